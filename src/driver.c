@@ -35,6 +35,8 @@
 
 #include <unistd.h>
 #include <fcntl.h>
+#include <stdio.h>
+#include <time.h>
 #include "xf86.h"
 #include "xf86_OSproc.h"
 #include "compiler.h"
@@ -125,12 +127,34 @@ typedef enum
     OPTION_SW_CURSOR,
     OPTION_DEVICE_PATH,
     OPTION_SHADOW_FB,
+    OPTION_ATOMIC,
+    OPTION_PER_CRTC_SCANOUT,
+    OPTION_BO_CACHE_SIZE,
+    OPTION_PREFAULT_BOS,
+    OPTION_TEAR_FREE,
+    OPTION_PAGEFLIP,
+    OPTION_ASYNC_FLIP,
+    OPTION_VARIABLE_REFRESH,
+    OPTION_SCALER_THREADS,
+    OPTION_PROBE_CACHE,
+    OPTION_STARTUP_PROFILE,
 } modesettingOpts;
 
 static const OptionInfoRec Options[] = {
     {OPTION_SW_CURSOR, "SWcursor", OPTV_BOOLEAN, {0}, FALSE},
     {OPTION_DEVICE_PATH, "kmsdev", OPTV_STRING, {0}, FALSE },
     {OPTION_SHADOW_FB, "ShadowFB", OPTV_BOOLEAN, {0}, FALSE },
+    {OPTION_ATOMIC, "Atomic", OPTV_BOOLEAN, {0}, FALSE },
+    {OPTION_PER_CRTC_SCANOUT, "PerCrtcScanout", OPTV_BOOLEAN, {0}, FALSE },
+    {OPTION_BO_CACHE_SIZE, "BOCacheSize", OPTV_INTEGER, {0}, FALSE },
+    {OPTION_PREFAULT_BOS, "PrefaultBOs", OPTV_BOOLEAN, {0}, FALSE },
+    {OPTION_TEAR_FREE, "TearFree", OPTV_BOOLEAN, {0}, FALSE },
+    {OPTION_PAGEFLIP, "PageFlip", OPTV_BOOLEAN, {0}, FALSE },
+    {OPTION_ASYNC_FLIP, "AsyncFlip", OPTV_BOOLEAN, {0}, FALSE },
+    {OPTION_VARIABLE_REFRESH, "VariableRefresh", OPTV_BOOLEAN, {0}, FALSE },
+    {OPTION_SCALER_THREADS, "ScalerThreads", OPTV_INTEGER, {0}, FALSE },
+    {OPTION_PROBE_CACHE, "ProbeCache", OPTV_STRING, {0}, FALSE },
+    {OPTION_STARTUP_PROFILE, "StartupProfile", OPTV_STRING, {0}, FALSE },
     {-1, NULL, OPTV_NONE, {0}, FALSE}
 };
 
@@ -176,6 +200,106 @@ Setup(pointer module, pointer opts, int *errmaj, int *errmin)
     }
 }
 
+static const char * const ms_startup_phase_names[MS_STARTUP__COUNT] = {
+    [MS_STARTUP_PROBE] = "probe",
+    [MS_STARTUP_OPEN] = "open",
+    [MS_STARTUP_DEFAULT_BPP] = "default_bpp",
+    [MS_STARTUP_OUTPUTS] = "outputs",
+    [MS_STARTUP_PRE_INIT] = "pre_init",
+    [MS_STARTUP_INITIAL_BOS] = "initial_bos",
+    [MS_STARTUP_SET_MODES] = "set_modes",
+    [MS_STARTUP_SCREEN_INIT] = "screen_init",
+    [MS_STARTUP_SCREEN_RESOURCES] = "screen_resources",
+};
+
+/* the probe runs before there are screens, PreInit takes a copy */
+static ms_startup_rec ms_probe_startup;
+
+static uint64_t
+ms_startup_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint64_t
+ms_startup_begin(ms_startup_rec *startup)
+{
+    uint64_t now = ms_startup_now();
+
+    if (!startup->start)
+        startup->start = now;
+    return now;
+}
+
+static void
+ms_startup_end(ms_startup_rec *startup, enum ms_startup_phase phase,
+               uint64_t begin)
+{
+    if (!startup->reported)
+        startup->phase_us[phase] += ms_startup_now() - begin;
+}
+
+/* one line in the log, and the same as JSON in path if there is one */
+static void
+ms_startup_report(ScrnInfoPtr scrn, ms_startup_rec *startup, const char *path)
+{
+    uint64_t first_flush = ms_startup_now() - startup->start;
+    char line[512];
+    int i, fd, len = 0;
+    FILE *f = NULL;
+
+    startup->reported = TRUE;
+
+    for (i = 0; i < MS_STARTUP__COUNT && len < (int)sizeof(line); i++)
+        len += snprintf(line + len, sizeof(line) - len, "%s=%.3fms ",
+                        ms_startup_phase_names[i],
+                        startup->phase_us[i] / 1000.0);
+    xf86DrvMsg(scrn->scrnIndex, X_INFO, "Startup: %sfirst_flush=%.3fms\n",
+               line, first_flush / 1000.0);
+
+    if (!path)
+        return;
+    /* we're root: don't follow a symlink someone left at path */
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC,
+              0644);
+    if (fd >= 0)
+        f = fdopen(fd, "w");
+    if (!f) {
+        xf86DrvMsg(scrn->scrnIndex, X_WARNING,
+                   "Couldn't write the startup profile %s: %s\n",
+                   path, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return;
+    }
+    fprintf(f, "{");
+    for (i = 0; i < MS_STARTUP__COUNT; i++)
+        fprintf(f, "\"%s_ms\": %.3f, ", ms_startup_phase_names[i],
+                startup->phase_us[i] / 1000.0);
+    fprintf(f, "\"first_flush_ms\": %.3f}\n", first_flush / 1000.0);
+    fclose(f);
+}
+
+/*
+ * A flush of the screen's contents has completed: a flip, a DirtyFB, or
+ * a block handler when the crtcs scan out what is drawn as it is.  The
+ * first one once the screen is up ends startup.
+ */
+void
+ms_startup_flushed(ScrnInfoPtr scrn)
+{
+    modesettingPtr ms = modesettingPTR(scrn);
+
+    if (!ms->startup.screen_up || ms->startup.reported)
+        return;
+
+    ms_startup_report(scrn, &ms->startup,
+                      xf86GetOptValString(ms->Options, OPTION_STARTUP_PROFILE));
+}
+
 static void
 Identify(int flags)
 {
@@ -317,8 +441,14 @@ ms_pci_probe(DriverPtr driver,
 	GDevPtr devSection = xf86GetDevFromEntity(scrn->entityList[0],
 						  scrn->entityInstanceList[0]);
 
+	uint64_t begin;
+	Bool found;
+
 	devpath = xf86FindOptionValue(devSection->options, "kmsdev");
-	if (probe_hw_pci(devpath, dev)) {
+	begin = ms_startup_begin(&ms_probe_startup);
+	found = probe_hw_pci(devpath, dev);
+	ms_startup_end(&ms_probe_startup, MS_STARTUP_PROBE, begin);
+	if (found) {
 	    scrn->driverVersion = 1;
 	    scrn->driverName = "modesetting";
 	    scrn->name = "modeset";
@@ -352,11 +482,16 @@ ms_platform_probe(DriverPtr driver,
     ScrnInfoPtr scrn = NULL;
     const char *path = xf86_get_platform_device_attrib(dev, ODEV_ATTRIB_PATH);
     int scr_flags = 0;
+    uint64_t begin;
+    Bool found;
 
     if (flags & PLATFORM_PROBE_GPU_SCREEN)
             scr_flags = XF86_ALLOCATE_GPU_SCREEN;
 
-    if (probe_hw(path, dev)) {
+    begin = ms_startup_begin(&ms_probe_startup);
+    found = probe_hw(path, dev);
+    ms_startup_end(&ms_probe_startup, MS_STARTUP_PROBE, begin);
+    if (found) {
         scrn = xf86AllocateScreen(driver, scr_flags);
         xf86AddEntityToScreen(scrn, entity_num);
 
@@ -401,8 +536,14 @@ Probe(DriverPtr drv, int flags)
 
     for (i = 0; i < numDevSections; i++) {
 
+	uint64_t begin;
+	Bool found;
+
 	dev = xf86FindOptionValue(devSections[i]->options,"kmsdev");
-	if (probe_hw(dev, NULL)) {
+	begin = ms_startup_begin(&ms_probe_startup);
+	found = probe_hw(dev, NULL);
+	ms_startup_end(&ms_probe_startup, MS_STARTUP_PROBE, begin);
+	if (found) {
 	    int entity;
 	    entity = xf86ClaimFbSlot(drv, 0, devSections[i], TRUE);
 	    scrn = xf86ConfigFbEntity(scrn, 0, entity,
@@ -470,10 +611,15 @@ static int dispatch_dirty_region(ScrnInfoPtr scrn,
 	    clip[i].y2 = rect->y2;
 	}
 
-	/* TODO query connector property to see if this is needed */
-	ret = drmModeDirtyFB(ms->fd, fb_id, clip, num_cliprects);
+	/* atomic planes may take the damage along with a plane update */
+	if (drmmode_damage_fb(&ms->drmmode, fb_id, dirty, 0, 0))
+	    ret = 0;
+	else
+	    ret = drmModeDirtyFB(ms->fd, fb_id, clip, num_cliprects);
 	free(clip);
 	DamageEmpty(damage);
+	/* taken by the kernel, or scanned out as it is anyway */
+	ms_startup_flushed(scrn);
 	if (ret) {
 	    if (ret == -EINVAL)
 		return ret;
@@ -537,6 +683,20 @@ static void dispatch_slave_dirty(ScreenPtr pScreen)
 }
 #endif
 
+static void dispatch_scanouts(ScreenPtr pScreen)
+{
+    ScrnInfoPtr scrn = xf86ScreenToScrn(pScreen);
+    modesettingPtr ms = modesettingPTR(scrn);
+    RegionPtr dirty = DamageRegion(ms->damage);
+
+    /* with TearFree, damage held back by a pending flip may be due now */
+    if (!RegionNotEmpty(dirty) && !ms->drmmode.tearfree)
+	return;
+
+    drmmode_update_scanouts(scrn, &ms->drmmode, dirty);
+    DamageEmpty(ms->damage);
+}
+
 static void msBlockHandler(BLOCKHANDLER_ARGS_DECL)
 {
     SCREEN_PTR(arg);
@@ -545,13 +705,28 @@ static void msBlockHandler(BLOCKHANDLER_ARGS_DECL)
     pScreen->BlockHandler = ms->BlockHandler;
     pScreen->BlockHandler(BLOCKHANDLER_ARGS);
     pScreen->BlockHandler = msBlockHandler;
+    /* the tiles of a monitor RandR just set come on together */
+    drmmode_flush_tile_modesets(&ms->drmmode);
+    /* as do the output properties clients set since the last time */
+    drmmode_flush_output_props(&ms->drmmode);
 #ifdef MODESETTING_OUTPUT_SLAVE_SUPPORT
     if (pScreen->isGPU)
         dispatch_slave_dirty(pScreen);
     else
 #endif
-    if (ms->dirty_enabled)
+    if (ms->drmmode.per_crtc_scanout) {
+	if (ms->damage)
+	    dispatch_scanouts(pScreen);
+    } else if (ms->dirty_enabled)
         dispatch_dirty(pScreen);
+    else
+        /* the crtcs scan out the front as it is, drawn is shown */
+        ms_startup_flushed(xf86ScreenToScrn(pScreen));
+
+#ifdef MODESETTING_PRESENT_SUPPORT
+    /* captures go out after the frame they capture */
+    drmmode_writeback_frame(&ms->drmmode);
+#endif
 }
 
 static void
@@ -607,6 +782,7 @@ PreInit(ScrnInfoPtr pScrn, int flags)
     int ret;
     int bppflags;
     int defaultdepth, defaultbpp;
+    uint64_t begin = ms_startup_begin(&ms_probe_startup), phase;
 
     if (pScrn->numEntities != 1)
 	return FALSE;
@@ -624,6 +800,7 @@ PreInit(ScrnInfoPtr pScrn, int flags)
     ms = modesettingPTR(pScrn);
     ms->SaveGeneration = -1;
     ms->pEnt = pEnt;
+    ms->startup = ms_probe_startup;
 
     pScrn->displayWidth = 640;	       /* default it */
 
@@ -647,6 +824,7 @@ PreInit(ScrnInfoPtr pScrn, int flags)
     pScrn->progClock = TRUE;
     pScrn->rgbBits = 8;
 
+    phase = ms_startup_begin(&ms->startup);
 #if XSERVER_PLATFORM_BUS
     if (pEnt->location.type == BUS_PLATFORM) {
 #ifdef XF86_PDEV_SERVER_FD
@@ -681,10 +859,12 @@ PreInit(ScrnInfoPtr pScrn, int flags)
         devicename = xf86FindOptionValue(ms->pEnt->device->options, "kmsdev");
         ms->fd = open_hw(devicename);
     }
+    ms_startup_end(&ms->startup, MS_STARTUP_OPEN, phase);
     if (ms->fd < 0)
 	return FALSE;
 
     ms->drmmode.fd = ms->fd;
+    dumb_bo_pool_init(&ms->drmmode.bo_pool, ms->fd);
 
 #ifdef MODESETTING_OUTPUT_SLAVE_SUPPORT
     pScrn->capabilities = 0;
@@ -696,7 +876,13 @@ PreInit(ScrnInfoPtr pScrn, int flags)
     }
 #endif
 #endif
+    /* needed before the options are processed, like kmsdev */
+    ms->drmmode.probe_cache.path =
+        xf86FindOptionValue(ms->pEnt->device->options, "ProbeCache");
+    phase = ms_startup_begin(&ms->startup);
+    drmmode_probe_cache_load(pScrn, &ms->drmmode);
     drmmode_get_default_bpp(pScrn, &ms->drmmode, &defaultdepth, &defaultbpp);
+    ms_startup_end(&ms->startup, MS_STARTUP_DEFAULT_BPP, phase);
     if (defaultdepth == 24 && defaultbpp == 24)
 	    bppflags = SupportConvert32to24 | Support24bppFb;
     else
@@ -735,6 +921,18 @@ PreInit(ScrnInfoPtr pScrn, int flags)
 	ms->drmmode.sw_cursor = TRUE;
     }
 
+    {
+	int cache_kb;
+
+	if (xf86GetOptValInteger(ms->Options, OPTION_BO_CACHE_SIZE, &cache_kb))
+	    ms->drmmode.bo_pool.max_idle_bytes = (size_t)max(cache_kb, 0) << 10;
+	ms->drmmode.bo_pool.prefault =
+	    xf86ReturnOptValBool(ms->Options, OPTION_PREFAULT_BOS, FALSE);
+	/* the bpp probe may already have parked a bo */
+	dumb_bo_pool_trim(&ms->drmmode.bo_pool,
+			  ms->drmmode.bo_pool.max_idle_bytes);
+    }
+
     ret = drmGetCap(ms->fd, DRM_CAP_DUMB_PREFER_SHADOW, &value);
     if (!ret) {
 	prefer_shadow = !!value;
@@ -753,11 +951,64 @@ PreInit(ScrnInfoPtr pScrn, int flags)
 
     ms->drmmode.shadow_enable = xf86ReturnOptValBool(ms->Options, OPTION_SHADOW_FB, prefer_shadow);
 
+    if (xf86ReturnOptValBool(ms->Options, OPTION_ATOMIC, FALSE)) {
+	ret = drmSetClientCap(ms->fd, DRM_CLIENT_CAP_ATOMIC, 1);
+	ms->drmmode.atomic_modeset = (ret == 0);
+    }
+    xf86DrvMsg(pScrn->scrnIndex, X_INFO, "Atomic modesetting: %s\n",
+	       ms->drmmode.atomic_modeset ? "enabled" : "disabled");
+
+    /* per-crtc scanout bos are filled from the shadow, so it needs one */
+    ms->drmmode.per_crtc_scanout =
+	xf86ReturnOptValBool(ms->Options, OPTION_PER_CRTC_SCANOUT, FALSE);
+    /* TearFree flips between two of those per crtc */
+    ms->drmmode.tearfree =
+	xf86ReturnOptValBool(ms->Options, OPTION_TEAR_FREE, FALSE);
+    if (ms->drmmode.tearfree)
+	ms->drmmode.per_crtc_scanout = TRUE;
+    if (ms->drmmode.per_crtc_scanout)
+	ms->drmmode.shadow_enable = TRUE;
+
     xf86DrvMsg(pScrn->scrnIndex, X_INFO, "ShadowFB: preferred %s, enabled %s\n", prefer_shadow ? "YES" : "NO", ms->drmmode.shadow_enable ? "YES" : "NO");
+    if (ms->drmmode.per_crtc_scanout)
+	xf86DrvMsg(pScrn->scrnIndex, X_INFO, "Using per-CRTC scanout buffers\n");
+    xf86DrvMsg(pScrn->scrnIndex, X_INFO, "TearFree: %s\n",
+	       ms->drmmode.tearfree ? "enabled" : "disabled");
+    /* scaling transforms the planes can't do happens on the way into those */
+    if (ms->drmmode.per_crtc_scanout) {
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	int threads = ncpu > 4 ? 4 : ncpu > 0 ? ncpu : 1;
+
+	xf86GetOptValInteger(ms->Options, OPTION_SCALER_THREADS, &threads);
+	ms->drmmode.scaler_threads = threads > 0 ? threads : 0;
+	if (ms->drmmode.scaler_threads)
+	    xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+		       "Software scaler: %d threads\n",
+		       ms->drmmode.scaler_threads);
+	else
+	    xf86DrvMsg(pScrn->scrnIndex, X_INFO, "Software scaler: disabled\n");
+    }
+#ifdef MODESETTING_PRESENT_SUPPORT
+    ms->drmmode.pageflip =
+	xf86ReturnOptValBool(ms->Options, OPTION_PAGEFLIP, TRUE);
+    ms->drmmode.vrr_support =
+	xf86ReturnOptValBool(ms->Options, OPTION_VARIABLE_REFRESH, FALSE);
+#endif
+
+    ret = drmGetCap(ms->fd, DRM_CAP_ASYNC_PAGE_FLIP, &value);
+    ms->drmmode.async_flip_cap = (ret == 0 && value);
+    if (xf86ReturnOptValBool(ms->Options, OPTION_ASYNC_FLIP, FALSE)) {
+	ms->drmmode.async_flip = ms->drmmode.async_flip_cap;
+	xf86DrvMsg(pScrn->scrnIndex, X_CONFIG, "Async page flips: %s\n",
+		   ms->drmmode.async_flip ? "enabled" :
+		   "not supported by the kernel, flipping on vblank");
+    }
+    phase = ms_startup_begin(&ms->startup);
     if (drmmode_pre_init(pScrn, &ms->drmmode, pScrn->bitsPerPixel / 8) == FALSE) {
 	xf86DrvMsg(pScrn->scrnIndex, X_ERROR, "KMS setup failed\n");
 	goto fail;
     }
+    ms_startup_end(&ms->startup, MS_STARTUP_OUTPUTS, phase);
 
     /*
      * If the driver can do gamma correction, it should call xf86SetGamma() here.
@@ -785,12 +1036,13 @@ PreInit(ScrnInfoPtr pScrn, int flags)
 	return FALSE;
     }
 
-    if (ms->drmmode.shadow_enable) {
+    if (ms->drmmode.shadow_enable && !ms->drmmode.per_crtc_scanout) {
 	if (!xf86LoadSubModule(pScrn, "shadow")) {
 	    return FALSE;
 	}
     }
 
+    ms_startup_end(&ms->startup, MS_STARTUP_PRE_INIT, begin);
     return TRUE;
     fail:
     return FALSE;
@@ -824,18 +1076,24 @@ CreateScreenResources(ScreenPtr pScreen)
     PixmapPtr rootPixmap;
     Bool ret;
     void *pixels;
+    uint64_t begin = ms_startup_begin(&ms->startup), phase;
     pScreen->CreateScreenResources = ms->createScreenResources;
     ret = pScreen->CreateScreenResources(pScreen);
     pScreen->CreateScreenResources = CreateScreenResources;
 
+    phase = ms_startup_begin(&ms->startup);
     if (!drmmode_set_desired_modes(pScrn, &ms->drmmode))
       return FALSE;
+    ms_startup_end(&ms->startup, MS_STARTUP_SET_MODES, phase);
 
     drmmode_uevent_init(pScrn, &ms->drmmode);
 
     if (!ms->drmmode.sw_cursor)
         drmmode_map_cursor_bos(pScrn, &ms->drmmode);
-    pixels = drmmode_map_front_bo(&ms->drmmode);
+    if (ms->drmmode.per_crtc_scanout)
+	pixels = ms->drmmode.shadow_fb;
+    else
+	pixels = drmmode_map_front_bo(&ms->drmmode);
     if (!pixels)
 	return FALSE;
 
@@ -847,7 +1105,7 @@ CreateScreenResources(ScreenPtr pScreen)
     if (!pScreen->ModifyPixmapHeader(rootPixmap, -1, -1, -1, -1, -1, pixels))
 	FatalError("Couldn't adjust screen pixmap\n");
 
-    if (ms->drmmode.shadow_enable) {
+    if (ms->drmmode.shadow_enable && !ms->drmmode.per_crtc_scanout) {
 	if (!shadowAdd(pScreen, rootPixmap, msUpdatePacked,
 		       msShadowWindow, 0, 0))
 	    return FALSE;
@@ -865,6 +1123,8 @@ CreateScreenResources(ScreenPtr pScreen)
 		   "Failed to create screen damage record\n");
 	return FALSE;
     }
+    ms_startup_end(&ms->startup, MS_STARTUP_SCREEN_RESOURCES, begin);
+    ms->startup.screen_up = TRUE;
     return ret;
 }
 
@@ -922,6 +1182,8 @@ ScreenInit(SCREEN_INIT_ARGS_DECL)
     ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
     modesettingPtr ms = modesettingPTR(pScrn);
     VisualPtr visual;
+    uint64_t begin = ms_startup_begin(&ms->startup), phase;
+    Bool ret;
 
     pScrn->pScreen = pScreen;
 
@@ -930,14 +1192,22 @@ ScreenInit(SCREEN_INIT_ARGS_DECL)
 
     /* HW dependent - FIXME */
     pScrn->displayWidth = pScrn->virtualX;
+    phase = ms_startup_begin(&ms->startup);
     if (!drmmode_create_initial_bos(pScrn, &ms->drmmode))
 	return FALSE;
+    ms_startup_end(&ms->startup, MS_STARTUP_INITIAL_BOS, phase);
 
     if (ms->drmmode.shadow_enable) {
-	ms->drmmode.shadow_fb = calloc(1, pScrn->displayWidth * pScrn->virtualY *
-			       ((pScrn->bitsPerPixel + 7) >> 3));
-	if (!ms->drmmode.shadow_fb)
+	int pitch = ms->drmmode.front_bo ? ms->drmmode.front_bo->pitch :
+	    pScrn->displayWidth * ((pScrn->bitsPerPixel + 7) >> 3);
+
+	/* sized like the front bo, so resizes within it can keep the shadow */
+	ms->drmmode.shadow_fb = calloc(1, pitch * ms->drmmode.front_height);
+	if (!ms->drmmode.shadow_fb) {
+	    if (ms->drmmode.per_crtc_scanout)
+		return FALSE;
 	    ms->drmmode.shadow_enable = FALSE;
+	}
     }	
     
     miClearVisualTypes();
@@ -983,7 +1253,8 @@ ScreenInit(SCREEN_INIT_ARGS_DECL)
 
     fbPictureInit(pScreen, NULL, 0);
 
-    if (ms->drmmode.shadow_enable && !msShadowInit(pScreen)) {
+    if (ms->drmmode.shadow_enable && !ms->drmmode.per_crtc_scanout &&
+	!msShadowInit(pScreen)) {
 	xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
 		   "shadow fb init failed\n");
 	return FALSE;
@@ -1022,6 +1293,15 @@ ScreenInit(SCREEN_INIT_ARGS_DECL)
     if (!xf86CrtcScreenInit(pScreen))
 	return FALSE;
 
+    if (!ms_vblank_screen_init(pScreen))
+	return FALSE;
+
+#ifdef MODESETTING_PRESENT_SUPPORT
+    if (!ms_present_screen_init(pScreen))
+	xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+		   "Failed to initialize the Present extension.\n");
+#endif
+
     if (!miCreateDefColormap(pScreen))
 	return FALSE;
 
@@ -1030,7 +1310,9 @@ ScreenInit(SCREEN_INIT_ARGS_DECL)
     if (serverGeneration == 1)
 	xf86ShowUnusedOptions(pScrn->scrnIndex, pScrn->options);
 
-    return EnterVT(VT_FUNC_ARGS);
+    ret = EnterVT(VT_FUNC_ARGS);
+    ms_startup_end(&ms->startup, MS_STARTUP_SCREEN_INIT, begin);
+    return ret;
 }
 
 static void
@@ -1054,10 +1336,20 @@ LeaveVT(VT_FUNC_ARGS_DECL)
 {
     SCRN_INFO_PTR(arg);
     modesettingPtr ms = modesettingPTR(pScrn);
+    xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(pScrn);
+    int c;
+
     xf86_hide_cursors(pScrn);
 
+    /* whoever gets the VT next expects a fixed refresh */
+    for (c = 0; c < xf86_config->num_crtc; c++)
+	drmmode_crtc_set_vrr(xf86_config->crtc[c], FALSE);
+
     pScrn->vtSema = FALSE;
 
+    /* monitors may come and go while we're away without us hearing */
+    drmmode_force_probe(pScrn);
+
 #ifdef XF86_PDEV_SERVER_FD
     if (ms->pEnt->location.type == BUS_PLATFORM &&
             (ms->pEnt->location.id.plat->flags & XF86_PDEV_SERVER_FD))
@@ -1075,6 +1367,7 @@ EnterVT(VT_FUNC_ARGS_DECL)
 {
     SCRN_INFO_PTR(arg);
     modesettingPtr ms = modesettingPTR(pScrn);
+    uint64_t begin = ms_startup_begin(&ms->startup);
 
     pScrn->vtSema = TRUE;
 
@@ -1082,6 +1375,7 @@ EnterVT(VT_FUNC_ARGS_DECL)
 
     if (!drmmode_set_desired_modes(pScrn, &ms->drmmode))
 	return FALSE;
+    ms_startup_end(&ms->startup, MS_STARTUP_SET_MODES, begin);
 
     return TRUE;
 }
@@ -1106,15 +1400,27 @@ CloseScreen(CLOSE_SCREEN_ARGS_DECL)
 	ms->damage = NULL;
     }
 
+#ifdef MODESETTING_PRESENT_SUPPORT
+    /* the capture pixmaps go back while the pixmap hooks are still ours */
+    drmmode_writeback_fini(&ms->drmmode);
+#endif
+
     if (ms->drmmode.shadow_enable) {
-	shadowRemove(pScreen, pScreen->GetScreenPixmap(pScreen));
+	if (!ms->drmmode.per_crtc_scanout)
+	    shadowRemove(pScreen, pScreen->GetScreenPixmap(pScreen));
 	free(ms->drmmode.shadow_fb);
 	ms->drmmode.shadow_fb = NULL;
     }
     drmmode_uevent_fini(pScrn, &ms->drmmode);
 
+#ifdef MODESETTING_PRESENT_SUPPORT
+    ms_present_close_screen(pScreen);
+#endif
+
     drmmode_free_bos(pScrn, &ms->drmmode);
 
+    ms_vblank_close_screen(pScreen);
+
     if (pScrn->vtSema) {
         LeaveVT(VT_FUNC_ARGS);
     }
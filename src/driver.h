@@ -43,6 +43,34 @@ typedef struct
     ScrnInfoPtr pScrn_2;
 } EntRec, *EntPtr;
 
+/*
+ * Where startup goes, from the first probe to the first completed flush
+ * of the screen's contents, reported once per screen.  The phases nest:
+ * pre_init includes open, default_bpp and outputs, screen_init includes
+ * initial_bos and, like screen_resources, set_modes.  The probe covers
+ * every device the driver probed.
+ */
+enum ms_startup_phase {
+    MS_STARTUP_PROBE,
+    MS_STARTUP_OPEN,
+    MS_STARTUP_DEFAULT_BPP,
+    MS_STARTUP_OUTPUTS,
+    MS_STARTUP_PRE_INIT,
+    MS_STARTUP_INITIAL_BOS,
+    MS_STARTUP_SET_MODES,
+    MS_STARTUP_SCREEN_INIT,
+    MS_STARTUP_SCREEN_RESOURCES,
+    MS_STARTUP__COUNT
+};
+
+typedef struct {
+    uint64_t start;
+    uint64_t phase_us[MS_STARTUP__COUNT];
+    /* CreateScreenResources is done, the next flush is the first */
+    Bool screen_up;
+    Bool reported;
+} ms_startup_rec;
+
 typedef struct _modesettingRec
 {
     int fd;
@@ -76,6 +104,46 @@ typedef struct _modesettingRec
     Bool dirty_enabled;
 
     uint32_t cursor_width, cursor_height;
+
+    pointer drm_event_handler;
+
+    CreatePixmapProcPtr CreatePixmap;
+    DestroyPixmapProcPtr DestroyPixmap;
+
+    ms_startup_rec startup;
+
+#ifdef MODESETTING_PRESENT_SUPPORT
+    /* this screen's copy: the capabilities differ between devices */
+    struct present_screen_info *present_info;
+#endif
 } modesettingRec, *modesettingPtr;
 
 #define modesettingPTR(p) ((modesettingPtr)((p)->driverPrivate))
+
+typedef void (*ms_drm_handler_proc)(uint64_t frame, uint64_t usec, void *data);
+typedef void (*ms_drm_abort_proc)(void *data);
+
+uint32_t ms_drm_queue_alloc(xf86CrtcPtr crtc, void *data,
+			    ms_drm_handler_proc handler,
+			    ms_drm_abort_proc abort);
+void ms_drm_abort(ScrnInfoPtr scrn, ms_drm_handler_proc handler,
+		  Bool (*match)(void *data, void *match_data),
+		  void *match_data);
+void ms_drm_abort_seq(ScrnInfoPtr scrn, uint32_t seq);
+int ms_flush_drm_events(ScreenPtr screen);
+
+uint32_t ms_crtc_vblank_pipe(int crtc_index);
+xf86CrtcPtr ms_covering_crtc(ScrnInfoPtr scrn, BoxPtr box);
+int ms_get_crtc_ust_msc(xf86CrtcPtr crtc, CARD64 *ust, CARD64 *msc);
+uint32_t ms_crtc_msc_to_kernel_msc(xf86CrtcPtr crtc, uint64_t expect);
+uint64_t ms_kernel_msc_to_crtc_msc(xf86CrtcPtr crtc, uint32_t sequence);
+
+void ms_startup_flushed(ScrnInfoPtr scrn);
+
+Bool ms_vblank_screen_init(ScreenPtr screen);
+void ms_vblank_close_screen(ScreenPtr screen);
+
+#ifdef MODESETTING_PRESENT_SUPPORT
+Bool ms_present_screen_init(ScreenPtr screen);
+void ms_present_close_screen(ScreenPtr screen);
+#endif
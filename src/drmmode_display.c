@@ -30,17 +30,24 @@
 #endif
 
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include "xf86str.h"
 #include "X11/Xatom.h"
 #include "micmap.h"
 #include "xf86cmap.h"
 #include "xf86DDC.h"
+#include "dixstruct.h"
 
 #include <xf86drm.h>
+#include <drm_fourcc.h>
 #include "xf86Crtc.h"
+#include "xf86RandR12.h"
 #include "drmmode_display.h"
 
 #include <cursorstr.h>
@@ -55,250 +62,1777 @@
 #include "compat-api.h"
 
 #include "driver.h"
+#include "probe.h"
+#include "scaler.h"
 
-static struct dumb_bo *dumb_bo_create(int fd,
-			  const unsigned width, const unsigned height,
-			  const unsigned bpp)
+#ifdef MODESETTING_OUTPUT_SLAVE_SUPPORT
+Bool drmmode_SetSlaveBO(PixmapPtr ppix,
+			drmmode_ptr drmmode, 
+			int fd_handle, int pitch, int size)
 {
-	struct drm_mode_create_dumb arg;
-	struct dumb_bo *bo;
+    	msPixmapPrivPtr ppriv = msGetPixmapPriv(drmmode, ppix);
+
+	ppriv->backing_bo = dumb_get_bo_from_handle(drmmode->fd, fd_handle, pitch, size);
+	if (!ppriv->backing_bo)
+		return FALSE;
+
+	close(fd_handle);
+	return TRUE;
+}
+#endif
+
+static void
+drmmode_ConvertFromKMode(ScrnInfoPtr	scrn,
+		     drmModeModeInfo *kmode,
+		     DisplayModePtr	mode,
+		     char		*name)
+{
+	memset(mode, 0, sizeof(DisplayModeRec));
+	mode->status = MODE_OK;
+
+	mode->Clock = kmode->clock;
+
+	mode->HDisplay = kmode->hdisplay;
+	mode->HSyncStart = kmode->hsync_start;
+	mode->HSyncEnd = kmode->hsync_end;
+	mode->HTotal = kmode->htotal;
+	mode->HSkew = kmode->hskew;
+
+	mode->VDisplay = kmode->vdisplay;
+	mode->VSyncStart = kmode->vsync_start;
+	mode->VSyncEnd = kmode->vsync_end;
+	mode->VTotal = kmode->vtotal;
+	mode->VScan = kmode->vscan;
+
+	mode->Flags = kmode->flags; //& FLAG_BITS;
+	mode->name = name;
+
+	if (kmode->type & DRM_MODE_TYPE_DRIVER)
+		mode->type = M_T_DRIVER;
+	if (kmode->type & DRM_MODE_TYPE_PREFERRED)
+		mode->type |= M_T_PREFERRED;
+	xf86SetModeCrtc (mode, scrn->adjustFlags);
+}
+
+static void
+drmmode_ConvertToKMode(ScrnInfoPtr	scrn,
+		     drmModeModeInfo *kmode,
+		     DisplayModePtr	mode)
+{
+	memset(kmode, 0, sizeof(*kmode));
+
+	kmode->clock = mode->Clock;
+	kmode->hdisplay = mode->HDisplay;
+	kmode->hsync_start = mode->HSyncStart;
+	kmode->hsync_end = mode->HSyncEnd;
+	kmode->htotal = mode->HTotal;
+	kmode->hskew = mode->HSkew;
+
+	kmode->vdisplay = mode->VDisplay;
+	kmode->vsync_start = mode->VSyncStart;
+	kmode->vsync_end = mode->VSyncEnd;
+	kmode->vtotal = mode->VTotal;
+	kmode->vscan = mode->VScan;
+
+	kmode->flags = mode->Flags; //& FLAG_BITS;
+	if (mode->name)
+		strncpy(kmode->name, mode->name, DRM_DISPLAY_MODE_LEN);
+	kmode->name[DRM_DISPLAY_MODE_LEN-1] = 0;
+
+}
+
+/* copy the top-left width x height pixels between two buffers */
+static void
+drmmode_copy_area(void *dst, int dst_pitch, const void *src, int src_pitch,
+		  int width, int height, int cpp)
+{
+	int y;
+
+	for (y = 0; y < height; y++)
+		memcpy((uint8_t *)dst + y * dst_pitch,
+		       (const uint8_t *)src + y * src_pitch, width * cpp);
+}
+
+/* look up the ids (and optionally current values) of named KMS properties */
+static Bool
+drmmode_prop_info_init(int fd, uint32_t obj_id, uint32_t obj_type,
+		       const char * const *names, uint32_t *ids,
+		       uint64_t *values, int count)
+{
+	drmModeObjectPropertiesPtr props;
+	int i, j;
+
+	memset(ids, 0, count * sizeof(*ids));
+	props = drmModeObjectGetProperties(fd, obj_id, obj_type);
+	if (!props)
+		return FALSE;
+
+	for (i = 0; i < props->count_props; i++) {
+		drmModePropertyPtr prop = drmModeGetProperty(fd, props->props[i]);
+
+		if (!prop)
+			continue;
+		for (j = 0; j < count; j++) {
+			if (!strcmp(prop->name, names[j])) {
+				ids[j] = prop->prop_id;
+				if (values)
+					values[j] = props->prop_values[i];
+				break;
+			}
+		}
+		drmModeFreeProperty(prop);
+	}
+	drmModeFreeObjectProperties(props);
+	return TRUE;
+}
+
+static const char * const plane_prop_names[DRMMODE_PLANE__COUNT] = {
+	[DRMMODE_PLANE_TYPE] = "type",
+	[DRMMODE_PLANE_FB_ID] = "FB_ID",
+	[DRMMODE_PLANE_CRTC_ID] = "CRTC_ID",
+	[DRMMODE_PLANE_SRC_X] = "SRC_X",
+	[DRMMODE_PLANE_SRC_Y] = "SRC_Y",
+	[DRMMODE_PLANE_SRC_W] = "SRC_W",
+	[DRMMODE_PLANE_SRC_H] = "SRC_H",
+	[DRMMODE_PLANE_CRTC_X] = "CRTC_X",
+	[DRMMODE_PLANE_CRTC_Y] = "CRTC_Y",
+	[DRMMODE_PLANE_CRTC_W] = "CRTC_W",
+	[DRMMODE_PLANE_CRTC_H] = "CRTC_H",
+	[DRMMODE_PLANE_FB_DAMAGE_CLIPS] = "FB_DAMAGE_CLIPS",
+};
+
+/* has one of the crtcs set up before this one taken plane_id already? */
+static Bool
+drmmode_plane_claimed(drmmode_ptr drmmode, uint32_t plane_id)
+{
+	xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(drmmode->scrn);
+	int c;
+
+	for (c = 0; c < xf86_config->num_crtc; c++) {
+		drmmode_crtc_private_ptr drmmode_crtc =
+			xf86_config->crtc[c]->driver_private;
+
+		if (drmmode_crtc && drmmode_crtc->plane_id == plane_id)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/*
+ * Find the primary plane driving this crtc, needs universal planes.  A
+ * primary plane may list several crtcs: take the one already on this
+ * crtc, else a free one, and never one some other crtc is using.
+ */
+static void
+drmmode_crtc_init_plane(drmmode_ptr drmmode,
+			drmmode_crtc_private_ptr drmmode_crtc, int num)
+{
+	uint32_t crtc_id = drmmode_crtc->mode_crtc->crtc_id;
+	drmModePlaneResPtr plane_res;
+	uint32_t best_ids[DRMMODE_PLANE__COUNT];
+	int i, best = 0;
+
+	if (!drmmode->universal_planes)
+		return;
+
+	plane_res = drmModeGetPlaneResources(drmmode->fd);
+	if (!plane_res)
+		return;
+
+	for (i = 0; i < plane_res->count_planes && best < 2; i++) {
+		drmModePlanePtr plane;
+		uint32_t ids[DRMMODE_PLANE__COUNT];
+		uint64_t values[DRMMODE_PLANE__COUNT];
+		int score;
+
+		plane = drmModeGetPlane(drmmode->fd, plane_res->planes[i]);
+		if (!plane)
+			continue;
+
+		if (plane->crtc_id == crtc_id)
+			score = 2;
+		else if (!plane->crtc_id &&
+			 !drmmode_plane_claimed(drmmode, plane->plane_id))
+			score = 1;
+		else
+			score = 0;
+
+		if (score > best && (plane->possible_crtcs & (1 << num)) &&
+		    drmmode_prop_info_init(drmmode->fd, plane->plane_id,
+					   DRM_MODE_OBJECT_PLANE,
+					   plane_prop_names, ids, values,
+					   DRMMODE_PLANE__COUNT) &&
+		    ids[DRMMODE_PLANE_TYPE] &&
+		    values[DRMMODE_PLANE_TYPE] == DRM_PLANE_TYPE_PRIMARY) {
+			best = score;
+			drmmode_crtc->plane_id = plane->plane_id;
+			memcpy(best_ids, ids, sizeof(ids));
+		}
+		drmModeFreePlane(plane);
+	}
+	drmModeFreePlaneResources(plane_res);
+
+	if (best)
+		memcpy(drmmode_crtc->plane_props, best_ids, sizeof(best_ids));
+}
+
+/* add a full primary plane update to an atomic request, coords in pixels */
+static int
+drmmode_plane_add_props(drmModeAtomicReqPtr req,
+			drmmode_crtc_private_ptr drmmode_crtc, uint32_t fb_id,
+			int src_x, int src_y, int src_w, int src_h,
+			int crtc_w, int crtc_h)
+{
+	uint32_t plane_id = drmmode_crtc->plane_id;
+	uint32_t *props = drmmode_crtc->plane_props;
+	int ret = 0;
+
+	ret |= drmModeAtomicAddProperty(req, plane_id, props[DRMMODE_PLANE_FB_ID],
+					fb_id) <= 0;
+	ret |= drmModeAtomicAddProperty(req, plane_id, props[DRMMODE_PLANE_CRTC_ID],
+					drmmode_crtc->mode_crtc->crtc_id) <= 0;
+	ret |= drmModeAtomicAddProperty(req, plane_id, props[DRMMODE_PLANE_SRC_X],
+					(uint64_t)src_x << 16) <= 0;
+	ret |= drmModeAtomicAddProperty(req, plane_id, props[DRMMODE_PLANE_SRC_Y],
+					(uint64_t)src_y << 16) <= 0;
+	ret |= drmModeAtomicAddProperty(req, plane_id, props[DRMMODE_PLANE_SRC_W],
+					(uint64_t)src_w << 16) <= 0;
+	ret |= drmModeAtomicAddProperty(req, plane_id, props[DRMMODE_PLANE_SRC_H],
+					(uint64_t)src_h << 16) <= 0;
+	ret |= drmModeAtomicAddProperty(req, plane_id, props[DRMMODE_PLANE_CRTC_X],
+					0) <= 0;
+	ret |= drmModeAtomicAddProperty(req, plane_id, props[DRMMODE_PLANE_CRTC_Y],
+					0) <= 0;
+	ret |= drmModeAtomicAddProperty(req, plane_id, props[DRMMODE_PLANE_CRTC_W],
+					crtc_w) <= 0;
+	ret |= drmModeAtomicAddProperty(req, plane_id, props[DRMMODE_PLANE_CRTC_H],
+					crtc_h) <= 0;
+
+	return ret ? -EINVAL : 0;
+}
+
+/*
+ * Point the primary plane at (x, y) of fb_id without touching the mode,
+ * and wait for it.  Legacy SetPlane isn't synchronised to vblank on most
+ * drivers; panning goes through drmmode_crtc_pan_commit() instead.
+ */
+static Bool
+drmmode_crtc_set_plane_fb(xf86CrtcPtr crtc, uint32_t fb_id, int x, int y)
+{
+	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+	drmmode_ptr drmmode = drmmode_crtc->drmmode;
+	int w = crtc->mode.HDisplay;
+	int h = crtc->mode.VDisplay;
 	int ret;
 
-	bo = calloc(1, sizeof(*bo));
-	if (!bo)
+	if (!drmmode_crtc->plane_id)
+		return FALSE;
+	/* this is newer than any pan still waiting */
+	drmmode_crtc->pan_pending = FALSE;
+
+	if (drmmode->atomic_modeset) {
+		drmModeAtomicReqPtr req = drmModeAtomicAlloc();
+
+		if (!req)
+			return FALSE;
+		ret = drmmode_plane_add_props(req, drmmode_crtc, fb_id,
+					      x, y, w, h, w, h);
+		if (ret == 0)
+			ret = drmModeAtomicCommit(drmmode->fd, req, 0, NULL);
+		drmModeAtomicFree(req);
+	} else
+		ret = drmModeSetPlane(drmmode->fd, drmmode_crtc->plane_id,
+				      drmmode_crtc->mode_crtc->crtc_id, fb_id, 0,
+				      0, 0, w, h,
+				      x << 16, y << 16, w << 16, h << 16);
+	if (ret)
+		return FALSE;
+
+	drmmode_crtc->shown_fb_id = fb_id;
+	drmmode_crtc->shown_x = x;
+	drmmode_crtc->shown_y = y;
+	drmmode_crtc->shown_w = w;
+	drmmode_crtc->shown_h = h;
+	return TRUE;
+}
+
+/*
+ * Is the crtc's RandR transform a plain scale of a src_w x src_h part of
+ * the screen to the whole mode?
+ */
+static Bool
+drmmode_crtc_transform_is_scale(xf86CrtcPtr crtc, int *src_w, int *src_h)
+{
+	struct pixman_f_transform *t = &crtc->transform.f_transform;
+
+	if (!crtc->transformPresent || crtc->rotation != RR_Rotate_0)
+		return FALSE;
+#ifdef MODESETTING_OUTPUT_SLAVE_SUPPORT
+	if (crtc->randr_crtc && crtc->randr_crtc->scanout_pixmap)
+		return FALSE;
+#endif
+
+	if (t->m[0][1] != 0 || t->m[1][0] != 0 ||
+	    t->m[0][2] != 0 || t->m[1][2] != 0 ||
+	    t->m[2][0] != 0 || t->m[2][1] != 0 || t->m[2][2] != 1 ||
+	    t->m[0][0] <= 0 || t->m[1][1] <= 0)
+		return FALSE;
+
+	*src_w = (int)(crtc->mode.HDisplay * t->m[0][0] + 0.5);
+	*src_h = (int)(crtc->mode.VDisplay * t->m[1][1] + 0.5);
+	return *src_w > 0 && *src_h > 0;
+}
+
+/*
+ * Is the crtc's RandR transform a plain scale, which the primary plane
+ * could do by sampling a src_w x src_h rectangle of the front at x, y?
+ */
+static Bool
+drmmode_crtc_scale_transform(xf86CrtcPtr crtc, int x, int y,
+			     int *src_w, int *src_h)
+{
+	ScrnInfoPtr scrn = crtc->scrn;
+	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+	drmmode_ptr drmmode = drmmode_crtc->drmmode;
+
+	if (!drmmode->atomic_modeset || !drmmode_crtc->plane_id ||
+	    !drmmode->fb_id || drmmode->per_crtc_scanout ||
+	    !drmmode_crtc_transform_is_scale(crtc, src_w, src_h))
+		return FALSE;
+
+	return x >= 0 && y >= 0 &&
+		x + *src_w <= scrn->virtualX && y + *src_h <= scrn->virtualY;
+}
+
+/*
+ * Or can the driver's own scaler do it, stretching src_w x src_h of the
+ * shadow at x, y into the crtc's scanout bos?
+ */
+static Bool
+drmmode_crtc_sw_scale_transform(xf86CrtcPtr crtc, int x, int y,
+				int *src_w, int *src_h)
+{
+	ScrnInfoPtr scrn = crtc->scrn;
+	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+	drmmode_ptr drmmode = drmmode_crtc->drmmode;
+
+	if (!drmmode->per_crtc_scanout || drmmode->scaler_threads <= 0 ||
+	    scrn->bitsPerPixel != 32 ||
+	    !drmmode_crtc_transform_is_scale(crtc, src_w, src_h))
+		return FALSE;
+
+	return x >= 0 && y >= 0 &&
+		x + *src_w <= scrn->virtualX && y + *src_h <= scrn->virtualY;
+}
+
+/*
+ * xf86CrtcRotate was told there is no transform, so set up what the rest
+ * of the server looks at by hand.  transform_in_use stays off: there is
+ * no rotation shadow to redisplay into.
+ */
+static void
+drmmode_crtc_set_scaled_transform(xf86CrtcPtr crtc, int x, int y,
+				  int src_w, int src_h)
+{
+	RRTransformCompute(x, y, crtc->mode.HDisplay, crtc->mode.VDisplay,
+			   crtc->rotation, &crtc->transform,
+			   &crtc->crtc_to_framebuffer,
+			   &crtc->f_crtc_to_framebuffer,
+			   &crtc->f_framebuffer_to_crtc);
+	crtc->bounds.x1 = x;
+	crtc->bounds.y1 = y;
+	crtc->bounds.x2 = x + src_w;
+	crtc->bounds.y2 = y + src_h;
+}
+
+/* the size of the part of the screen the crtc shows, before any scaling */
+static void
+drmmode_crtc_source_size(xf86CrtcPtr crtc, int *w, int *h)
+{
+	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+
+	if (drmmode_crtc->plane_scaled) {
+		*w = drmmode_crtc->shown_w;
+		*h = drmmode_crtc->shown_h;
+	} else if (drmmode_crtc->scaler)
+		ms_scaler_src_size(drmmode_crtc->scaler, w, h);
+	else {
+		*w = crtc->mode.HDisplay;
+		*h = crtc->mode.VDisplay;
+	}
+}
+
+static const char * const crtc_modeset_prop_names[] = { "MODE_ID", "ACTIVE" };
+static const char * const connector_crtc_prop_name[] = { "CRTC_ID" };
+
+/*
+ * Add a full modeset of crtc to req: kmode on the given connectors, with
+ * the primary plane showing src_w x src_h of fb_id at x, y.
+ */
+static int
+drmmode_crtc_add_modeset(drmModeAtomicReqPtr req, xf86CrtcPtr crtc,
+			 const drmModeModeInfo *kmode,
+			 const uint32_t *connector_ids, int num_connectors,
+			 uint32_t fb_id, int x, int y, int src_w, int src_h,
+			 uint32_t *mode_blob)
+{
+	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+	drmmode_ptr drmmode = drmmode_crtc->drmmode;
+	uint32_t crtc_id = drmmode_crtc->mode_crtc->crtc_id;
+	uint32_t ids[2], prop_id;
+	int i, ret = 0;
+
+	if (!drmmode_prop_info_init(drmmode->fd, crtc_id, DRM_MODE_OBJECT_CRTC,
+				    crtc_modeset_prop_names, ids, NULL, 2) ||
+	    !ids[0] || !ids[1])
+		return -EINVAL;
+	if (drmModeCreatePropertyBlob(drmmode->fd, kmode, sizeof(*kmode),
+				      mode_blob)) {
+		*mode_blob = 0;
+		return -ENOMEM;
+	}
+	ret |= drmModeAtomicAddProperty(req, crtc_id, ids[0], *mode_blob) <= 0;
+	ret |= drmModeAtomicAddProperty(req, crtc_id, ids[1], 1) <= 0;
+
+	for (i = 0; i < num_connectors && !ret; i++) {
+		if (!drmmode_prop_info_init(drmmode->fd, connector_ids[i],
+					    DRM_MODE_OBJECT_CONNECTOR,
+					    connector_crtc_prop_name,
+					    &prop_id, NULL, 1) || !prop_id)
+			return -EINVAL;
+		ret |= drmModeAtomicAddProperty(req, connector_ids[i], prop_id,
+						crtc_id) <= 0;
+	}
+	if (ret)
+		return -EINVAL;
+
+	return drmmode_plane_add_props(req, drmmode_crtc, fb_id,
+				       x, y, src_w, src_h,
+				       kmode->hdisplay, kmode->vdisplay);
+}
+
+/*
+ * Light kmode on crtc with the primary plane scaling src_w x src_h of
+ * fb_id at x, y up or down to the whole mode, all in one atomic commit.
+ * With test_only, just ask whether the hardware could.
+ */
+static Bool
+drmmode_crtc_set_plane_scaled(xf86CrtcPtr crtc, const drmModeModeInfo *kmode,
+			      const uint32_t *output_ids, int output_count,
+			      uint32_t fb_id, int x, int y, int src_w, int src_h,
+			      Bool test_only)
+{
+	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+	drmmode_ptr drmmode = drmmode_crtc->drmmode;
+	uint32_t flags = DRM_MODE_ATOMIC_ALLOW_MODESET;
+	uint32_t mode_blob = 0;
+	drmModeAtomicReqPtr req;
+	int ret;
+
+	if (test_only)
+		flags |= DRM_MODE_ATOMIC_TEST_ONLY;
+
+	req = drmModeAtomicAlloc();
+	if (!req)
+		return FALSE;
+
+	ret = drmmode_crtc_add_modeset(req, crtc, kmode, output_ids,
+				       output_count, fb_id, x, y,
+				       src_w, src_h, &mode_blob);
+	if (ret == 0)
+		ret = drmModeAtomicCommit(drmmode->fd, req, flags, NULL);
+	drmModeAtomicFree(req);
+	if (mode_blob)
+		drmModeDestroyPropertyBlob(drmmode->fd, mode_blob);
+	if (ret || test_only)
+		return ret == 0;
+
+	drmmode_crtc->shown_fb_id = fb_id;
+	drmmode_crtc->shown_x = x;
+	drmmode_crtc->shown_y = y;
+	drmmode_crtc->shown_w = src_w;
+	drmmode_crtc->shown_h = src_h;
+	drmmode_crtc->plane_scaled = TRUE;
+	drmmode_crtc_set_scaled_transform(crtc, x, y, src_w, src_h);
+	return TRUE;
+}
+
+/* FB_DAMAGE_CLIPS entries, laid out like the kernel's struct drm_mode_rect */
+typedef struct {
+	int32_t x1, y1, x2, y2;
+} drmmode_rect_rec;
+
+/* region translated by dx, dy as a damage clip blob, 0 on failure */
+static uint32_t
+drmmode_create_damage_blob(drmmode_ptr drmmode, RegionPtr region,
+			   int dx, int dy)
+{
+	int n = RegionNumRects(region);
+	BoxPtr box = RegionRects(region);
+	drmmode_rect_rec *rects;
+	uint32_t blob_id = 0;
+	int i;
+
+	if (!n)
+		return 0;
+
+	rects = malloc(n * sizeof(*rects));
+	if (!rects)
+		return 0;
+
+	for (i = 0; i < n; i++, box++) {
+		rects[i].x1 = box->x1 + dx;
+		rects[i].y1 = box->y1 + dy;
+		rects[i].x2 = box->x2 + dx;
+		rects[i].y2 = box->y2 + dy;
+	}
+
+	if (drmModeCreatePropertyBlob(drmmode->fd, rects, n * sizeof(*rects),
+				      &blob_id))
+		blob_id = 0;
+	free(rects);
+	return blob_id;
+}
+
+static Bool
+drmmode_crtc_has_damage_clips(drmmode_crtc_private_ptr drmmode_crtc)
+{
+	return drmmode_crtc->drmmode->atomic_modeset &&
+		drmmode_crtc->plane_id &&
+		drmmode_crtc->plane_props[DRMMODE_PLANE_FB_DAMAGE_CLIPS];
+}
+
+/* re-commit the crtc's primary plane at fb_id, with damage if blob_id */
+static int
+drmmode_crtc_add_plane_damage(drmModeAtomicReqPtr req, xf86CrtcPtr crtc,
+			      uint32_t fb_id, uint32_t blob_id)
+{
+	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+	int w = crtc->mode.HDisplay;
+	int h = crtc->mode.VDisplay;
+	int ret;
+
+	ret = drmmode_plane_add_props(req, drmmode_crtc, fb_id,
+				      drmmode_crtc->shown_x,
+				      drmmode_crtc->shown_y,
+				      drmmode_crtc->shown_w,
+				      drmmode_crtc->shown_h, w, h);
+	if (ret == 0 && blob_id &&
+	    drmModeAtomicAddProperty(req, drmmode_crtc->plane_id,
+				     drmmode_crtc->plane_props[DRMMODE_PLANE_FB_DAMAGE_CLIPS],
+				     blob_id) <= 0)
+		ret = -EINVAL;
+	return ret;
+}
+
+/* the tile group of the monitor on crtc, 0 if it isn't a tiled one */
+static uint32_t
+drmmode_crtc_tile_group(xf86CrtcPtr crtc)
+{
+#if XF86_OUTPUT_VERSION >= 3
+	xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(crtc->scrn);
+	int i;
+
+	for (i = 0; i < xf86_config->num_output; i++) {
+		xf86OutputPtr output = xf86_config->output[i];
+
+		if (output->crtc == crtc && output->tile_info.group_id)
+			return output->tile_info.group_id;
+	}
+#endif
+	return 0;
+}
+
+/*
+ * Fill peers with crtc and the other lit crtcs showing tiles of the same
+ * monitor, crtc first, and return how many.  Their updates have to go in
+ * together or the seams between tiles tear; without atomic modesetting,
+ * or for a monitor that isn't tiled, crtc is on its own.
+ */
+int
+drmmode_crtc_tile_peers(xf86CrtcPtr crtc, xf86CrtcPtr *peers)
+{
+	xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(crtc->scrn);
+	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+	uint32_t group;
+	int c, n = 1;
+
+	peers[0] = crtc;
+	if (!drmmode_crtc->drmmode->atomic_modeset || !drmmode_crtc->plane_id)
+		return 1;
+	group = drmmode_crtc_tile_group(crtc);
+	if (!group)
+		return 1;
+
+	for (c = 0; c < xf86_config->num_crtc && n < DRMMODE_MAX_TILES; c++) {
+		xf86CrtcPtr peer = xf86_config->crtc[c];
+		drmmode_crtc_private_ptr peer_priv = peer->driver_private;
+
+		if (peer == crtc || !peer->enabled || peer_priv->leased ||
+		    !peer_priv->plane_id)
+			continue;
+		if (drmmode_crtc_tile_group(peer) == group)
+			peers[n++] = peer;
+	}
+	return n;
+}
+
+/*
+ * Re-commit the primary planes of crtcs at the fbs they show, in one
+ * non-blocking atomic commit with damage[i] (fb coordinates) as crtcs[i]'s
+ * FB_DAMAGE_CLIPS.  Crtcs with no damage are left out.  Returns FALSE
+ * when some plane has no damage clips or the commit fails.
+ */
+static Bool
+drmmode_crtcs_damage(drmmode_ptr drmmode, xf86CrtcPtr *crtcs,
+		     RegionRec *damage, int n)
+{
+	drmModeAtomicReqPtr req;
+	uint32_t *blob_ids;
+	int i, ret = 0, count = 0;
+
+	for (i = 0; i < n; i++) {
+		if (!RegionNotEmpty(&damage[i]))
+			continue;
+		if (!drmmode_crtc_has_damage_clips(crtcs[i]->driver_private))
+			return FALSE;
+		count++;
+	}
+	if (!count)
+		return TRUE;
+
+	blob_ids = calloc(n, sizeof(*blob_ids));
+	req = drmModeAtomicAlloc();
+	if (!blob_ids || !req)
+		ret = -ENOMEM;
+
+	for (i = 0; i < n && ret == 0; i++) {
+		drmmode_crtc_private_ptr drmmode_crtc = crtcs[i]->driver_private;
+
+		if (!RegionNotEmpty(&damage[i]))
+			continue;
+		blob_ids[i] = drmmode_create_damage_blob(drmmode, &damage[i],
+							 0, 0);
+		if (!blob_ids[i])
+			ret = -ENOMEM;
+		else
+			ret = drmmode_crtc_add_plane_damage(req, crtcs[i],
+							    drmmode_crtc->shown_fb_id,
+							    blob_ids[i]);
+	}
+	if (ret == 0)
+		ret = drmModeAtomicCommit(drmmode->fd, req,
+					  DRM_MODE_ATOMIC_NONBLOCK, NULL);
+
+	if (req)
+		drmModeAtomicFree(req);
+	for (i = 0; blob_ids && i < n; i++)
+		if (blob_ids[i])
+			drmModeDestroyPropertyBlob(drmmode->fd, blob_ids[i]);
+	free(blob_ids);
+	return ret == 0;
+}
+
+/*
+ * Tell every crtc showing fb_id that region, translated by dx, dy into fb
+ * coordinates, has changed: one non-blocking atomic commit carrying
+ * FB_DAMAGE_CLIPS for each of their primary planes, each clipped to the
+ * part of the fb that plane shows so tiles only hear of their own.
+ * Returns FALSE when some plane has no damage clips or the commit fails,
+ * and the caller should fall back to DirtyFB.
+ */
+Bool
+drmmode_damage_fb(drmmode_ptr drmmode, uint32_t fb_id, RegionPtr region,
+		  int dx, int dy)
+{
+	xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(drmmode->scrn);
+	xf86CrtcPtr *crtcs;
+	RegionRec *damage;
+	Bool ret;
+	int c, i, n = 0;
+
+	if (!drmmode->atomic_modeset)
+		return FALSE;
+
+	for (c = 0; c < xf86_config->num_crtc; c++) {
+		xf86CrtcPtr crtc = xf86_config->crtc[c];
+		drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+
+		if (!crtc->enabled || drmmode_crtc->shown_fb_id != fb_id)
+			continue;
+		if (!drmmode_crtc_has_damage_clips(drmmode_crtc))
+			return FALSE;
+		n++;
+	}
+	if (!n || !RegionNotEmpty(region))
+		return TRUE;
+
+	crtcs = calloc(n, sizeof(*crtcs));
+	damage = calloc(n, sizeof(*damage));
+	if (!crtcs || !damage) {
+		free(crtcs);
+		free(damage);
+		return FALSE;
+	}
+
+	for (c = 0, i = 0; c < xf86_config->num_crtc; c++) {
+		xf86CrtcPtr crtc = xf86_config->crtc[c];
+		drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+		BoxRec box;
+		RegionRec shown;
+
+		if (!crtc->enabled || drmmode_crtc->shown_fb_id != fb_id)
+			continue;
+
+		box.x1 = drmmode_crtc->shown_x;
+		box.y1 = drmmode_crtc->shown_y;
+		box.x2 = drmmode_crtc->shown_x + drmmode_crtc->shown_w;
+		box.y2 = drmmode_crtc->shown_y + drmmode_crtc->shown_h;
+		RegionInit(&shown, &box, 1);
+		RegionNull(&damage[i]);
+		RegionCopy(&damage[i], region);
+		RegionTranslate(&damage[i], dx, dy);
+		RegionIntersect(&damage[i], &damage[i], &shown);
+		RegionUninit(&shown);
+		crtcs[i++] = crtc;
+	}
+
+	ret = drmmode_crtcs_damage(drmmode, crtcs, damage, n);
+
+	for (i = 0; i < n; i++)
+		RegionUninit(&damage[i]);
+	free(crtcs);
+	free(damage);
+	return ret;
+}
+
+static const char * const vrr_capable_name[] = { "vrr_capable" };
+static const char * const vrr_enabled_name[] = { "VRR_ENABLED" };
+
+/* does every output on crtc drive a sink that can do adaptive sync? */
+static Bool
+drmmode_crtc_vrr_capable(xf86CrtcPtr crtc)
+{
+	xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(crtc->scrn);
+	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+	drmmode_ptr drmmode = drmmode_crtc->drmmode;
+	int i, n = 0;
+
+	for (i = 0; i < xf86_config->num_output; i++) {
+		xf86OutputPtr output = xf86_config->output[i];
+		drmmode_output_private_ptr drmmode_output;
+		uint32_t prop_id;
+		uint64_t value = 0;
+
+		if (output->crtc != crtc)
+			continue;
+
+		drmmode_output = output->driver_private;
+		if (!drmmode_output->mode_output ||
+		    !drmmode_prop_info_init(drmmode->fd,
+					    drmmode_output->mode_output->connector_id,
+					    DRM_MODE_OBJECT_CONNECTOR,
+					    vrr_capable_name, &prop_id, &value, 1) ||
+		    !prop_id || !value)
+			return FALSE;
+		n++;
+	}
+
+	return n > 0;
+}
+
+/*
+ * Turn adaptive sync on or off for crtc.  While on, the refresh waits for
+ * the next flip instead of running at the mode's fixed rate.
+ */
+void
+drmmode_crtc_set_vrr(xf86CrtcPtr crtc, Bool enabled)
+{
+	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+	drmmode_ptr drmmode = drmmode_crtc->drmmode;
+
+	if (!drmmode_crtc->vrr_prop_id || drmmode_crtc->vrr_enabled == enabled)
+		return;
+	if (enabled && !drmmode_crtc_vrr_capable(crtc))
+		return;
+
+	if (drmModeObjectSetProperty(drmmode->fd,
+				     drmmode_crtc->mode_crtc->crtc_id,
+				     DRM_MODE_OBJECT_CRTC,
+				     drmmode_crtc->vrr_prop_id, enabled) == 0)
+		drmmode_crtc->vrr_enabled = enabled;
+}
+
+/*
+ * Queue a page flip of crtc to fb_id, reported as DRM event seq.  An async
+ * flip lands right away and may tear; if the kernel refuses those for this
+ * crtc we stop asking and flip on vblank instead.
+ */
+int
+drmmode_crtc_page_flip(xf86CrtcPtr crtc, uint32_t fb_id, Bool async,
+		       uint32_t seq, RegionPtr damage)
+{
+	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+	drmmode_ptr drmmode = drmmode_crtc->drmmode;
+	uint32_t crtc_id = drmmode_crtc->mode_crtc->crtc_id;
+	void *data = (void *)(uintptr_t)seq;
+	int ret;
+
+	drmmode_flush_tile_modesets(drmmode);
+
+	if (async && drmmode->async_flip_cap &&
+	    !drmmode_crtc->async_flip_refused) {
+		ret = drmModePageFlip(drmmode->fd, crtc_id, fb_id,
+				      DRM_MODE_PAGE_FLIP_EVENT |
+				      DRM_MODE_PAGE_FLIP_ASYNC, data);
+		if (ret != -EINVAL)
+			goto out;
+
+		xf86DrvMsg(crtc->scrn->scrnIndex, X_INFO,
+			   "CRTC %d refused an async page flip, "
+			   "flipping on vblank\n", drmmode_crtc->hw_id);
+		drmmode_crtc->async_flip_refused = TRUE;
+	}
+
+	/* damage rides along with the flip, for panels that refresh partially */
+	if (damage && drmmode_crtc_has_damage_clips(drmmode_crtc)) {
+		uint32_t blob_id = drmmode_create_damage_blob(drmmode, damage,
+							      0, 0);
+		drmModeAtomicReqPtr req = drmModeAtomicAlloc();
+
+		ret = -ENOMEM;
+		if (blob_id && req)
+			ret = drmmode_crtc_add_plane_damage(req, crtc, fb_id,
+							    blob_id);
+		if (ret == 0)
+			ret = drmModeAtomicCommit(drmmode->fd, req,
+						  DRM_MODE_PAGE_FLIP_EVENT |
+						  DRM_MODE_ATOMIC_NONBLOCK,
+						  data);
+		if (req)
+			drmModeAtomicFree(req);
+		if (blob_id)
+			drmModeDestroyPropertyBlob(drmmode->fd, blob_id);
+		if (ret == 0)
+			goto out;
+	}
+
+	ret = drmModePageFlip(drmmode->fd, crtc_id, fb_id,
+			      DRM_MODE_PAGE_FLIP_EVENT, data);
+out:
+	if (ret == 0)
+		drmmode_crtc->shown_fb_id = fb_id;
+	return ret;
+}
+
+/*
+ * Flip crtcs, the tiles of one monitor, to fb_id in a single atomic
+ * commit, reported as DRM event seq.  Each crtc sends an event; only the
+ * one seq was queued on gets through.  Tiles always flip on vblank, an
+ * async flip would tear right along the seams.
+ */
+int
+drmmode_crtcs_page_flip(xf86CrtcPtr *crtcs, int n, uint32_t fb_id,
+			Bool async, uint32_t seq)
+{
+	drmmode_crtc_private_ptr drmmode_crtc = crtcs[0]->driver_private;
+	drmmode_ptr drmmode = drmmode_crtc->drmmode;
+	drmModeAtomicReqPtr req;
+	int i, ret = 0;
+
+	if (n == 1)
+		return drmmode_crtc_page_flip(crtcs[0], fb_id, async, seq, NULL);
+
+	drmmode_flush_tile_modesets(drmmode);
+
+	req = drmModeAtomicAlloc();
+	if (!req)
+		return -ENOMEM;
+	for (i = 0; i < n && ret == 0; i++)
+		ret = drmmode_crtc_add_plane_damage(req, crtcs[i], fb_id, 0);
+	if (ret == 0)
+		ret = drmModeAtomicCommit(drmmode->fd, req,
+					  DRM_MODE_PAGE_FLIP_EVENT |
+					  DRM_MODE_ATOMIC_NONBLOCK,
+					  (void *)(uintptr_t)seq);
+	drmModeAtomicFree(req);
+
+	for (i = 0; i < n && ret == 0; i++) {
+		drmmode_crtc = crtcs[i]->driver_private;
+		drmmode_crtc->shown_fb_id = fb_id;
+	}
+	return ret;
+}
+
+/*
+ * Can the crtc scan out the front buffer at (x, y) through a plane update
+ * alone, i.e. without rotation or a slave scanout pixmap in the way?
+ */
+static Bool
+drmmode_crtc_front_plane_ok(xf86CrtcPtr crtc, int x, int y,
+			    int fb_width, int fb_height)
+{
+	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+
+	if (!drmmode_crtc->plane_id || drmmode_crtc->rotate_fb_id ||
+	    drmmode_crtc->plane_scaled || crtc->rotation != RR_Rotate_0)
+		return FALSE;
+#ifdef MODESETTING_OUTPUT_SLAVE_SUPPORT
+	if (crtc->randr_crtc && crtc->randr_crtc->scanout_pixmap)
+		return FALSE;
+#endif
+	if (x < 0 || y < 0 ||
+	    x + crtc->mode.HDisplay > fb_width ||
+	    y + crtc->mode.VDisplay > fb_height)
+		return FALSE;
+
+	return TRUE;
+}
+
+static void
+drmmode_crtc_dpms(xf86CrtcPtr crtc, int mode)
+{
+#if 0
+	xf86CrtcConfigPtr   xf86_config = XF86_CRTC_CONFIG_PTR(crtc->scrn);
+//	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+//	drmmode_ptr drmmode = drmmode_crtc->drmmode;
+
+	/* bonghits in the randr 1.2 - uses dpms to disable crtc - bad buzz */
+	if (mode == DPMSModeOff) {
+//		drmModeSetCrtc(drmmode->fd, drmmode_crtc->mode_crtc->crtc_id,
+//			       0, 0, 0, NULL, 0, NULL);
+	}
+#endif
+}
+
+#if 0
+static PixmapPtr
+create_pixmap_for_fbcon(drmmode_ptr drmmode,
+			ScrnInfoPtr pScrn, int crtc_id)
+{
+	xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(pScrn);
+	drmmode_crtc_private_ptr drmmode_crtc;
+	ScreenPtr pScreen = pScrn->pScreen;
+	PixmapPtr pixmap;
+	struct radeon_bo *bo;
+	drmModeFBPtr fbcon;
+	struct drm_gem_flink flink;
+
+	drmmode_crtc = xf86_config->crtc[crtc_id]->driver_private;
+
+	fbcon = drmModeGetFB(drmmode->fd, drmmode_crtc->mode_crtc->buffer_id);
+	if (fbcon == NULL)
+		return NULL;
+
+	flink.handle = fbcon->handle;
+	if (ioctl(drmmode->fd, DRM_IOCTL_GEM_FLINK, &flink) < 0) {
+		xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
+			   "Couldn't flink fbcon handle\n");
 		return NULL;
+	}
+
+	bo = radeon_bo_open(drmmode->bufmgr, flink.name, 0, 0, 0, 0);
+	if (bo == NULL) {
+		xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
+			   "Couldn't allocate bo for fbcon handle\n");
+		return NULL;
+	}
+
+	pixmap = drmmode_create_bo_pixmap(pScreen, fbcon->width, fbcon->height,
+					  fbcon->depth, fbcon->bpp,
+					  fbcon->pitch, bo);
+	if (!pixmap) 
+		return NULL;
+
+	radeon_bo_unref(bo);
+	drmModeFreeFB(fbcon);
+	return pixmap;
+}
+
+#endif
+
+static void
+drmmode_scanout_destroy(drmmode_ptr drmmode, drmmode_scanout_ptr scanout)
+{
+	if (scanout->fb_id)
+		drmModeRmFB(drmmode->fd, scanout->fb_id);
+	if (scanout->bo)
+		dumb_bo_pool_put(&drmmode->bo_pool, scanout->bo);
+	memset(scanout, 0, sizeof(*scanout));
+}
+
+static Bool
+drmmode_scanout_create(ScrnInfoPtr scrn, drmmode_ptr drmmode,
+		       drmmode_scanout_ptr scanout, int width, int height)
+{
+	memset(scanout, 0, sizeof(*scanout));
+
+	scanout->bo = dumb_bo_pool_get(&drmmode->bo_pool, width, height,
+				     scrn->bitsPerPixel);
+	if (!scanout->bo)
+		return FALSE;
+
+	if (drmModeAddFB(drmmode->fd, width, height, scrn->depth,
+			 scrn->bitsPerPixel, scanout->bo->pitch,
+			 scanout->bo->handle, &scanout->fb_id) ||
+	    dumb_bo_map(drmmode->fd, scanout->bo)) {
+		drmmode_scanout_destroy(drmmode, scanout);
+		return FALSE;
+	}
+
+	scanout->width = width;
+	scanout->height = height;
+	return TRUE;
+}
+
+static void
+drmmode_scanout_swap(drmmode_scanout_ptr a, drmmode_scanout_ptr b)
+{
+	drmmode_scanout_rec tmp = *a;
+
+	*a = *b;
+	*b = tmp;
+}
+
+/* clip region to the part of the screen this crtc shows */
+static void
+drmmode_crtc_scanout_region(xf86CrtcPtr crtc, RegionPtr region,
+			    RegionPtr damage)
+{
+	ScrnInfoPtr scrn = crtc->scrn;
+	BoxRec box;
+	int w, h;
+
+	drmmode_crtc_source_size(crtc, &w, &h);
+	box.x1 = max(crtc->x, 0);
+	box.y1 = max(crtc->y, 0);
+	box.x2 = min(crtc->x + w, scrn->virtualX);
+	box.y2 = min(crtc->y + h, scrn->virtualY);
+	if (box.x2 < box.x1)
+		box.x2 = box.x1;
+	if (box.y2 < box.y1)
+		box.y2 = box.y1;
+
+	RegionInit(region, &box, 1);
+	if (damage)
+		RegionIntersect(region, region, damage);
+}
+
+static void
+drmmode_dirty_fb(drmmode_ptr drmmode, uint32_t fb_id, RegionPtr region,
+		 int dx, int dy)
+{
+	int num_cliprects = RegionNumRects(region);
+	BoxPtr rect = RegionRects(region);
+	drmModeClip *clip;
+	int i, ret;
+
+	if (!num_cliprects)
+		return;
+	/* either way, what was copied into fb_id is out */
+	if (drmmode_damage_fb(drmmode, fb_id, region, dx, dy) ||
+	    drmmode->dirty_fb_unsupported) {
+		ms_startup_flushed(drmmode->scrn);
+		return;
+	}
+
+	clip = malloc(num_cliprects * sizeof(drmModeClip));
+	if (!clip)
+		return;
+
+	for (i = 0; i < num_cliprects; i++, rect++) {
+		clip[i].x1 = rect->x1 + dx;
+		clip[i].y1 = rect->y1 + dy;
+		clip[i].x2 = rect->x2 + dx;
+		clip[i].y2 = rect->y2 + dy;
+	}
+
+	ret = drmModeDirtyFB(drmmode->fd, fb_id, clip, num_cliprects);
+	if (ret == -EINVAL || ret == -ENOSYS)
+		drmmode->dirty_fb_unsupported = TRUE;
+	free(clip);
+	ms_startup_flushed(drmmode->scrn);
+}
+
+/*
+ * Stretch region (screen coordinates) of the shadow into a crtc scanout
+ * bo through the crtc's scaler, and say in fb_damage which part of the
+ * bo that redid: everything whose filter footprint reaches the damage.
+ */
+static void
+drmmode_crtc_scanout_scale(xf86CrtcPtr crtc, drmmode_scanout_ptr scanout,
+			   RegionPtr region, RegionPtr fb_damage)
+{
+	ScrnInfoPtr scrn = crtc->scrn;
+	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+	drmmode_ptr drmmode = drmmode_crtc->drmmode;
+	int src_pitch = scrn->displayWidth * 4;
+	const uint8_t *src = (uint8_t *)drmmode->shadow_fb +
+		crtc->y * src_pitch + crtc->x * 4;
+	BoxPtr box = RegionRects(region);
+	int n = RegionNumRects(region);
+	RegionRec dst;
+
+	RegionNull(&dst);
+	for (; n--; box++) {
+		int x1 = box->x1 - crtc->x, y1 = box->y1 - crtc->y;
+		int x2 = box->x2 - crtc->x, y2 = box->y2 - crtc->y;
+		RegionRec r;
+		BoxRec b;
+
+		ms_scaler_dst_box(drmmode_crtc->scaler, &x1, &y1, &x2, &y2);
+		if (x2 <= x1 || y2 <= y1)
+			continue;
+		b.x1 = x1;
+		b.y1 = y1;
+		b.x2 = x2;
+		b.y2 = y2;
+		RegionInit(&r, &b, 1);
+		RegionUnion(&dst, &dst, &r);
+		RegionUninit(&r);
+	}
+
+	box = RegionRects(&dst);
+	n = RegionNumRects(&dst);
+	for (; n--; box++)
+		ms_scaler_run(drmmode->scaler_pool, drmmode_crtc->scaler,
+			      src, src_pitch, scanout->bo->ptr,
+			      scanout->bo->pitch,
+			      box->x1, box->y1, box->x2, box->y2);
+
+	if (fb_damage)
+		RegionCopy(fb_damage, &dst);
+	RegionUninit(&dst);
+}
+
+/*
+ * Copy region (screen coordinates) from the shadow into a crtc scanout
+ * bo.  If fb_damage is given, it gets what changed in fb coordinates.
+ */
+static void
+drmmode_crtc_scanout_copy(xf86CrtcPtr crtc, drmmode_scanout_ptr scanout,
+			  RegionPtr region, RegionPtr fb_damage)
+{
+	ScrnInfoPtr scrn = crtc->scrn;
+	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+	drmmode_ptr drmmode = drmmode_crtc->drmmode;
+	int cpp = (scrn->bitsPerPixel + 7) / 8;
+	int src_pitch = scrn->displayWidth * cpp;
+	BoxPtr box = RegionRects(region);
+	int n = RegionNumRects(region);
+
+	if (drmmode_crtc->scaler) {
+		drmmode_crtc_scanout_scale(crtc, scanout, region, fb_damage);
+		return;
+	}
+
+	for (; n--; box++) {
+		const uint8_t *src = (uint8_t *)drmmode->shadow_fb +
+			box->y1 * src_pitch + box->x1 * cpp;
+		uint8_t *dst = (uint8_t *)scanout->bo->ptr +
+			(box->y1 - crtc->y) * scanout->bo->pitch +
+			(box->x1 - crtc->x) * cpp;
+
+		drmmode_copy_area(dst, scanout->bo->pitch, src, src_pitch,
+				  box->x2 - box->x1, box->y2 - box->y1, cpp);
+	}
+
+	if (fb_damage) {
+		RegionCopy(fb_damage, region);
+		RegionTranslate(fb_damage, -crtc->x, -crtc->y);
+	}
+}
+
+static void
+drmmode_scanout_flip_handler(uint64_t msc, uint64_t usec, void *data)
+{
+	xf86CrtcPtr crtc = data;
+	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+
+	/* the next block handler flushes whatever piled up meanwhile */
+	drmmode_crtc->flip_pending = FALSE;
+	ms_startup_flushed(crtc->scrn);
+}
+
+static void
+drmmode_scanout_flip_abort(void *data)
+{
+	xf86CrtcPtr crtc = data;
+	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
 
-	memset(&arg, 0, sizeof(arg));
-	arg.width = width;
-	arg.height = height;
-	arg.bpp = bpp;
-	
-	ret = drmIoctl(fd, DRM_IOCTL_MODE_CREATE_DUMB, &arg);
-	if (ret)
-		goto err_free;
+	drmmode_crtc->flip_pending = FALSE;
+}
 
-	bo->handle = arg.handle;
-	bo->size = arg.size;
-	bo->pitch = arg.pitch;
+static void
+drmmode_crtc_wait_pending_flip(xf86CrtcPtr crtc)
+{
+	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+	drmmode_ptr drmmode = drmmode_crtc->drmmode;
 
-	return bo;
- err_free:
-	free(bo);
-	return NULL;
+	while (drmmode_crtc->flip_pending &&
+	       drmHandleEvent(drmmode->fd, &drmmode->event_context) >= 0)
+		;
 }
 
-static int dumb_bo_map(int fd, struct dumb_bo *bo)
+/*
+ * TearFree: bring the back scanout up to date and flip to it.  The back
+ * bo missed both this frame's damage and the previous frame's, which
+ * only went into the bo now on screen.
+ */
+static void
+drmmode_crtc_scanout_flip(xf86CrtcPtr crtc)
 {
-	struct drm_mode_map_dumb arg;
-	int ret;
-	void *map;
+	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+	drmmode_ptr drmmode = drmmode_crtc->drmmode;
+	unsigned back_id = drmmode_crtc->scanout_id ^ 1;
+	drmmode_scanout_ptr back = &drmmode_crtc->scanout[back_id];
+	drmmode_scanout_ptr front;
+	RegionRec region, fb_damage;
+	uint32_t seq;
+
+	RegionNull(&region);
+	RegionNull(&fb_damage);
+	RegionUnion(&region, &drmmode_crtc->scanout_damage,
+		    &drmmode_crtc->scanout_last_damage);
+	drmmode_crtc_scanout_copy(crtc, back, &region, &fb_damage);
+	RegionUninit(&region);
+
+	seq = ms_drm_queue_alloc(crtc, crtc, drmmode_scanout_flip_handler,
+				 drmmode_scanout_flip_abort);
+	if (seq && drmmode_crtc_page_flip(crtc, back->fb_id,
+					  drmmode->async_flip, seq,
+					  &fb_damage) == 0) {
+		RegionUninit(&fb_damage);
+		drmmode_crtc->scanout_id = back_id;
+		drmmode_crtc->flip_pending = TRUE;
+		RegionCopy(&drmmode_crtc->scanout_last_damage,
+			   &drmmode_crtc->scanout_damage);
+		RegionEmpty(&drmmode_crtc->scanout_damage);
+		return;
+	}
+	if (seq)
+		ms_drm_abort_seq(crtc->scrn, seq);
+
+	/* no flip this time, update the front in place; both are current now */
+	front = &drmmode_crtc->scanout[drmmode_crtc->scanout_id];
+	drmmode_crtc_scanout_copy(crtc, front, &drmmode_crtc->scanout_damage,
+				  &fb_damage);
+	drmmode_dirty_fb(drmmode, front->fb_id, &fb_damage, 0, 0);
+	RegionUninit(&fb_damage);
+	RegionEmpty(&drmmode_crtc->scanout_damage);
+	RegionEmpty(&drmmode_crtc->scanout_last_damage);
+}
 
-	if (bo->ptr) {
-		bo->map_count++;
-		return 0;
+/* copy the damaged part of the shadow into the crtc's own scanout bo */
+static void
+drmmode_crtc_scanout_update(xf86CrtcPtr crtc, RegionPtr damage)
+{
+	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+	drmmode_ptr drmmode = drmmode_crtc->drmmode;
+	drmmode_scanout_ptr scanout =
+		&drmmode_crtc->scanout[drmmode_crtc->scanout_id];
+	RegionRec region, fb_damage;
+
+	drmmode_crtc_scanout_region(crtc, &region, damage);
+
+	if (drmmode->tearfree) {
+		RegionUnion(&drmmode_crtc->scanout_damage,
+			    &drmmode_crtc->scanout_damage, &region);
+		RegionUninit(&region);
+		if (!drmmode_crtc->flip_pending &&
+		    RegionNotEmpty(&drmmode_crtc->scanout_damage))
+			drmmode_crtc_scanout_flip(crtc);
+		return;
 	}
 
-	memset(&arg, 0, sizeof(arg));
-	arg.handle = bo->handle;
+	RegionNull(&fb_damage);
+	drmmode_crtc_scanout_copy(crtc, scanout, &region, &fb_damage);
+	drmmode_dirty_fb(drmmode, scanout->fb_id, &fb_damage, 0, 0);
+	RegionUninit(&fb_damage);
+	RegionUninit(&region);
+}
 
-	ret = drmIoctl(fd, DRM_IOCTL_MODE_MAP_DUMB, &arg);
-	if (ret)
-		return ret;
+/* the tiles' flip is over, one way or the other */
+static void
+drmmode_tiles_flip_abort(void *data)
+{
+	xf86CrtcPtr leader = data;
+	xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(leader->scrn);
+	int c;
 
-	map = mmap(0, bo->size, PROT_READ | PROT_WRITE, MAP_SHARED,
-		   fd, arg.offset);
-	if (map == MAP_FAILED)
-		return -errno;
+	for (c = 0; c < xf86_config->num_crtc; c++) {
+		xf86CrtcPtr crtc = xf86_config->crtc[c];
+		drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
 
-	bo->ptr = map;
-	return 0;
+		if (crtc != leader && drmmode_crtc->tile_flip_leader != leader)
+			continue;
+		drmmode_crtc->flip_pending = FALSE;
+		drmmode_crtc->tile_flip_leader = NULL;
+	}
 }
 
-#if 0
-static int dumb_bo_unmap(int fd, struct dumb_bo *bo)
+/* a tile group's flip is done when the event for its first crtc is */
+static void
+drmmode_tiles_flip_handler(uint64_t msc, uint64_t usec, void *data)
 {
-	bo->map_count--;
-	return 0;
+	xf86CrtcPtr leader = data;
+
+	drmmode_tiles_flip_abort(data);
+	ms_startup_flushed(leader->scrn);
 }
-#endif
 
-static int dumb_bo_destroy(int fd, struct dumb_bo *bo)
+/*
+ * TearFree for the tiles of one monitor: bring every back scanout up to
+ * date, then flip them all in one atomic commit so no tile runs a frame
+ * ahead of the others.
+ */
+static void
+drmmode_tiles_scanout_flip(xf86CrtcPtr *peers, int n)
 {
-	struct drm_mode_destroy_dumb arg;
-	int ret;
-	
-	if (bo->ptr) {
-		munmap(bo->ptr, bo->size);
-		bo->ptr = NULL;
+	drmmode_crtc_private_ptr drmmode_crtc = peers[0]->driver_private;
+	drmmode_ptr drmmode = drmmode_crtc->drmmode;
+	RegionRec fb_damage[DRMMODE_MAX_TILES];
+	uint32_t blob_ids[DRMMODE_MAX_TILES] = { 0 };
+	drmModeAtomicReqPtr req;
+	uint32_t seq = 0;
+	int i, ret = -ENOMEM;
+
+	for (i = 0; i < n; i++) {
+		RegionRec region;
+
+		drmmode_crtc = peers[i]->driver_private;
+		RegionNull(&region);
+		RegionNull(&fb_damage[i]);
+		RegionUnion(&region, &drmmode_crtc->scanout_damage,
+			    &drmmode_crtc->scanout_last_damage);
+		drmmode_crtc_scanout_copy(peers[i],
+					  &drmmode_crtc->scanout[drmmode_crtc->scanout_id ^ 1],
+					  &region, &fb_damage[i]);
+		RegionUninit(&region);
 	}
 
-	memset(&arg, 0, sizeof(arg));
-	arg.handle = bo->handle;
-	ret = drmIoctl(fd, DRM_IOCTL_MODE_DESTROY_DUMB, &arg);
-	if (ret)
-		return -errno;
-
-	free(bo);
-	return 0;
+	req = drmModeAtomicAlloc();
+	if (req)
+		seq = ms_drm_queue_alloc(peers[0], peers[0],
+					 drmmode_tiles_flip_handler,
+					 drmmode_tiles_flip_abort);
+	if (seq) {
+		ret = 0;
+		for (i = 0; i < n && ret == 0; i++) {
+			drmmode_crtc = peers[i]->driver_private;
+			if (RegionNotEmpty(&fb_damage[i]) &&
+			    drmmode_crtc_has_damage_clips(drmmode_crtc))
+				blob_ids[i] = drmmode_create_damage_blob(drmmode,
+									 &fb_damage[i],
+									 0, 0);
+			ret = drmmode_crtc_add_plane_damage(req, peers[i],
+							    drmmode_crtc->scanout[drmmode_crtc->scanout_id ^ 1].fb_id,
+							    blob_ids[i]);
+		}
+		if (ret == 0)
+			ret = drmModeAtomicCommit(drmmode->fd, req,
+						  DRM_MODE_PAGE_FLIP_EVENT |
+						  DRM_MODE_ATOMIC_NONBLOCK,
+						  (void *)(uintptr_t)seq);
+	}
+	if (req)
+		drmModeAtomicFree(req);
+	for (i = 0; i < n; i++)
+		if (blob_ids[i])
+			drmModeDestroyPropertyBlob(drmmode->fd, blob_ids[i]);
+
+	if (ret && seq)
+		ms_drm_abort_seq(peers[0]->scrn, seq);
+
+	for (i = 0; i < n; i++) {
+		drmmode_scanout_ptr front;
+
+		drmmode_crtc = peers[i]->driver_private;
+		if (ret == 0) {
+			drmmode_crtc->scanout_id ^= 1;
+			drmmode_crtc->shown_fb_id =
+				drmmode_crtc->scanout[drmmode_crtc->scanout_id].fb_id;
+			drmmode_crtc->flip_pending = TRUE;
+			drmmode_crtc->tile_flip_leader = peers[0];
+			RegionCopy(&drmmode_crtc->scanout_last_damage,
+				   &drmmode_crtc->scanout_damage);
+		} else {
+			/* no flip this time, update the fronts in place */
+			front = &drmmode_crtc->scanout[drmmode_crtc->scanout_id];
+			drmmode_crtc_scanout_copy(peers[i], front,
+						  &drmmode_crtc->scanout_damage,
+						  &fb_damage[i]);
+			drmmode_dirty_fb(drmmode, front->fb_id, &fb_damage[i],
+					 0, 0);
+			RegionEmpty(&drmmode_crtc->scanout_last_damage);
+		}
+		RegionEmpty(&drmmode_crtc->scanout_damage);
+		RegionUninit(&fb_damage[i]);
+	}
 }
 
-#ifdef MODESETTING_OUTPUT_SLAVE_SUPPORT
-static struct dumb_bo *dumb_get_bo_from_handle(int fd, int handle, int pitch, int size)
+/*
+ * Update the tiles of one monitor from the shadow together, so that all
+ * of them change in the same frame.  Returns FALSE if some tile doesn't
+ * scan out of its own bos and each has to go on its own.
+ */
+static Bool
+drmmode_tiles_scanout_update(xf86CrtcPtr *peers, int n, RegionPtr damage)
 {
-  	struct dumb_bo *bo;
-	int ret;
+	drmmode_crtc_private_ptr drmmode_crtc = peers[0]->driver_private;
+	drmmode_ptr drmmode = drmmode_crtc->drmmode;
+	RegionRec fb_damage[DRMMODE_MAX_TILES];
+	Bool pending = FALSE, dirty = FALSE;
+	int i;
 
-	bo = calloc(1, sizeof(*bo));
-	if (!bo)
-		return NULL;
+	for (i = 0; i < n; i++) {
+		drmmode_crtc = peers[i]->driver_private;
+		if (!drmmode_crtc->use_scanout)
+			return FALSE;
+	}
 
-	ret = drmPrimeFDToHandle(fd, handle, &bo->handle);
-	if (ret) {
-		free(bo);
-		return NULL;
+	if (drmmode->tearfree) {
+		for (i = 0; i < n; i++) {
+			RegionRec region;
+
+			drmmode_crtc = peers[i]->driver_private;
+			drmmode_crtc_scanout_region(peers[i], &region, damage);
+			RegionUnion(&drmmode_crtc->scanout_damage,
+				    &drmmode_crtc->scanout_damage, &region);
+			RegionUninit(&region);
+			pending |= drmmode_crtc->flip_pending;
+			dirty |= RegionNotEmpty(&drmmode_crtc->scanout_damage);
+		}
+		if (!pending && dirty)
+			drmmode_tiles_scanout_flip(peers, n);
+		return TRUE;
 	}
-	bo->pitch = pitch;
-	bo->size = size;
-	return bo;
-}
-#endif
 
-#ifdef MODESETTING_OUTPUT_SLAVE_SUPPORT
-Bool drmmode_SetSlaveBO(PixmapPtr ppix,
-			drmmode_ptr drmmode, 
-			int fd_handle, int pitch, int size)
-{
-    	msPixmapPrivPtr ppriv = msGetPixmapPriv(drmmode, ppix);
+	for (i = 0; i < n; i++) {
+		RegionRec region;
 
-	ppriv->backing_bo = dumb_get_bo_from_handle(drmmode->fd, fd_handle, pitch, size);
-	if (!ppriv->backing_bo)
-		return FALSE;
+		drmmode_crtc = peers[i]->driver_private;
+		drmmode_crtc_scanout_region(peers[i], &region, damage);
+		RegionNull(&fb_damage[i]);
+		drmmode_crtc_scanout_copy(peers[i],
+					  &drmmode_crtc->scanout[drmmode_crtc->scanout_id],
+					  &region, &fb_damage[i]);
+		RegionUninit(&region);
+	}
 
-	close(fd_handle);
+	/* one commit tells every tile's plane, else one DirtyFB each */
+	if (!drmmode_crtcs_damage(drmmode, peers, fb_damage, n)) {
+		for (i = 0; i < n; i++) {
+			drmmode_crtc = peers[i]->driver_private;
+			drmmode_dirty_fb(drmmode,
+					 drmmode_crtc->scanout[drmmode_crtc->scanout_id].fb_id,
+					 &fb_damage[i], 0, 0);
+		}
+	}
+	for (i = 0; i < n; i++)
+		RegionUninit(&fb_damage[i]);
 	return TRUE;
 }
-#endif
 
+/* fill every scanout bo of the crtc from the shadow, nothing pending */
 static void
-drmmode_ConvertFromKMode(ScrnInfoPtr	scrn,
-		     drmModeModeInfo *kmode,
-		     DisplayModePtr	mode)
+drmmode_crtc_scanout_refresh(xf86CrtcPtr crtc)
 {
-	memset(mode, 0, sizeof(DisplayModeRec));
-	mode->status = MODE_OK;
+	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+	drmmode_ptr drmmode = drmmode_crtc->drmmode;
+	RegionRec region;
+	int i;
 
-	mode->Clock = kmode->clock;
+	drmmode_crtc_scanout_region(crtc, &region, NULL);
+	for (i = 0; i < (drmmode->tearfree ? 2 : 1); i++)
+		drmmode_crtc_scanout_copy(crtc, &drmmode_crtc->scanout[i],
+					  &region, NULL);
+	RegionUninit(&region);
+	RegionEmpty(&drmmode_crtc->scanout_damage);
+	RegionEmpty(&drmmode_crtc->scanout_last_damage);
+}
 
-	mode->HDisplay = kmode->hdisplay;
-	mode->HSyncStart = kmode->hsync_start;
-	mode->HSyncEnd = kmode->hsync_end;
-	mode->HTotal = kmode->htotal;
-	mode->HSkew = kmode->hskew;
+void
+drmmode_update_scanouts(ScrnInfoPtr scrn, drmmode_ptr drmmode,
+			RegionPtr damage)
+{
+	xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(scrn);
+	uint32_t done = 0;
+	int c, i;
 
-	mode->VDisplay = kmode->vdisplay;
-	mode->VSyncStart = kmode->vsync_start;
-	mode->VSyncEnd = kmode->vsync_end;
-	mode->VTotal = kmode->vtotal;
-	mode->VScan = kmode->vscan;
+	drmmode_flush_tile_modesets(drmmode);
 
-	mode->Flags = kmode->flags; //& FLAG_BITS;
-	mode->name = strdup(kmode->name);
+	for (c = 0; c < xf86_config->num_crtc; c++) {
+		xf86CrtcPtr crtc = xf86_config->crtc[c];
+		drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+		xf86CrtcPtr peers[DRMMODE_MAX_TILES];
+		int n;
 
-	if (kmode->type & DRM_MODE_TYPE_DRIVER)
-		mode->type = M_T_DRIVER;
-	if (kmode->type & DRM_MODE_TYPE_PREFERRED)
-		mode->type |= M_T_PREFERRED;
-	xf86SetModeCrtc (mode, scrn->adjustFlags);
+		if (!crtc->enabled || !drmmode_crtc->use_scanout ||
+		    (done & (1U << drmmode_crtc->hw_id)))
+			continue;
+
+		n = drmmode_crtc_tile_peers(crtc, peers);
+		if (n > 1 && drmmode_tiles_scanout_update(peers, n, damage)) {
+			for (i = 0; i < n; i++) {
+				drmmode_crtc = peers[i]->driver_private;
+				done |= 1U << drmmode_crtc->hw_id;
+			}
+			continue;
+		}
+
+		drmmode_crtc_scanout_update(crtc, damage);
+	}
+}
+
+/* allocate new scanout bos into new_scanout where the mode size changed */
+static Bool
+drmmode_crtc_scanout_alloc(xf86CrtcPtr crtc, int width, int height,
+			   drmmode_scanout_rec new_scanout[2])
+{
+	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+	drmmode_ptr drmmode = drmmode_crtc->drmmode;
+	int i;
+
+	for (i = 0; i < (drmmode->tearfree ? 2 : 1); i++) {
+		if (drmmode_crtc->scanout[i].width == width &&
+		    drmmode_crtc->scanout[i].height == height)
+			continue;
+		if (!drmmode_scanout_create(crtc->scrn, drmmode,
+					    &new_scanout[i], width, height)) {
+			while (i--)
+				drmmode_scanout_destroy(drmmode,
+							&new_scanout[i]);
+			return FALSE;
+		}
+	}
+	return TRUE;
 }
 
 static void
-drmmode_ConvertToKMode(ScrnInfoPtr	scrn,
-		     drmModeModeInfo *kmode,
-		     DisplayModePtr	mode)
+drmmode_crtc_scanout_free(xf86CrtcPtr crtc)
 {
-	memset(kmode, 0, sizeof(*kmode));
+	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+	drmmode_ptr drmmode = drmmode_crtc->drmmode;
 
-	kmode->clock = mode->Clock;
-	kmode->hdisplay = mode->HDisplay;
-	kmode->hsync_start = mode->HSyncStart;
-	kmode->hsync_end = mode->HSyncEnd;
-	kmode->htotal = mode->HTotal;
-	kmode->hskew = mode->HSkew;
+	drmmode_crtc_wait_pending_flip(crtc);
+	drmmode_crtc->use_scanout = FALSE;
+	drmmode_crtc->scanout_id = 0;
+	drmmode_scanout_destroy(drmmode, &drmmode_crtc->scanout[0]);
+	drmmode_scanout_destroy(drmmode, &drmmode_crtc->scanout[1]);
+	RegionEmpty(&drmmode_crtc->scanout_damage);
+	RegionEmpty(&drmmode_crtc->scanout_last_damage);
+	ms_scaler_destroy(drmmode_crtc->scaler);
+	drmmode_crtc->scaler = NULL;
+}
 
-	kmode->vdisplay = mode->VDisplay;
-	kmode->vsync_start = mode->VSyncStart;
-	kmode->vsync_end = mode->VSyncEnd;
-	kmode->vtotal = mode->VTotal;
-	kmode->vscan = mode->VScan;
+/*
+ * RandR sets the crtcs of a tiled monitor one request at a time.  Hold
+ * their modesets back so drmmode_flush_tile_modesets() lights all the
+ * tiles in one atomic commit instead of one after another.
+ */
+static Bool
+drmmode_crtc_defer_tile_modeset(xf86CrtcPtr crtc,
+				const drmModeModeInfo *kmode,
+				const DisplayModeRec *saved_mode,
+				int saved_x, int saved_y,
+				Rotation saved_rotation,
+				drmmode_scanout_ptr old_scanout)
+{
+	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+	drmmode_ptr drmmode = drmmode_crtc->drmmode;
+	int i;
 
-	kmode->flags = mode->Flags; //& FLAG_BITS;
-	if (mode->name)
-		strncpy(kmode->name, mode->name, DRM_DISPLAY_MODE_LEN);
-	kmode->name[DRM_DISPLAY_MODE_LEN-1] = 0;
+	if (!drmmode->atomic_modeset || !drmmode_crtc->plane_id ||
+	    !drmmode_crtc_tile_group(crtc))
+		return FALSE;
+
+	/*
+	 * The tile shows what it did until the flush, so its scanouts must
+	 * outlive this modeset, and a failed flush goes back to that state.
+	 */
+	if (!drmmode_crtc->tile_modeset) {
+		for (i = 0; i < 2; i++)
+			drmmode_scanout_swap(&drmmode_crtc->tile_old_scanout[i],
+					     &old_scanout[i]);
+		drmmode_crtc->tile_saved_mode = *saved_mode;
+		drmmode_crtc->tile_saved_x = saved_x;
+		drmmode_crtc->tile_saved_y = saved_y;
+		drmmode_crtc->tile_saved_rotation = saved_rotation;
+	}
+
+	drmmode_crtc->tile_kmode = *kmode;
+	drmmode_crtc->tile_modeset = TRUE;
+	drmmode->tile_modeset_pending = TRUE;
+	return TRUE;
+}
+
+/* up to max of the connectors on crtc into ids, returns how many */
+static int
+drmmode_crtc_connector_ids(xf86CrtcPtr crtc, uint32_t *ids, int max)
+{
+	xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(crtc->scrn);
+	int i, n = 0;
+
+	for (i = 0; i < xf86_config->num_output && n < max; i++) {
+		xf86OutputPtr output = xf86_config->output[i];
+		drmmode_output_private_ptr drmmode_output = output->driver_private;
+
+		if (output->crtc == crtc && !drmmode_output->leased &&
+		    drmmode_output->mode_output)
+			ids[n++] = drmmode_output->mode_output->connector_id;
+	}
+	return n;
+}
 
+/* add crtc's held back modeset to req: mode, connectors and plane */
+static int
+drmmode_crtc_add_tile_modeset(drmModeAtomicReqPtr req, xf86CrtcPtr crtc,
+			      uint32_t *mode_blob)
+{
+	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+	uint32_t connector_ids[32];
+	int n;
+
+	n = drmmode_crtc_connector_ids(crtc, connector_ids,
+				       MS_ARRAY_SIZE(connector_ids));
+	return drmmode_crtc_add_modeset(req, crtc, &drmmode_crtc->tile_kmode,
+					connector_ids, n,
+					drmmode_crtc->shown_fb_id,
+					drmmode_crtc->shown_x,
+					drmmode_crtc->shown_y,
+					drmmode_crtc->shown_w,
+					drmmode_crtc->shown_h, mode_blob);
 }
 
+/*
+ * The tile's modeset failed after set_mode_major reported success: go
+ * back to what the kernel still shows and tell RandR.
+ */
 static void
-drmmode_crtc_dpms(xf86CrtcPtr crtc, int mode)
+drmmode_crtc_tile_modeset_failed(xf86CrtcPtr crtc)
 {
-#if 0
-	xf86CrtcConfigPtr   xf86_config = XF86_CRTC_CONFIG_PTR(crtc->scrn);
-//	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
-//	drmmode_ptr drmmode = drmmode_crtc->drmmode;
+	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+	drmmode_ptr drmmode = drmmode_crtc->drmmode;
+	drmModeCrtcPtr kcrtc;
+	int i;
 
-	/* bonghits in the randr 1.2 - uses dpms to disable crtc - bad buzz */
-	if (mode == DPMSModeOff) {
-//		drmModeSetCrtc(drmmode->fd, drmmode_crtc->mode_crtc->crtc_id,
-//			       0, 0, 0, NULL, 0, NULL);
+	for (i = 0; i < 2; i++)
+		if (drmmode_crtc->tile_old_scanout[i].fb_id)
+			drmmode_scanout_swap(&drmmode_crtc->scanout[i],
+					     &drmmode_crtc->tile_old_scanout[i]);
+
+	kcrtc = drmModeGetCrtc(drmmode->fd, drmmode_crtc->mode_crtc->crtc_id);
+	crtc->enabled = kcrtc && kcrtc->mode_valid;
+	crtc->mode = drmmode_crtc->tile_saved_mode;
+	crtc->x = drmmode_crtc->tile_saved_x;
+	crtc->y = drmmode_crtc->tile_saved_y;
+	crtc->rotation = drmmode_crtc->tile_saved_rotation;
+	if (kcrtc) {
+		drmmode_crtc->shown_fb_id = kcrtc->buffer_id;
+		drmmode_crtc->shown_x = kcrtc->x;
+		drmmode_crtc->shown_y = kcrtc->y;
+		drmmode_crtc->shown_w = kcrtc->mode.hdisplay;
+		drmmode_crtc->shown_h = kcrtc->mode.vdisplay;
+		drmModeFreeCrtc(kcrtc);
 	}
-#endif
+	drmmode_crtc->scanout_id =
+		drmmode_crtc->scanout[1].fb_id &&
+		drmmode_crtc->scanout[1].fb_id == drmmode_crtc->shown_fb_id;
+	drmmode_crtc->use_scanout = drmmode_crtc->shown_fb_id &&
+		drmmode_crtc->scanout[drmmode_crtc->scanout_id].fb_id ==
+		drmmode_crtc->shown_fb_id;
 }
 
-#if 0
-static PixmapPtr
-create_pixmap_for_fbcon(drmmode_ptr drmmode,
-			ScrnInfoPtr pScrn, int crtc_id)
+/*
+ * Commit the held back tile modesets, all in one go.  Should the kernel
+ * refuse that, set the crtcs one at a time like any other.
+ */
+void
+drmmode_flush_tile_modesets(drmmode_ptr drmmode)
 {
-	xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(pScrn);
-	drmmode_crtc_private_ptr drmmode_crtc;
-	ScreenPtr pScreen = pScrn->pScreen;
-	PixmapPtr pixmap;
-	struct radeon_bo *bo;
-	drmModeFBPtr fbcon;
-	struct drm_gem_flink flink;
+	xf86CrtcConfigPtr xf86_config;
+	drmModeAtomicReqPtr req;
+	uint32_t *mode_blobs;
+	Bool failed = FALSE;
+	int c, ret = -ENOMEM;
 
-	drmmode_crtc = xf86_config->crtc[crtc_id]->driver_private;
+	if (!drmmode->tile_modeset_pending)
+		return;
+	drmmode->tile_modeset_pending = FALSE;
+	xf86_config = XF86_CRTC_CONFIG_PTR(drmmode->scrn);
 
-	fbcon = drmModeGetFB(drmmode->fd, drmmode_crtc->mode_crtc->buffer_id);
-	if (fbcon == NULL)
-		return NULL;
+	/* whatever was switched off or leased meanwhile stays that way */
+	for (c = 0; c < xf86_config->num_crtc; c++) {
+		xf86CrtcPtr crtc = xf86_config->crtc[c];
+		drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
 
-	flink.handle = fbcon->handle;
-	if (ioctl(drmmode->fd, DRM_IOCTL_GEM_FLINK, &flink) < 0) {
-		xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
-			   "Couldn't flink fbcon handle\n");
-		return NULL;
+		if (!crtc->enabled || drmmode_crtc->leased)
+			drmmode_crtc->tile_modeset = FALSE;
 	}
 
-	bo = radeon_bo_open(drmmode->bufmgr, flink.name, 0, 0, 0, 0);
-	if (bo == NULL) {
-		xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
-			   "Couldn't allocate bo for fbcon handle\n");
-		return NULL;
+	mode_blobs = calloc(xf86_config->num_crtc, sizeof(*mode_blobs));
+	req = drmModeAtomicAlloc();
+	if (mode_blobs && req) {
+		ret = 0;
+		for (c = 0; c < xf86_config->num_crtc && ret == 0; c++) {
+			xf86CrtcPtr crtc = xf86_config->crtc[c];
+			drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+
+			if (drmmode_crtc->tile_modeset)
+				ret = drmmode_crtc_add_tile_modeset(req, crtc,
+								    &mode_blobs[c]);
+		}
+		if (ret == 0)
+			ret = drmModeAtomicCommit(drmmode->fd, req,
+						  DRM_MODE_ATOMIC_ALLOW_MODESET,
+						  NULL);
 	}
+	if (req)
+		drmModeAtomicFree(req);
+	for (c = 0; mode_blobs && c < xf86_config->num_crtc; c++)
+		if (mode_blobs[c])
+			drmModeDestroyPropertyBlob(drmmode->fd, mode_blobs[c]);
+	free(mode_blobs);
 
-	pixmap = drmmode_create_bo_pixmap(pScreen, fbcon->width, fbcon->height,
-					  fbcon->depth, fbcon->bpp,
-					  fbcon->pitch, bo);
-	if (!pixmap) 
-		return NULL;
+	if (ret)
+		xf86DrvMsg(drmmode->scrn->scrnIndex, X_WARNING,
+			   "Tiled modeset commit failed (%s), "
+			   "setting the tiles one at a time\n", strerror(-ret));
 
-	radeon_bo_unref(bo);
-	drmModeFreeFB(fbcon);
-	return pixmap;
-}
+	for (c = 0; c < xf86_config->num_crtc; c++) {
+		xf86CrtcPtr crtc = xf86_config->crtc[c];
+		drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+		uint32_t connector_ids[32];
+		int n;
+
+		if (drmmode_crtc->tile_modeset && ret) {
+			n = drmmode_crtc_connector_ids(crtc, connector_ids,
+						       MS_ARRAY_SIZE(connector_ids));
+			if (drmModeSetCrtc(drmmode->fd,
+					   drmmode_crtc->mode_crtc->crtc_id,
+					   drmmode_crtc->shown_fb_id,
+					   drmmode_crtc->shown_x,
+					   drmmode_crtc->shown_y,
+					   connector_ids, n,
+					   &drmmode_crtc->tile_kmode)) {
+				xf86DrvMsg(crtc->scrn->scrnIndex, X_ERROR,
+					   "failed to set mode on CRTC %d\n",
+					   drmmode_crtc->hw_id);
+				drmmode_crtc_tile_modeset_failed(crtc);
+				failed = TRUE;
+			}
+		}
+		drmmode_crtc->tile_modeset = FALSE;
 
-#endif
+		/* off screen now, whichever way it went */
+		drmmode_scanout_destroy(drmmode, &drmmode_crtc->tile_old_scanout[0]);
+		drmmode_scanout_destroy(drmmode, &drmmode_crtc->tile_old_scanout[1]);
+	}
+
+	if (failed && drmmode->scrn->pScreen)
+		xf86RandR12TellChanged(drmmode->scrn->pScreen);
+}
 
 static Bool
 drmmode_set_mode_major(xf86CrtcPtr crtc, DisplayModePtr mode,
@@ -318,10 +1852,16 @@ drmmode_set_mode_major(xf86CrtcPtr crtc, DisplayModePtr mode,
 	uint32_t fb_id;
 	drmModeModeInfo kmode;
 	int height;
+	drmmode_scanout_rec new_scanout[2];
+	Bool want_scanout = FALSE;
+	Bool plane_scale = FALSE;
+	struct ms_scaler *scaler = NULL;
+	int src_w = 0, src_h = 0;
 
 	height = pScrn->virtualY;
+	memset(new_scanout, 0, sizeof(new_scanout));
 
-	if (drmmode->fb_id == 0) {
+	if (drmmode->fb_id == 0 && drmmode->front_bo) {
 		ret = drmModeAddFB(drmmode->fd,
 				   pScrn->virtualX, height,
                                    pScrn->depth, pScrn->bitsPerPixel,
@@ -344,9 +1884,8 @@ drmmode_set_mode_major(xf86CrtcPtr crtc, DisplayModePtr mode,
 		crtc->x = x;
 		crtc->y = y;
 		crtc->rotation = rotation;
-#if XORG_VERSION_CURRENT >= XORG_VERSION_NUMERIC(1,5,99,0,0)
-		crtc->transformPresent = FALSE;
-#endif
+		/* the modeset takes the origin along */
+		drmmode_crtc->pan_pending = FALSE;
 	}
 
 	output_ids = calloc(sizeof(uint32_t), xf86_config->num_output);
@@ -364,21 +1903,55 @@ drmmode_set_mode_major(xf86CrtcPtr crtc, DisplayModePtr mode,
 				continue;
 
 			drmmode_output = output->driver_private;
+			if (!drmmode_output->mode_output)
+				continue;
 			output_ids[output_count] = drmmode_output->mode_output->connector_id;
 			output_count++;
 		}
 
+		drmmode_ConvertToKMode(crtc->scrn, &kmode, mode);
+
+		/*
+		 * A pure scale is left to the primary plane if it can, else
+		 * to our own scaler; hide it from xf86CrtcRotate so no
+		 * software shadow is set up.
+		 */
+		drmmode_crtc->plane_scaled = FALSE;
+		plane_scale = drmmode_crtc_scale_transform(crtc, x, y,
+							   &src_w, &src_h);
+		/* ask first, so a refusal costs no modeset of its own */
+		if (plane_scale &&
+		    !drmmode_crtc_set_plane_scaled(crtc, &kmode, output_ids,
+						   output_count, drmmode->fb_id,
+						   x, y, src_w, src_h, TRUE))
+			plane_scale = FALSE;
+		if (!plane_scale &&
+		    drmmode_crtc_sw_scale_transform(crtc, x, y,
+						    &src_w, &src_h)) {
+			scaler = ms_scaler_create(src_w, src_h, mode->HDisplay,
+						  mode->VDisplay);
+			if (scaler && !drmmode->scaler_pool)
+				drmmode->scaler_pool =
+					ms_scaler_pool_create(drmmode->scaler_threads - 1);
+		}
+		if (plane_scale || scaler)
+			crtc->transformPresent = FALSE;
 		if (!xf86CrtcRotate(crtc)) {
+			if (plane_scale || scaler)
+				crtc->transformPresent = TRUE;
 			goto done;
 		}
+		if (plane_scale || scaler)
+			crtc->transformPresent = TRUE;
 #if XORG_VERSION_CURRENT >= XORG_VERSION_NUMERIC(1,7,0,0,0)
 		crtc->funcs->gamma_set(crtc, crtc->gamma_red, crtc->gamma_green,
 				       crtc->gamma_blue, crtc->gamma_size);
 #endif
-		
-		drmmode_ConvertToKMode(crtc->scrn, &kmode, mode);
 
 		fb_id = drmmode->fb_id;
+		drmmode_crtc->use_scanout = FALSE;
+		/* a new mode may well take async flips again */
+		drmmode_crtc->async_flip_refused = FALSE;
 #ifdef MODESETTING_OUTPUT_SLAVE_SUPPORT
 		if (crtc->randr_crtc->scanout_pixmap) {
     			msPixmapPrivPtr ppriv = msGetPixmapPriv(drmmode, crtc->randr_crtc->scanout_pixmap);
@@ -389,14 +1962,91 @@ drmmode_set_mode_major(xf86CrtcPtr crtc, DisplayModePtr mode,
 		if (drmmode_crtc->rotate_fb_id) {
 			fb_id = drmmode_crtc->rotate_fb_id;
 			x = y = 0;
+		} else if (drmmode->per_crtc_scanout) {
+			/* a new mode size needs new bos, keep the old ones lit until then */
+			if (!drmmode_crtc_scanout_alloc(crtc, mode->HDisplay,
+							mode->VDisplay,
+							new_scanout)) {
+				ret = FALSE;
+				goto done;
+			}
+			want_scanout = TRUE;
+			x = y = 0;
 		}
-		ret = drmModeSetCrtc(drmmode->fd, drmmode_crtc->mode_crtc->crtc_id,
-				     fb_id, x, y, output_ids, output_count, &kmode);
-		if (ret)
+
+		if (want_scanout) {
+			struct ms_scaler *old_scaler = drmmode_crtc->scaler;
+
+			drmmode_crtc_wait_pending_flip(crtc);
+			for (i = 0; i < 2; i++)
+				if (new_scanout[i].fb_id)
+					drmmode_scanout_swap(&drmmode_crtc->scanout[i],
+							     &new_scanout[i]);
+			drmmode_crtc->scaler = scaler;
+			scaler = old_scaler;
+			fb_id = drmmode_crtc->scanout[drmmode_crtc->scanout_id].fb_id;
+			drmmode_crtc->use_scanout = fb_id != 0;
+			if (drmmode_crtc->use_scanout)
+				drmmode_crtc_scanout_refresh(crtc);
+		}
+
+		if (plane_scale)
+			ret = drmmode_crtc_set_plane_scaled(crtc, &kmode,
+							    output_ids,
+							    output_count,
+							    fb_id, x, y,
+							    src_w, src_h,
+							    FALSE) ? 0 : -EINVAL;
+		else if (drmmode_crtc_defer_tile_modeset(crtc, &kmode,
+							 &saved_mode, saved_x,
+							 saved_y, saved_rotation,
+							 new_scanout))
+			ret = 0;
+		else
+			ret = drmModeSetCrtc(drmmode->fd,
+					     drmmode_crtc->mode_crtc->crtc_id,
+					     fb_id, x, y, output_ids,
+					     output_count, &kmode);
+		if (ret == 0 && !plane_scale) {
+			drmmode_crtc->shown_fb_id = fb_id;
+			drmmode_crtc->shown_x = x;
+			drmmode_crtc->shown_y = y;
+			drmmode_crtc->shown_w = mode->HDisplay;
+			drmmode_crtc->shown_h = mode->VDisplay;
+			if (want_scanout && drmmode_crtc->scaler)
+				drmmode_crtc_set_scaled_transform(crtc, crtc->x,
+								  crtc->y,
+								  src_w, src_h);
+		}
+		if (ret) {
 			xf86DrvMsg(crtc->scrn->scrnIndex, X_ERROR,
 				   "failed to set mode: %s", strerror(-ret));
-		else
+			/* the previous scanouts, if any, are still the live ones */
+			for (i = 0; i < 2; i++)
+				if (new_scanout[i].fb_id)
+					drmmode_scanout_swap(&drmmode_crtc->scanout[i],
+							     &new_scanout[i]);
+			if (want_scanout) {
+				struct ms_scaler *new_scaler = drmmode_crtc->scaler;
+
+				drmmode_crtc->scaler = scaler;
+				scaler = new_scaler;
+			}
+			if (drmmode_crtc->use_scanout)
+				drmmode_crtc->use_scanout =
+					drmmode_crtc->scanout[drmmode_crtc->scanout_id].fb_id != 0;
+		} else {
 			ret = TRUE;
+			/* not scanning out of our own bos, nothing to scale into */
+			if (!want_scanout) {
+				ms_scaler_destroy(drmmode_crtc->scaler);
+				drmmode_crtc->scaler = NULL;
+			}
+		}
+
+		/* whichever scanouts are not on screen now can go */
+		drmmode_scanout_destroy(drmmode, &new_scanout[0]);
+		drmmode_scanout_destroy(drmmode, &new_scanout[1]);
 
 		if (crtc->scrn->pScreen)
 			xf86CrtcSetScreenSubpixelOrder(crtc->scrn->pScreen);
@@ -417,6 +2067,8 @@ drmmode_set_mode_major(xf86CrtcPtr crtc, DisplayModePtr mode,
 		xf86_reload_cursors(pScrn->pScreen);
 #endif
 done:
+	/* whichever scaler lost out */
+	ms_scaler_destroy(scaler);
 	if (!ret) {
 		crtc->x = saved_x;
 		crtc->y = saved_y;
@@ -443,6 +2095,15 @@ drmmode_set_cursor_position (xf86CrtcPtr crtc, int x, int y)
 	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
 	drmmode_ptr drmmode = drmmode_crtc->drmmode;
 
+	/* the cursor plane is not scaled along with the picture */
+	if (drmmode_crtc->plane_scaled || drmmode_crtc->scaler) {
+		int w, h;
+
+		drmmode_crtc_source_size(crtc, &w, &h);
+		x = x * crtc->mode.HDisplay / w;
+		y = y * crtc->mode.VDisplay / h;
+	}
+
 	drmModeMoveCursor(drmmode->fd, drmmode_crtc->mode_crtc->crtc_id, x, y);
 }
 
@@ -597,35 +2258,105 @@ drmmode_crtc_init(ScrnInfoPtr pScrn, drmmode_ptr drmmode, int num)
 	drmmode_crtc = xnfcalloc(sizeof(drmmode_crtc_private_rec), 1);
 	drmmode_crtc->mode_crtc = drmModeGetCrtc(drmmode->fd, drmmode->mode_res->crtcs[num]);
 	drmmode_crtc->drmmode = drmmode;
+	drmmode_crtc->hw_id = num;
+	drmmode_crtc->vblank_pipe = ms_crtc_vblank_pipe(num);
+	drmmode_crtc_init_plane(drmmode, drmmode_crtc, num);
+	drmmode_prop_info_init(drmmode->fd, drmmode_crtc->mode_crtc->crtc_id,
+			       DRM_MODE_OBJECT_CRTC, vrr_enabled_name,
+			       &drmmode_crtc->vrr_prop_id, NULL, 1);
+	RegionNull(&drmmode_crtc->scanout_damage);
+	RegionNull(&drmmode_crtc->scanout_last_damage);
 	crtc->driver_private = drmmode_crtc;
 }
 
+static xf86OutputStatus
+drmmode_connector_status(drmModeConnectorPtr koutput)
+{
+	switch (koutput->connection) {
+	case DRM_MODE_CONNECTED:
+		return XF86OutputStatusConnected;
+	case DRM_MODE_DISCONNECTED:
+		return XF86OutputStatusDisconnected;
+	default:
+	case DRM_MODE_UNKNOWNCONNECTION:
+		return XF86OutputStatusUnknown;
+	}
+}
+
+/* the next detect of every output goes all the way to the monitor */
+void
+drmmode_force_probe(ScrnInfoPtr scrn)
+{
+	xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(scrn);
+	int i;
+
+	for (i = 0; i < xf86_config->num_output; i++) {
+		drmmode_output_private_ptr drmmode_output =
+			xf86_config->output[i]->driver_private;
+
+		drmmode_output->probe_pending = TRUE;
+	}
+}
+
+/*
+ * A full probe (drmModeGetConnector) has the kernel read EDID over DDC,
+ * which takes tens of ms per output.  That is only done for outputs a
+ * hotplug event or drmmode_force_probe() asked for; RandR queries from
+ * clients get the state the kernel already has.
+ */
 static xf86OutputStatus
 drmmode_output_detect(xf86OutputPtr output)
 {
 	/* go to the hw and retrieve a new output struct */
 	drmmode_output_private_ptr drmmode_output = output->driver_private;
 	drmmode_ptr drmmode = drmmode_output->drmmode;
-	xf86OutputStatus status;
-	drmModeFreeConnector(drmmode_output->mode_output);
+	drmModeConnectorPtr koutput;
+	Bool forced = drmmode_output->probe_pending;
 
-	drmmode_output->mode_output = drmModeGetConnector(drmmode->fd, drmmode_output->output_id);
-	if (!drmmode_output->mode_output)
+	/* out of the desktop while some other client drives it */
+	if (drmmode_output->leased || drmmode_output->output_id == -1)
 		return XF86OutputStatusDisconnected;
 
-	switch (drmmode_output->mode_output->connection) {
-	case DRM_MODE_CONNECTED:
-		status = XF86OutputStatusConnected;
-		break;
-	case DRM_MODE_DISCONNECTED:
-		status = XF86OutputStatusDisconnected;
-		break;
-	default:
-	case DRM_MODE_UNKNOWNCONNECTION:
-		status = XF86OutputStatusUnknown;
-		break;
+#ifdef HAVE_UDEV
+	/* the probe threads are on it, a client asking doesn't wait for them */
+	if (drmmode->probe && !drmmode_output->probed)
+		forced = FALSE;
+#endif
+
+	/* hotplug reprobes only go to the connectors the events were for */
+	if (drmmode->hotplug_probe && !forced && drmmode_output->mode_output)
+		return drmmode_connector_status(drmmode_output->mode_output);
+
+	if (drmmode_output->probed) {
+		/* the probe threads went to the hw for us already */
+		koutput = drmmode_output->probed;
+		drmmode_output->probed = NULL;
+		forced = TRUE;
+		drmmode_output->conn_props.valid = FALSE;
+	}
+#ifdef HAVE_DRMMODEGETCONNECTORCURRENT
+	else if (!forced && drmmode_output->mode_output)
+		koutput = drmModeGetConnectorCurrent(drmmode->fd,
+						     drmmode_output->output_id);
+#endif
+	else {
+		koutput = drmModeGetConnector(drmmode->fd,
+					      drmmode_output->output_id);
+		forced = TRUE;
+		/* hotplug and property change events both end up here */
+		drmmode_output->conn_props.valid = FALSE;
 	}
-	return status;
+	xf86DrvMsgVerb(output->scrn->scrnIndex, X_INFO, forced ? 3 : 4,
+		       "Output %s: %s\n", output->name,
+		       forced ? "probed" : "reusing the kernel's connector state");
+	drmmode_output->probe_pending = drmmode_output->probe_pending && !forced;
+
+	drmModeFreeConnector(drmmode_output->mode_output);
+	drmmode_output->mode_output = koutput;
+	if (!drmmode_output->mode_output)
+		return XF86OutputStatusDisconnected;
+
+	return drmmode_connector_status(drmmode_output->mode_output);
 }
 
 static Bool
@@ -634,40 +2365,223 @@ drmmode_output_mode_valid(xf86OutputPtr output, DisplayModePtr pModes)
 	return MODE_OK;
 }
 
+static const char * const connector_prop_names[DRMMODE_CONNECTOR__COUNT] = {
+	[DRMMODE_CONNECTOR_EDID] = "EDID",
+	[DRMMODE_CONNECTOR_DPMS] = "DPMS",
+	[DRMMODE_CONNECTOR_SCALING_MODE] = "scaling mode",
+	[DRMMODE_CONNECTOR_TILE] = "TILE",
+	[DRMMODE_CONNECTOR_PATH] = "PATH",
+};
+
+/* what a property has to be, besides its name, to be the one we want */
+static const uint32_t connector_prop_flags[DRMMODE_CONNECTOR__COUNT] = {
+	[DRMMODE_CONNECTOR_EDID] = DRM_MODE_PROP_BLOB,
+	[DRMMODE_CONNECTOR_DPMS] = DRM_MODE_PROP_ENUM,
+	[DRMMODE_CONNECTOR_TILE] = DRM_MODE_PROP_BLOB,
+	[DRMMODE_CONNECTOR_PATH] = DRM_MODE_PROP_BLOB,
+};
+
+/* one walk over the connector's properties, the only one until a hotplug */
+static void
+drmmode_connector_props_init(int fd, drmModeConnectorPtr koutput,
+			     drmmode_connector_props_ptr cache)
+{
+	int i, j;
+
+	for (j = 0; j < DRMMODE_CONNECTOR__COUNT; j++) {
+		cache->ids[j] = 0;
+		cache->index[j] = -1;
+	}
+
+	for (i = 0; i < koutput->count_props; i++) {
+		drmModePropertyPtr prop = drmModeGetProperty(fd, koutput->props[i]);
+
+		if (!prop)
+			continue;
+		for (j = 0; j < DRMMODE_CONNECTOR__COUNT; j++) {
+			if ((prop->flags & connector_prop_flags[j]) ==
+			    connector_prop_flags[j] &&
+			    !strcmp(prop->name, connector_prop_names[j])) {
+				cache->ids[j] = prop->prop_id;
+				cache->index[j] = i;
+				break;
+			}
+		}
+		drmModeFreeProperty(prop);
+	}
+	cache->valid = TRUE;
+}
+
+/* index of a well-known property in koutput->props, -1 if it has none */
+static int
+drmmode_connector_prop(int fd, drmModeConnectorPtr koutput,
+		       drmmode_connector_props_ptr cache,
+		       enum drmmode_connector_property which)
+{
+	int i;
+
+	if (!koutput)
+		return -1;
+	if (!cache->valid)
+		drmmode_connector_props_init(fd, koutput, cache);
+
+	i = cache->index[which];
+	if (i < 0 || (i < koutput->count_props &&
+		      koutput->props[i] == cache->ids[which]))
+		return i;
+
+	/* same property, the kernel just listed it somewhere else this time */
+	for (i = 0; i < koutput->count_props; i++) {
+		if (koutput->props[i] == cache->ids[which])
+			break;
+	}
+	if (i == koutput->count_props)
+		i = -1;
+	cache->index[which] = i;
+	return i;
+}
+
+static int
+drmmode_output_prop(drmmode_output_private_ptr drmmode_output,
+		    enum drmmode_connector_property which)
+{
+	return drmmode_connector_prop(drmmode_output->drmmode->fd,
+				      drmmode_output->mode_output,
+				      &drmmode_output->conn_props, which);
+}
+
+/* properties we handle ourselves rather than hand to RandR */
+static Bool
+drmmode_connector_prop_internal(drmmode_connector_props_ptr cache,
+				uint32_t prop_id)
+{
+	return cache->valid &&
+		(prop_id == cache->ids[DRMMODE_CONNECTOR_EDID] ||
+		 prop_id == cache->ids[DRMMODE_CONNECTOR_DPMS] ||
+		 prop_id == cache->ids[DRMMODE_CONNECTOR_TILE] ||
+		 prop_id == cache->ids[DRMMODE_CONNECTOR_PATH]);
+}
+
 static Bool
 has_panel_fitter(xf86OutputPtr output)
 {
 	drmmode_output_private_ptr drmmode_output = output->driver_private;
-	drmModeConnectorPtr koutput = drmmode_output->mode_output;
-	drmmode_ptr drmmode = drmmode_output->drmmode;
-	int i;
 
 	/* Presume that if the output supports scaling, then we have a
 	 * panel fitter capable of adjust any mode to suit.
 	 */
-	for (i = 0; i < koutput->count_props; i++) {
-		drmModePropertyPtr props;
-		Bool found = FALSE;
+	return drmmode_output_prop(drmmode_output,
+				   DRMMODE_CONNECTOR_SCALING_MODE) >= 0;
+}
 
-		props = drmModeGetProperty(drmmode->fd, koutput->props[i]);
-		if (props) {
-			found = strcmp(props->name, "scaling mode") == 0;
-			drmModeFreeProperty(props);
-		}
+/* chunks are this big unless an allocation needs more */
+#define DRMMODE_ARENA_CHUNK 16384
 
-		if (found)
-			return TRUE;
+struct drmmode_arena_chunk {
+	struct drmmode_arena_chunk *next;
+	size_t size, used;
+	char data[] __attribute__((aligned(16)));
+};
+
+static void *
+drmmode_arena_alloc(drmmode_arena_ptr arena, size_t size)
+{
+	struct drmmode_arena_chunk *chunk = arena->chunks;
+	void *ptr;
+
+	size = (size + 15) & ~(size_t)15;
+	if (!chunk || chunk->size - chunk->used < size) {
+		size_t chunk_size = max(size, DRMMODE_ARENA_CHUNK);
+
+		chunk = malloc(sizeof(*chunk) + chunk_size);
+		if (!chunk)
+			return NULL;
+		chunk->size = chunk_size;
+		chunk->used = 0;
+		chunk->next = arena->chunks;
+		arena->chunks = chunk;
 	}
 
-	return FALSE;
+	ptr = chunk->data + chunk->used;
+	chunk->used += size;
+	return ptr;
+}
+
+static char *
+drmmode_arena_strdup(drmmode_arena_ptr arena, const char *str)
+{
+	size_t len = strlen(str) + 1;
+	char *copy = drmmode_arena_alloc(arena, len);
+
+	if (copy)
+		memcpy(copy, str, len);
+	return copy;
+}
+
+/* throw everything away, keeping one chunk for next time */
+static void
+drmmode_arena_reset(drmmode_arena_ptr arena)
+{
+	struct drmmode_arena_chunk *chunk = arena->chunks;
+
+	if (!chunk)
+		return;
+	while (chunk->next) {
+		struct drmmode_arena_chunk *next = chunk->next;
+
+		chunk->next = next->next;
+		free(next);
+	}
+	chunk->used = 0;
+}
+
+static void
+drmmode_arena_fini(drmmode_arena_ptr arena)
+{
+	drmmode_arena_reset(arena);
+	free(arena->chunks);
+	arena->chunks = NULL;
+}
+
+/* copy a mode list into the arena, as far as it has room */
+static DisplayModePtr
+drmmode_arena_dup_modes(drmmode_arena_ptr arena, DisplayModePtr modes)
+{
+	DisplayModePtr head = NULL, prev = NULL, m;
+
+	for (; modes; modes = modes->next) {
+		m = drmmode_arena_alloc(arena, sizeof(*m));
+		if (!m)
+			break;
+		*m = *modes;
+		if (modes->name)
+			m->name = drmmode_arena_strdup(arena, modes->name);
+		m->prev = prev;
+		m->next = NULL;
+		if (prev)
+			prev->next = m;
+		else
+			head = m;
+		prev = m;
+	}
+	return head;
+}
+
+static void
+drmmode_free_modes(DisplayModePtr modes)
+{
+	while (modes)
+		xf86DeleteMode(&modes, modes);
 }
 
 static DisplayModePtr
 drmmode_output_add_gtf_modes(xf86OutputPtr output,
 			     DisplayModePtr Modes)
 {
+	drmmode_output_private_ptr drmmode_output = output->driver_private;
 	xf86MonPtr mon = output->MonInfo;
 	DisplayModePtr i, m, preferred = NULL;
+	drmmode_gtf_key_rec key;
 	int max_x = 0, max_y = 0;
 	float max_vrefresh = 0.0;
 
@@ -688,108 +2602,564 @@ drmmode_output_add_gtf_modes(xf86OutputPtr output,
 	max_vrefresh = max(max_vrefresh, 60.0);
 	max_vrefresh *= (1 + SYNC_TOLERANCE);
 
-	m = xf86GetDefaultModes();
-	xf86ValidateModesSize(output->scrn, m, max_x, max_y, 0);
+	memset(&key, 0, sizeof(key));
+	key.max_x = max_x;
+	key.max_y = max_y;
+	key.max_vrefresh = max_vrefresh;
+	if (preferred) {
+		key.preferred_x = preferred->HDisplay;
+		key.preferred_y = preferred->VDisplay;
+		key.preferred_vrefresh = xf86ModeVRefresh(preferred);
+	}
+
+	/* the default table is long, it's only gone through for new limits */
+	if (!drmmode_output->gtf_cached ||
+	    memcmp(&key, &drmmode_output->gtf_key, sizeof(key))) {
+		m = xf86GetDefaultModes();
+		xf86ValidateModesSize(output->scrn, m, max_x, max_y, 0);
+
+		for (i = m; i; i = i->next) {
+			if (xf86ModeVRefresh(i) > max_vrefresh)
+				i->status = MODE_VSYNC;
+			if (preferred &&
+			    i->HDisplay >= preferred->HDisplay &&
+			    i->VDisplay >= preferred->VDisplay &&
+			    xf86ModeVRefresh(i) >= xf86ModeVRefresh(preferred))
+				i->status = MODE_VSYNC;
+		}
+
+		xf86PruneInvalidModes(output->scrn, &m, FALSE);
+
+		drmmode_arena_reset(&drmmode_output->gtf_arena);
+		drmmode_output->gtf_modes =
+			drmmode_arena_dup_modes(&drmmode_output->gtf_arena, m);
+		drmmode_free_modes(m);
+		drmmode_output->gtf_key = key;
+		drmmode_output->gtf_cached = TRUE;
+	}
+
+	return xf86ModesAdd(Modes,
+			    drmmode_arena_dup_modes(&drmmode_output->mode_arena,
+						    drmmode_output->gtf_modes));
+}
+
+/*
+ * Hand the connector's TILE blob to the server, which groups the outputs
+ * showing tiles of one monitor into a single RandR monitor.
+ */
+static void
+drmmode_output_attach_tile(xf86OutputPtr output)
+{
+#if XF86_OUTPUT_VERSION >= 3
+	drmmode_output_private_ptr drmmode_output = output->driver_private;
+	drmModeConnectorPtr koutput = drmmode_output->mode_output;
+	drmmode_ptr drmmode = drmmode_output->drmmode;
+	struct xf86CrtcTileInfo tile_info, *set = NULL;
+	int i;
+
+	i = drmmode_output_prop(drmmode_output, DRMMODE_CONNECTOR_TILE);
+	if (i >= 0) {
+		if (drmmode_output->tile_blob)
+			drmModeFreePropertyBlob(drmmode_output->tile_blob);
+		drmmode_output->tile_blob =
+			drmModeGetPropertyBlob(drmmode->fd, koutput->prop_values[i]);
+	}
+
+	if (drmmode_output->tile_blob &&
+	    xf86OutputParseKMSTile(drmmode_output->tile_blob->data,
+				   drmmode_output->tile_blob->length,
+				   &tile_info))
+		set = &tile_info;
+	xf86OutputSetTile(output, set);
+#endif
+}
+
+#define DRMMODE_FNV_OFFSET 14695981039346656037ULL
+#define DRMMODE_FNV_PRIME 1099511628211ULL
+
+/* FNV-1a, good enough to tell one monitor from another */
+static uint64_t
+drmmode_hash(uint64_t hash, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+
+	while (len--) {
+		hash ^= *p++;
+		hash *= DRMMODE_FNV_PRIME;
+	}
+	return hash;
+}
+
+/* what the monitor on a connector looks like: its EDID and kernel modes */
+static uint64_t
+drmmode_probe_hash(drmModeConnectorPtr koutput, drmModePropertyBlobPtr edid)
+{
+	uint64_t hash;
+
+	hash = drmmode_hash(DRMMODE_FNV_OFFSET, &koutput->count_modes,
+			    sizeof(koutput->count_modes));
+	hash = drmmode_hash(hash, koutput->modes,
+			    koutput->count_modes * sizeof(*koutput->modes));
+	if (edid)
+		hash = drmmode_hash(hash, edid->data, edid->length);
+	return hash;
+}
+
+static DisplayModePtr
+drmmode_output_get_modes(xf86OutputPtr output)
+{
+	drmmode_output_private_ptr drmmode_output = output->driver_private;
+	drmModeConnectorPtr koutput = drmmode_output->mode_output;
+	drmmode_ptr drmmode = drmmode_output->drmmode;
+	int i;
+	DisplayModePtr Modes = NULL, Mode;
+	xf86MonPtr mon = NULL;
+	uint64_t hash;
+
+	if (!koutput)
+		return NULL;
+
+	/* look for an EDID property */
+	i = drmmode_output_prop(drmmode_output, DRMMODE_CONNECTOR_EDID);
+	if (i >= 0) {
+		if (drmmode_output->edid_blob)
+			drmModeFreePropertyBlob(drmmode_output->edid_blob);
+		drmmode_output->edid_blob = drmModeGetPropertyBlob(drmmode->fd, koutput->prop_values[i]);
+	}
+
+	/*
+	 * The same EDID and kernel modes as last time is the same monitor:
+	 * keep the parsed EDID and hand out another copy of the modes.  The
+	 * server drops the EDID while the output is disconnected, so that
+	 * needs redoing even for the same monitor.
+	 */
+	hash = drmmode_probe_hash(koutput, drmmode_output->edid_blob);
+	if (drmmode_output->probe_cached && hash == drmmode_output->probe_hash &&
+	    (output->MonInfo || !drmmode_output->edid_blob)) {
+		drmmode_output_attach_tile(output);
+		return xf86DuplicateModes(output->scrn, drmmode_output->probe_modes);
+	}
+
+	if (drmmode_output->edid_blob) {
+		mon = xf86InterpretEDID(output->scrn->scrnIndex,
+					drmmode_output->edid_blob->data);
+		if (mon && drmmode_output->edid_blob->length > 128)
+			mon->flags |= MONITOR_EDID_COMPLETE_RAWDATA;
+	}
+	xf86OutputSetEDID(output, mon);
+	drmmode_output_attach_tile(output);
+
+	/*
+	 * modes should already be available.  Our copy lives in the arena,
+	 * the server gets a copy of its own to free as it likes.
+	 */
+	drmmode_arena_reset(&drmmode_output->mode_arena);
+	for (i = 0; i < koutput->count_modes; i++) {
+		char *name;
+
+		Mode = drmmode_arena_alloc(&drmmode_output->mode_arena,
+					   sizeof(DisplayModeRec));
+		name = drmmode_arena_strdup(&drmmode_output->mode_arena,
+					    koutput->modes[i].name);
+		if (!Mode || !name)
+			break;
+
+		drmmode_ConvertFromKMode(output->scrn, &koutput->modes[i], Mode, name);
+		Modes = xf86ModesAdd(Modes, Mode);
+
+	}
+	Modes = drmmode_output_add_gtf_modes(output, Modes);
+
+	drmmode_output->probe_modes = Modes;
+	drmmode_output->probe_hash = hash;
+	drmmode_output->probe_cached = TRUE;
+	return xf86DuplicateModes(output->scrn, Modes);
+}
+
+/* forget the connector and its encoders, they're gone or being replaced */
+static void
+drmmode_output_drop_connector(drmmode_output_private_ptr drmmode_output)
+{
+	int i;
+
+	for (i = 0; i < drmmode_output->num_encoders; i++)
+		drmModeFreeEncoder(drmmode_output->mode_encoders[i]);
+	free(drmmode_output->mode_encoders);
+	drmmode_output->mode_encoders = NULL;
+	drmmode_output->num_encoders = 0;
+	drmModeFreeConnector(drmmode_output->mode_output);
+	drmmode_output->mode_output = NULL;
+	drmModeFreeConnector(drmmode_output->probed);
+	drmmode_output->probed = NULL;
+}
+
+static void
+drmmode_output_destroy(xf86OutputPtr output)
+{
+	drmmode_output_private_ptr drmmode_output = output->driver_private;
+	int i;
+
+	if (drmmode_output->edid_blob)
+		drmModeFreePropertyBlob(drmmode_output->edid_blob);
+	if (drmmode_output->tile_blob)
+		drmModeFreePropertyBlob(drmmode_output->tile_blob);
+	drmmode_arena_fini(&drmmode_output->mode_arena);
+	drmmode_arena_fini(&drmmode_output->gtf_arena);
+	for (i = 0; i < drmmode_output->num_props; i++) {
+		drmModeFreeProperty(drmmode_output->props[i].mode_prop);
+		free(drmmode_output->props[i].atoms);
+	}
+	free(drmmode_output->props);
+	free(drmmode_output->prop_hash);
+	drmmode_output_drop_connector(drmmode_output);
+	free(drmmode_output);
+	output->driver_private = NULL;
+}
+
+static void
+drmmode_output_dpms(xf86OutputPtr output, int mode)
+{
+	drmmode_output_private_ptr drmmode_output = output->driver_private;
+	drmModeConnectorPtr koutput = drmmode_output->mode_output;
+	drmmode_ptr drmmode = drmmode_output->drmmode;
+
+	if (!koutput)
+		return;
+
+	drmModeConnectorSetProperty(drmmode->fd, koutput->connector_id,
+				    drmmode_output->dpms_enum_id, mode);
+	return;
+}
+
+#ifdef MODESETTING_PRESENT_SUPPORT
+static const char * const writeback_prop_names[] = {
+	"CRTC_ID", "WRITEBACK_FB_ID", "WRITEBACK_OUT_FENCE_PTR",
+	"WRITEBACK_PIXEL_FORMATS",
+};
+
+/*
+ * Keep a writeback connector for captures rather than make an output of
+ * it, there's no monitor behind it.  Our fbs are XRGB8888, connectors
+ * that can't write that are no use.
+ */
+static void
+drmmode_writeback_init(drmmode_ptr drmmode, drmModeConnectorPtr koutput)
+{
+	drmmode_writeback_ptr writebacks, wb;
+	drmModePropertyBlobPtr formats;
+	uint32_t ids[MS_ARRAY_SIZE(writeback_prop_names)];
+	uint64_t values[MS_ARRAY_SIZE(writeback_prop_names)];
+	uint32_t possible_crtcs = 0;
+	Bool xrgb = FALSE;
+	int i;
+
+	if (drmmode->cpp != 4 ||
+	    !drmmode_prop_info_init(drmmode->fd, koutput->connector_id,
+				    DRM_MODE_OBJECT_CONNECTOR,
+				    writeback_prop_names, ids, values,
+				    MS_ARRAY_SIZE(writeback_prop_names)) ||
+	    !ids[0] || !ids[1] || !ids[2] || !ids[3])
+		return;
+
+	formats = drmModeGetPropertyBlob(drmmode->fd, values[3]);
+	for (i = 0; formats && i < formats->length / sizeof(uint32_t); i++)
+		if (((uint32_t *)formats->data)[i] == DRM_FORMAT_XRGB8888)
+			xrgb = TRUE;
+	drmModeFreePropertyBlob(formats);
+	if (!xrgb)
+		return;
+
+	for (i = 0; i < koutput->count_encoders; i++) {
+		drmModeEncoderPtr encoder = drmModeGetEncoder(drmmode->fd,
+							      koutput->encoders[i]);
+
+		if (encoder) {
+			possible_crtcs |= encoder->possible_crtcs;
+			drmModeFreeEncoder(encoder);
+		}
+	}
+
+	writebacks = realloc(drmmode->writebacks,
+			     (drmmode->num_writebacks + 1) * sizeof(*writebacks));
+	if (!writebacks)
+		return;
+	drmmode->writebacks = writebacks;
+	wb = &writebacks[drmmode->num_writebacks++];
+	memset(wb, 0, sizeof(*wb));
+	wb->connector_id = koutput->connector_id;
+	wb->possible_crtcs = possible_crtcs;
+	wb->crtc_prop_id = ids[0];
+	wb->fb_prop_id = ids[1];
+	wb->fence_prop_id = ids[2];
+	wb->fence_fd = -1;
+
+	xf86DrvMsg(drmmode->scrn->scrnIndex, X_INFO,
+		   "Writeback connector %u available for capture\n",
+		   koutput->connector_id);
+}
+
+/* the frame in flight is written: tell whoever watches the pixmap */
+static void
+drmmode_writeback_done(int fd, void *data)
+{
+	drmmode_writeback_ptr wb = data;
+	PixmapPtr pixmap = wb->pixmap;
 
-	for (i = m; i; i = i->next) {
-		if (xf86ModeVRefresh(i) > max_vrefresh)
-			i->status = MODE_VSYNC;
-		if (preferred &&
-		    i->HDisplay >= preferred->HDisplay &&
-		    i->VDisplay >= preferred->VDisplay &&
-		    xf86ModeVRefresh(i) >= xf86ModeVRefresh(preferred))
-			i->status = MODE_VSYNC;
+	if (wb->fence_handler) {
+		xf86RemoveGeneralHandler(wb->fence_handler);
+		wb->fence_handler = NULL;
+	}
+	if (wb->fence_fd >= 0) {
+		close(wb->fence_fd);
+		wb->fence_fd = -1;
 	}
 
-	xf86PruneInvalidModes(output->scrn, &m, FALSE);
+	if (pixmap) {
+		BoxRec box = { 0, 0, pixmap->drawable.width,
+			       pixmap->drawable.height };
+		RegionRec region;
 
-	return xf86ModesAdd(Modes, m);
+		RegionInit(&region, &box, 1);
+		DamageRegionAppend(&pixmap->drawable, &region);
+		DamageRegionProcessPending(&pixmap->drawable);
+		RegionUninit(&region);
+	}
 }
 
-static DisplayModePtr
-drmmode_output_get_modes(xf86OutputPtr output)
+/*
+ * Stop a capture.  A frame still being written goes into the old bo, and
+ * that goes back to the bo pool with the pixmap, so wait for the frame's
+ * fence first.  It signals within a frame or two; the timeout is only
+ * there so a wedged display engine can't hang the server.
+ */
+static void
+drmmode_writeback_release(drmmode_ptr drmmode, drmmode_writeback_ptr wb)
 {
-	drmmode_output_private_ptr drmmode_output = output->driver_private;
-	drmModeConnectorPtr koutput = drmmode_output->mode_output;
-	drmmode_ptr drmmode = drmmode_output->drmmode;
-	int i;
-	DisplayModePtr Modes = NULL, Mode;
-	drmModePropertyPtr props;
-	xf86MonPtr mon = NULL;
+	PixmapPtr pixmap = wb->pixmap;
 
-	if (!koutput)
-		return NULL;
+	if (wb->fence_fd >= 0) {
+		struct pollfd pfd = { .fd = wb->fence_fd, .events = POLLIN };
 
-	/* look for an EDID property */
-	for (i = 0; i < koutput->count_props; i++) {
-		props = drmModeGetProperty(drmmode->fd, koutput->props[i]);
-		if (props && (props->flags & DRM_MODE_PROP_BLOB)) {
-			if (!strcmp(props->name, "EDID")) {
-				if (drmmode_output->edid_blob)
-					drmModeFreePropertyBlob(drmmode_output->edid_blob);
-				drmmode_output->edid_blob = drmModeGetPropertyBlob(drmmode->fd, koutput->prop_values[i]);
-			}
-			drmModeFreeProperty(props);
+		while (poll(&pfd, 1, 1000) < 0 &&
+		       (errno == EINTR || errno == EAGAIN))
+			;
+	}
+	wb->pixmap = NULL;
+	if (wb->fence_handler || wb->fence_fd >= 0)
+		drmmode_writeback_done(-1, wb);
+
+	if (wb->bound_crtc_id) {
+		drmModeAtomicReqPtr req = drmModeAtomicAlloc();
+
+		if (req) {
+			if (drmModeAtomicAddProperty(req, wb->connector_id,
+						     wb->crtc_prop_id, 0) > 0 &&
+			    drmModeAtomicCommit(drmmode->fd, req,
+						DRM_MODE_ATOMIC_ALLOW_MODESET,
+						NULL) == 0)
+				wb->bound_crtc_id = 0;
+			drmModeAtomicFree(req);
 		}
 	}
 
-	if (drmmode_output->edid_blob) {
-		mon = xf86InterpretEDID(output->scrn->scrnIndex,
-					drmmode_output->edid_blob->data);
-		if (mon && drmmode_output->edid_blob->length > 128)
-			mon->flags |= MONITOR_EDID_COMPLETE_RAWDATA;
+	if (wb->fb_id) {
+		drmModeRmFB(drmmode->fd, wb->fb_id);
+		wb->fb_id = 0;
 	}
-	xf86OutputSetEDID(output, mon);
+	if (pixmap)
+		pixmap->drawable.pScreen->DestroyPixmap(pixmap);
+	wb->output = NULL;
+}
 
-	/* modes should already be available */
-	for (i = 0; i < koutput->count_modes; i++) {
-		Mode = xnfalloc(sizeof(DisplayModeRec));
+/*
+ * Start the next frame of each capture whose previous one is written.
+ * The commit completes on the next vblank, and its fence waking us up
+ * gets the frame after that going.
+ */
+void
+drmmode_writeback_frame(drmmode_ptr drmmode)
+{
+	int i;
 
-		drmmode_ConvertFromKMode(output->scrn, &koutput->modes[i], Mode);
-		Modes = xf86ModesAdd(Modes, Mode);
+	for (i = 0; i < drmmode->num_writebacks; i++) {
+		drmmode_writeback_ptr wb = &drmmode->writebacks[i];
+		uint32_t flags = DRM_MODE_ATOMIC_NONBLOCK;
+		drmmode_crtc_private_ptr drmmode_crtc;
+		drmModeAtomicReqPtr req;
+		xf86CrtcPtr crtc;
+		uint32_t crtc_id;
+		int ret = 0;
 
-	}
+		if (!wb->pixmap || wb->fence_handler || !drmmode->scrn->vtSema)
+			continue;
+		crtc = wb->output->crtc;
+		if (!crtc || !crtc->enabled)
+			continue;
+		drmmode_crtc = crtc->driver_private;
+		crtc_id = drmmode_crtc->mode_crtc->crtc_id;
+		if (drmmode_crtc->leased ||
+		    !(wb->possible_crtcs & (1 << drmmode_crtc->hw_id)) ||
+		    crtc->mode.HDisplay != wb->pixmap->drawable.width ||
+		    crtc->mode.VDisplay != wb->pixmap->drawable.height)
+			continue;
+
+		/* moving the connector to another crtc is a modeset */
+		if (wb->bound_crtc_id != crtc_id)
+			flags |= DRM_MODE_ATOMIC_ALLOW_MODESET;
+
+		req = drmModeAtomicAlloc();
+		if (!req)
+			return;
+		wb->fence_fd = -1;
+		ret |= drmModeAtomicAddProperty(req, wb->connector_id,
+						wb->crtc_prop_id, crtc_id) <= 0;
+		ret |= drmModeAtomicAddProperty(req, wb->connector_id,
+						wb->fb_prop_id, wb->fb_id) <= 0;
+		ret |= drmModeAtomicAddProperty(req, wb->connector_id,
+						wb->fence_prop_id,
+						(uint64_t)(uintptr_t)&wb->fence_fd) <= 0;
+		if (ret == 0)
+			ret = drmModeAtomicCommit(drmmode->fd, req, flags, NULL);
+		drmModeAtomicFree(req);
+		/* e.g. a flip still pending, try again next time round */
+		if (ret)
+			continue;
 
-	return drmmode_output_add_gtf_modes(output, Modes);
+		wb->bound_crtc_id = crtc_id;
+		if (wb->fence_fd >= 0)
+			wb->fence_handler = xf86AddGeneralHandler(wb->fence_fd,
+								  drmmode_writeback_done,
+								  wb);
+		if (!wb->fence_handler)
+			drmmode_writeback_done(-1, wb);
+	}
 }
 
-static void
-drmmode_output_destroy(xf86OutputPtr output)
+void
+drmmode_writeback_fini(drmmode_ptr drmmode)
 {
-	drmmode_output_private_ptr drmmode_output = output->driver_private;
 	int i;
 
-	if (drmmode_output->edid_blob)
-		drmModeFreePropertyBlob(drmmode_output->edid_blob);
-	for (i = 0; i < drmmode_output->num_props; i++) {
-		drmModeFreeProperty(drmmode_output->props[i].mode_prop);
-		free(drmmode_output->props[i].atoms);
-	}
-	free(drmmode_output->props);
-	for (i = 0; i < drmmode_output->mode_output->count_encoders; i++) {
-		drmModeFreeEncoder(drmmode_output->mode_encoders[i]);
+	for (i = 0; i < drmmode->num_writebacks; i++)
+		drmmode_writeback_release(drmmode, &drmmode->writebacks[i]);
+	free(drmmode->writebacks);
+	drmmode->writebacks = NULL;
+	drmmode->num_writebacks = 0;
+}
+
+/* could a pixmap this size capture some lit crtc? */
+Bool
+drmmode_writeback_size_ok(drmmode_ptr drmmode, int width, int height)
+{
+	xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(drmmode->scrn);
+	int c;
+
+	if (!drmmode->num_writebacks)
+		return FALSE;
+
+	for (c = 0; c < xf86_config->num_crtc; c++) {
+		xf86CrtcPtr crtc = xf86_config->crtc[c];
+
+		if (crtc->enabled && crtc->mode.HDisplay == width &&
+		    crtc->mode.VDisplay == height)
+			return TRUE;
 	}
-	free(drmmode_output->mode_encoders);
-	drmModeFreeConnector(drmmode_output->mode_output);
-	free(drmmode_output);
-	output->driver_private = NULL;
+	return FALSE;
+}
+
+/*
+ * set_property isn't told which client is asking, so RRChangeOutputProperty
+ * is wrapped to note it.  RandR's vector outlives a server generation and
+ * so does this module, hence the check before wrapping.
+ */
+static ClientPtr writeback_client;
+static int (*writeback_change_output_property)(ClientPtr client);
+
+static int
+drmmode_writeback_change_output_property(ClientPtr client)
+{
+	ClientPtr saved = writeback_client;
+	int ret;
+
+	writeback_client = client;
+	ret = writeback_change_output_property(client);
+	writeback_client = saved;
+	return ret;
 }
 
 static void
-drmmode_output_dpms(xf86OutputPtr output, int mode)
+drmmode_writeback_wrap_randr(void)
+{
+	if (ProcRandrVector[X_RRChangeOutputProperty] ==
+	    drmmode_writeback_change_output_property)
+		return;
+	writeback_change_output_property =
+		ProcRandrVector[X_RRChangeOutputProperty];
+	ProcRandrVector[X_RRChangeOutputProperty] =
+		drmmode_writeback_change_output_property;
+}
+
+/*
+ * WRITEBACK_PIXMAP: a client sets it to a pixmap the size of the output's
+ * mode, and from then on the display engine writes each frame of the
+ * output's crtc into the pixmap's bo, with a Damage event on the pixmap
+ * for every one.  None stops that.  Only pixmaps in bos will do, which
+ * is what we give pixmaps the size of a lit crtc, and only the asking
+ * client's own, looked up as that client so access control has its say.
+ */
+static Bool
+drmmode_output_set_writeback(xf86OutputPtr output, RRPropertyValuePtr value)
 {
 	drmmode_output_private_ptr drmmode_output = output->driver_private;
-	drmModeConnectorPtr koutput = drmmode_output->mode_output;
 	drmmode_ptr drmmode = drmmode_output->drmmode;
+	drmmode_writeback_ptr wb = NULL;
+	msPixmapPrivPtr ppriv;
+	PixmapPtr pixmap;
+	XID xid;
+	int i;
 
-	if (!koutput)
-		return;
+	if (value->type != XA_PIXMAP || value->format != 32 || value->size != 1)
+		return FALSE;
+	xid = *(uint32_t *)value->data;
+
+	for (i = 0; i < drmmode->num_writebacks; i++)
+		if (drmmode->writebacks[i].output == output)
+			wb = &drmmode->writebacks[i];
+	if (wb)
+		drmmode_writeback_release(drmmode, wb);
+	if (xid == None)
+		return TRUE;
 
-	drmModeConnectorSetProperty(drmmode->fd, koutput->connector_id,
-				    drmmode_output->dpms_enum_id, mode);
-	return;
-}
+	if (!writeback_client || CLIENT_ID(xid) != writeback_client->index)
+		return FALSE;
+	if (dixLookupResourceByType((void **)&pixmap, xid, RT_PIXMAP,
+				    writeback_client, DixWriteAccess) != Success)
+		return FALSE;
+	ppriv = msGetPixmapPriv(drmmode, pixmap);
+	if (!ppriv->backing_bo || pixmap->drawable.depth != 24 ||
+	    pixmap->drawable.bitsPerPixel != 32)
+		return FALSE;
 
+	for (i = 0; !wb && i < drmmode->num_writebacks; i++)
+		if (!drmmode->writebacks[i].output &&
+		    (drmmode->writebacks[i].possible_crtcs & output->possible_crtcs))
+			wb = &drmmode->writebacks[i];
+	if (!wb)
+		return FALSE;
+
+	if (drmModeAddFB(drmmode->fd, pixmap->drawable.width,
+			 pixmap->drawable.height, 24, 32,
+			 ppriv->backing_bo->pitch, ppriv->backing_bo->handle,
+			 &wb->fb_id)) {
+		wb->fb_id = 0;
+		return FALSE;
+	}
+	pixmap->refcnt++;
+	wb->pixmap = pixmap;
+	wb->output = output;
+	return TRUE;
+}
+#endif
 
 static Bool
 drmmode_property_ignore(drmModePropertyPtr prop)
@@ -799,14 +3169,69 @@ drmmode_property_ignore(drmModePropertyPtr prop)
     /* ignore blob prop */
     if (prop->flags & DRM_MODE_PROP_BLOB)
 	return TRUE;
+    /* ignore properties only meaningful to atomic clients */
+    if (prop->flags & DRM_MODE_PROP_ATOMIC)
+	return TRUE;
     /* ignore standard property */
     if (!strcmp(prop->name, "EDID") ||
+	    !strcmp(prop->name, "TILE") ||
 	    !strcmp(prop->name, "DPMS"))
 	return TRUE;
 
     return FALSE;
 }
 
+static unsigned int
+drmmode_atom_hash(Atom atom, unsigned int mask)
+{
+    return ((uint32_t)atom * 2654435761u) & mask;
+}
+
+/* index the RandR properties by atom, for set_property */
+static void
+drmmode_output_hash_props(drmmode_output_private_ptr drmmode_output)
+{
+    unsigned int size = 4, h;
+    int i;
+
+    while (size < 2 * (unsigned int)drmmode_output->num_props)
+	size <<= 1;
+    drmmode_output->prop_hash = calloc(size, sizeof(int));
+    if (!drmmode_output->prop_hash)
+	return;
+    drmmode_output->prop_hash_mask = size - 1;
+
+    for (i = 0; i < drmmode_output->num_props; i++) {
+	drmmode_prop_ptr p = &drmmode_output->props[i];
+
+	if (!p->atoms)
+	    continue;
+	h = drmmode_atom_hash(p->atoms[0], drmmode_output->prop_hash_mask);
+	while (drmmode_output->prop_hash[h])
+	    h = (h + 1) & drmmode_output->prop_hash_mask;
+	drmmode_output->prop_hash[h] = i + 1;
+    }
+}
+
+static drmmode_prop_ptr
+drmmode_output_find_prop(drmmode_output_private_ptr drmmode_output,
+			 Atom property)
+{
+    unsigned int h;
+    int i;
+
+    if (!drmmode_output->prop_hash)
+	return NULL;
+
+    h = drmmode_atom_hash(property, drmmode_output->prop_hash_mask);
+    while ((i = drmmode_output->prop_hash[h])) {
+	if (drmmode_output->props[i - 1].atoms[0] == property)
+	    return &drmmode_output->props[i - 1];
+	h = (h + 1) & drmmode_output->prop_hash_mask;
+    }
+    return NULL;
+}
+
 static void
 drmmode_output_create_resources(xf86OutputPtr output)
 {
@@ -816,12 +3241,18 @@ drmmode_output_create_resources(xf86OutputPtr output)
     drmModePropertyPtr drmmode_prop;
     int i, j, err;
 
+    if (!mode_output)
+	return;
+
     drmmode_output->props = calloc(mode_output->count_props, sizeof(drmmode_prop_rec));
     if (!drmmode_output->props)
 	return;
     
     drmmode_output->num_props = 0;
     for (i = 0, j = 0; i < mode_output->count_props; i++) {
+	if (drmmode_connector_prop_internal(&drmmode_output->conn_props,
+					    mode_output->props[i]))
+	    continue;
 	drmmode_prop = drmModeGetProperty(drmmode->fd, mode_output->props[i]);
 	if (drmmode_property_ignore(drmmode_prop)) {
 	    drmModeFreeProperty(drmmode_prop);
@@ -892,6 +3323,31 @@ drmmode_output_create_resources(xf86OutputPtr output)
 	    }
 	}
     }
+
+    drmmode_output_hash_props(drmmode_output);
+
+#ifdef MODESETTING_PRESENT_SUPPORT
+    if (drmmode->num_writebacks) {
+	INT32 none = None;
+
+	drmmode_writeback_wrap_randr();
+	drmmode->writeback_atom = MakeAtom("WRITEBACK_PIXMAP",
+					   strlen("WRITEBACK_PIXMAP"), TRUE);
+	err = RRConfigureOutputProperty(output->randr_output,
+		drmmode->writeback_atom, FALSE, FALSE, FALSE, 0, NULL);
+	if (err != 0) {
+	    xf86DrvMsg(output->scrn->scrnIndex, X_ERROR,
+		    "RRConfigureOutputProperty error, %d\n", err);
+	}
+	err = RRChangeOutputProperty(output->randr_output,
+		drmmode->writeback_atom, XA_PIXMAP, 32, PropModeReplace, 1,
+		&none, FALSE, TRUE);
+	if (err != 0) {
+	    xf86DrvMsg(output->scrn->scrnIndex, X_ERROR,
+		    "RRChangeOutputProperty error, %d\n", err);
+	}
+    }
+#endif
 }
 
 static Bool
@@ -900,47 +3356,115 @@ drmmode_output_set_property(xf86OutputPtr output, Atom property,
 {
     drmmode_output_private_ptr drmmode_output = output->driver_private;
     drmmode_ptr drmmode = drmmode_output->drmmode;
-    int i;
+    drmmode_prop_ptr p;
+    uint64_t val;
 
-    for (i = 0; i < drmmode_output->num_props; i++) {
-	drmmode_prop_ptr p = &drmmode_output->props[i];
+#ifdef MODESETTING_PRESENT_SUPPORT
+    if (drmmode->writeback_atom && property == drmmode->writeback_atom)
+	return drmmode_output_set_writeback(output, value);
+#endif
 
-	if (p->atoms[0] != property)
-	    continue;
+    p = drmmode_output_find_prop(drmmode_output, property);
+    if (!p)
+	return TRUE;
 
-	if (p->mode_prop->flags & DRM_MODE_PROP_RANGE) {
-	    uint32_t val;
+    if (p->mode_prop->flags & DRM_MODE_PROP_RANGE) {
+	if (value->type != XA_INTEGER || value->format != 32 ||
+		value->size != 1)
+	    return FALSE;
+	val = *(uint32_t *)value->data;
+    } else if (p->mode_prop->flags & DRM_MODE_PROP_ENUM) {
+	Atom	atom;
+	int	j;
+
+	if (value->type != XA_ATOM || value->format != 32 || value->size != 1)
+	    return FALSE;
+	memcpy(&atom, value->data, 4);
+
+	/* atoms[j + 1] was made from enums[j]'s name */
+	for (j = 0; j < p->mode_prop->count_enums; j++)
+	    if (p->atoms[j + 1] == atom)
+		break;
+	if (j == p->mode_prop->count_enums)
+	    return TRUE;
+	val = p->mode_prop->enums[j].value;
+    } else
+	return TRUE;
 
-	    if (value->type != XA_INTEGER || value->format != 32 ||
-		    value->size != 1)
-		return FALSE;
-	    val = *(uint32_t *)value->data;
+    /* with atomic, everything a batch of requests set goes in one commit */
+    if (drmmode->atomic_modeset) {
+	p->pending_value = val;
+	p->pending = TRUE;
+	drmmode->prop_change_pending = TRUE;
+	return TRUE;
+    }
 
-	    drmModeConnectorSetProperty(drmmode->fd, drmmode_output->output_id,
-		    p->mode_prop->prop_id, (uint64_t)val);
-	    return TRUE;
-	} else if (p->mode_prop->flags & DRM_MODE_PROP_ENUM) {
-	    Atom	atom;
-	    const char	*name;
-	    int		j;
+    drmModeConnectorSetProperty(drmmode->fd, drmmode_output->output_id,
+	    p->mode_prop->prop_id, val);
+    return TRUE;
+}
 
-	    if (value->type != XA_ATOM || value->format != 32 || value->size != 1)
-		return FALSE;
-	    memcpy(&atom, value->data, 4);
-	    name = NameForAtom(atom);
-
-	    /* search for matching name string, then set its value down */
-	    for (j = 0; j < p->mode_prop->count_enums; j++) {
-		if (!strcmp(p->mode_prop->enums[j].name, name)) {
-		    drmModeConnectorSetProperty(drmmode->fd, drmmode_output->output_id,
-			    p->mode_prop->prop_id, p->mode_prop->enums[j].value);
-		    return TRUE;
+/*
+ * Commit the connector property changes held back by set_property, all
+ * in one go.  Should the kernel refuse that, set them one at a time.
+ */
+void
+drmmode_flush_output_props(drmmode_ptr drmmode)
+{
+	xf86CrtcConfigPtr xf86_config;
+	drmModeAtomicReqPtr req;
+	int i, j, ret = -ENOMEM;
+
+	if (!drmmode->prop_change_pending)
+		return;
+	drmmode->prop_change_pending = FALSE;
+	xf86_config = XF86_CRTC_CONFIG_PTR(drmmode->scrn);
+
+	req = drmModeAtomicAlloc();
+	for (i = 0; req && i < xf86_config->num_output; i++) {
+		drmmode_output_private_ptr drmmode_output =
+			xf86_config->output[i]->driver_private;
+
+		for (j = 0; j < drmmode_output->num_props; j++) {
+			drmmode_prop_ptr p = &drmmode_output->props[j];
+
+			if (!p->pending)
+				continue;
+			if (drmmode_output->output_id == -1) {
+				p->pending = FALSE;
+				continue;
+			}
+			if (drmModeAtomicAddProperty(req,
+						     drmmode_output->output_id,
+						     p->mode_prop->prop_id,
+						     p->pending_value) < 0)
+				goto commit;
 		}
-	    }
 	}
-    }
+	if (req)
+		ret = drmModeAtomicCommit(drmmode->fd, req,
+					  DRM_MODE_ATOMIC_ALLOW_MODESET, NULL);
+commit:
+	if (req)
+		drmModeAtomicFree(req);
 
-    return TRUE;
+	for (i = 0; i < xf86_config->num_output; i++) {
+		drmmode_output_private_ptr drmmode_output =
+			xf86_config->output[i]->driver_private;
+
+		for (j = 0; j < drmmode_output->num_props; j++) {
+			drmmode_prop_ptr p = &drmmode_output->props[j];
+
+			if (!p->pending)
+				continue;
+			p->pending = FALSE;
+			if (ret && drmmode_output->output_id != -1)
+				drmModeConnectorSetProperty(drmmode->fd,
+							    drmmode_output->output_id,
+							    p->mode_prop->prop_id,
+							    p->pending_value);
+		}
+	}
 }
 
 static Bool
@@ -989,20 +3513,130 @@ static const char * const output_names[] = { "None",
 					     "DSI",
 };
 
+/* the output for connector_id, if there's one */
+static xf86OutputPtr
+drmmode_find_output(ScrnInfoPtr pScrn, int connector_id)
+{
+	xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(pScrn);
+	int i;
+
+	for (i = 0; i < xf86_config->num_output; i++) {
+		xf86OutputPtr output = xf86_config->output[i];
+		drmmode_output_private_ptr drmmode_output = output->driver_private;
+
+		if (drmmode_output->output_id == connector_id)
+			return output;
+	}
+	return NULL;
+}
+
+/*
+ * Name an output.  Connectors behind an MST hub get new ids every time the
+ * hub comes back, so those are named after their PATH instead: the port
+ * they hang off of, then the hops from there, e.g. DP-1-1-2.
+ */
+static void
+drmmode_output_name(ScrnInfoPtr pScrn, drmmode_ptr drmmode,
+		    drmModeConnectorPtr koutput,
+		    drmmode_connector_props_ptr conn_props, char *name, int len)
+{
+	drmModePropertyBlobPtr path = NULL;
+	int i;
+
+	i = drmmode_connector_prop(drmmode->fd, koutput, conn_props,
+				   DRMMODE_CONNECTOR_PATH);
+	if (i >= 0)
+		path = drmModeGetPropertyBlob(drmmode->fd, koutput->prop_values[i]);
+
+	if (path && path->length > 4 && !strncmp(path->data, "mst:", 4)) {
+		char path_str[64], *hops;
+		xf86OutputPtr parent;
+
+		snprintf(path_str, sizeof(path_str), "%.*s",
+			 (int)path->length, (char *)path->data);
+		parent = drmmode_find_output(pScrn, strtol(path_str + 4, &hops, 10));
+		if (parent) {
+			snprintf(name, len, "%s%s", parent->name, hops);
+			drmModeFreePropertyBlob(path);
+			return;
+		}
+	}
+	drmModeFreePropertyBlob(path);
+
+	/* need to do smart conversion here for compat with non-kms ATI driver */
+	if (koutput->connector_type >= MS_ARRAY_SIZE(output_names))
+		snprintf(name, len, "Unknown-%d", koutput->connector_type_id - 1);
+#ifdef MODESETTING_OUTPUT_SLAVE_SUPPORT
+	else if (pScrn->is_gpu)
+		snprintf(name, len, "%s-%d-%d", output_names[koutput->connector_type], pScrn->scrnIndex - GPU_SCREEN_OFFSET + 1, koutput->connector_type_id - 1);
+#endif
+	else
+		snprintf(name, len, "%s-%d", output_names[koutput->connector_type], koutput->connector_type_id - 1);
+}
+
+/*
+ * Make an output for the connector koutput, which it takes over.  At
+ * runtime (dynamic) a connector that comes back under the name of one
+ * that went away takes over its output, so RandR clients keep seeing the
+ * same one; new ones get RandR outputs of their own.  Returns whether
+ * there's an output for it now.
+ */
+/*
+ * Tie output to the connector koutput, new or back after going away, and
+ * take what follows from it: the crtcs it can use, its size and the rest.
+ */
 static void
-drmmode_output_init(ScrnInfoPtr pScrn, drmmode_ptr drmmode, int num, int *num_dvi, int *num_hdmi)
+drmmode_output_attach(xf86OutputPtr output, drmModeConnectorPtr koutput,
+		      drmModeEncoderPtr *kencoders,
+		      const drmmode_connector_props_rec *conn_props)
+{
+	drmmode_output_private_ptr drmmode_output = output->driver_private;
+	int i;
+
+	drmmode_output->output_id = koutput->connector_id;
+	drmmode_output->mode_output = koutput;
+	drmmode_output->mode_encoders = kencoders;
+	drmmode_output->num_encoders = koutput->count_encoders;
+	drmmode_output->conn_props = *conn_props;
+	output->mm_width = koutput->mmWidth;
+	output->mm_height = koutput->mmHeight;
+
+	output->subpixel_order = subpixel_conv_table[koutput->subpixel];
+
+	output->possible_crtcs = 0x7f;
+	for (i = 0; i < koutput->count_encoders; i++) {
+		output->possible_crtcs &= kencoders[i]->possible_crtcs;
+	}
+	/* work out the possible clones later */
+	output->possible_clones = 0;
+
+	drmmode_output->dpms_enum_id = 0;
+	if (drmmode_output_prop(drmmode_output, DRMMODE_CONNECTOR_DPMS) >= 0)
+		drmmode_output->dpms_enum_id =
+			drmmode_output->conn_props.ids[DRMMODE_CONNECTOR_DPMS];
+}
+
+static Bool
+drmmode_output_init(ScrnInfoPtr pScrn, drmmode_ptr drmmode,
+		    drmModeConnectorPtr koutput, Bool dynamic)
 {
+	xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(pScrn);
 	xf86OutputPtr output;
-	drmModeConnectorPtr koutput;
 	drmModeEncoderPtr *kencoders = NULL;
 	drmmode_output_private_ptr drmmode_output;
-	drmModePropertyPtr props;
+	drmmode_connector_props_rec conn_props = { .valid = FALSE };
 	char name[32];
 	int i;
 
-	koutput = drmModeGetConnector(drmmode->fd, drmmode->mode_res->connectors[num]);
-	if (!koutput)
-		return;
+	/* the captures are set up once, at startup */
+	if (koutput->connector_type == DRM_MODE_CONNECTOR_WRITEBACK) {
+#ifdef MODESETTING_PRESENT_SUPPORT
+		if (!dynamic)
+			drmmode_writeback_init(drmmode, koutput);
+#endif
+		drmModeFreeConnector(koutput);
+		return FALSE;
+	}
 
 	kencoders = calloc(sizeof(drmModeEncoderPtr), koutput->count_encoders);
 	if (!kencoders) {
@@ -1016,15 +3650,20 @@ drmmode_output_init(ScrnInfoPtr pScrn, drmmode_ptr drmmode, int num, int *num_dv
 		}
 	}
 
-	/* need to do smart conversion here for compat with non-kms ATI driver */
-	if (koutput->connector_type >= MS_ARRAY_SIZE(output_names))
-		snprintf(name, 32, "Unknown-%d", koutput->connector_type_id - 1);
-#ifdef MODESETTING_OUTPUT_SLAVE_SUPPORT
-	else if (pScrn->is_gpu)
-		snprintf(name, 32, "%s-%d-%d", output_names[koutput->connector_type], pScrn->scrnIndex - GPU_SCREEN_OFFSET + 1, koutput->connector_type_id - 1);
-#endif
-	else
-		snprintf(name, 32, "%s-%d", output_names[koutput->connector_type], koutput->connector_type_id - 1);
+	drmmode_output_name(pScrn, drmmode, koutput, &conn_props,
+			    name, sizeof(name));
+
+	for (i = 0; dynamic && i < xf86_config->num_output; i++) {
+		output = xf86_config->output[i];
+		drmmode_output = output->driver_private;
+		if (drmmode_output->output_id != -1 ||
+		    strcmp(output->name, name))
+			continue;
+
+		/* back on what may well be another pipe */
+		drmmode_output_attach(output, koutput, kencoders, &conn_props);
+		return TRUE;
+	}
 
 	output = xf86OutputCreate (pScrn, &drmmode_output_funcs, name);
 	if (!output) {
@@ -1037,38 +3676,24 @@ drmmode_output_init(ScrnInfoPtr pScrn, drmmode_ptr drmmode, int num, int *num_dv
 		goto out_free_encoders;
 	}
 
-	drmmode_output->output_id = drmmode->mode_res->connectors[num];
-	drmmode_output->mode_output = koutput;
-	drmmode_output->mode_encoders = kencoders;
 	drmmode_output->drmmode = drmmode;
-	output->mm_width = koutput->mmWidth;
-	output->mm_height = koutput->mmHeight;
-
-	output->subpixel_order = subpixel_conv_table[koutput->subpixel];
 	output->interlaceAllowed = TRUE;
 	output->doubleScanAllowed = TRUE;
 	output->driver_private = drmmode_output;
-	
-	output->possible_crtcs = 0x7f;
-	for (i = 0; i < koutput->count_encoders; i++) {
-		output->possible_crtcs &= kencoders[i]->possible_crtcs;
-	}
-	/* work out the possible clones later */
-	output->possible_clones = 0;
-
-	for (i = 0; i < koutput->count_props; i++) {
-		props = drmModeGetProperty(drmmode->fd, koutput->props[i]);
-		if (props && (props->flags & DRM_MODE_PROP_ENUM)) {
-			if (!strcmp(props->name, "DPMS")) {
-				drmmode_output->dpms_enum_id = koutput->props[i];
-				drmModeFreeProperty(props);
-				break;
-			}
-			drmModeFreeProperty(props);
+	drmmode_output_attach(output, koutput, kencoders, &conn_props);
+
+	if (dynamic) {
+		output->randr_output = RROutputCreate(xf86ScrnToScreen(pScrn),
+						      output->name,
+						      strlen(output->name),
+						      output);
+		if (output->randr_output) {
+			drmmode_output_create_resources(output);
+			RRPostPendingProperties(output->randr_output);
 		}
 	}
 
-	return;
+	return TRUE;
 out_free_encoders:
 	if (kencoders){
 		for (i = 0; i < koutput->count_encoders; i++)
@@ -1076,7 +3701,7 @@ out_free_encoders:
 		free(kencoders);
 	}
 	drmModeFreeConnector(koutput);
-	
+	return FALSE;
 }
 
 static uint32_t find_clones(ScrnInfoPtr scrn, xf86OutputPtr output)
@@ -1116,9 +3741,15 @@ drmmode_clones_init(ScrnInfoPtr scrn, drmmode_ptr drmmode)
 		drmmode_output_private_ptr drmmode_output;
 
 		drmmode_output = output->driver_private;
+		drmmode_output->enc_mask = 0;
 		drmmode_output->enc_clone_mask = 0xff;
+		/* gone, and no clone of anything */
+		if (!drmmode_output->mode_output) {
+			drmmode_output->enc_clone_mask = 0;
+			continue;
+		}
 		/* and all the possible encoder clones for this output together */
-		for (j = 0; j < drmmode_output->mode_output->count_encoders; j++)
+		for (j = 0; j < drmmode_output->num_encoders; j++)
 		{
 			int k;
 			for (k = 0; k < drmmode->mode_res->count_encoders; k++) {
@@ -1136,6 +3767,92 @@ drmmode_clones_init(ScrnInfoPtr scrn, drmmode_ptr drmmode)
 	}
 }
 
+/*
+ * Grow the front buffer geometrically, so a sequence of RandR resizes does
+ * not reallocate (and repaint) the whole screen at every step.
+ */
+static void
+drmmode_front_capacity(drmmode_ptr drmmode, int width, int height,
+		       int *cap_width, int *cap_height)
+{
+	int max_width = drmmode->mode_res->max_width;
+	int max_height = drmmode->mode_res->max_height;
+
+	*cap_width = width;
+	*cap_height = height;
+
+	if (width > drmmode->front_width)
+		*cap_width = max(width, drmmode->front_width * 3 / 2);
+	if (height > drmmode->front_height)
+		*cap_height = max(height, drmmode->front_height * 3 / 2);
+
+	/* with per-crtc scanout the shadow is not bound by the KMS limits */
+	if (drmmode->per_crtc_scanout)
+		return;
+
+	if (max_width && *cap_width > max_width)
+		*cap_width = max(width, max_width);
+	if (max_height && *cap_height > max_height)
+		*cap_height = max(height, max_height);
+}
+
+/* per-crtc scanout: only the shadow follows the screen size */
+static Bool
+drmmode_resize_shadow(ScrnInfoPtr scrn, drmmode_ptr drmmode,
+		      int width, int height)
+{
+	xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(scrn);
+	ScreenPtr screen = xf86ScrnToScreen(scrn);
+	PixmapPtr ppix = screen->GetScreenPixmap(screen);
+	int cpp = (scrn->bitsPerPixel + 7) / 8;
+	int cap_width, cap_height, i;
+
+	if (width > drmmode->front_width || height > drmmode->front_height ||
+	    4 * width * height < drmmode->front_width * drmmode->front_height) {
+		void *new_shadow;
+
+		drmmode_front_capacity(drmmode, width, height,
+				       &cap_width, &cap_height);
+
+		xf86DrvMsg(scrn->scrnIndex, X_INFO,
+			   "Allocate new shadow buffer %dx%d (capacity %dx%d)\n",
+			   width, height, cap_width, cap_height);
+
+		new_shadow = calloc(1, cap_width * cpp * cap_height);
+		if (!new_shadow)
+			return FALSE;
+
+		drmmode_copy_area(new_shadow, cap_width * cpp,
+				  drmmode->shadow_fb, scrn->displayWidth * cpp,
+				  min(width, scrn->virtualX),
+				  min(height, scrn->virtualY), cpp);
+		free(drmmode->shadow_fb);
+		drmmode->shadow_fb = new_shadow;
+		drmmode->front_width = cap_width;
+		drmmode->front_height = cap_height;
+		scrn->displayWidth = cap_width;
+	}
+
+	scrn->virtualX = width;
+	scrn->virtualY = height;
+	screen->ModifyPixmapHeader(ppix, width, height, -1, -1,
+				   scrn->displayWidth * cpp, drmmode->shadow_fb);
+#if XORG_VERSION_CURRENT < XORG_VERSION_NUMERIC(1,9,99,1,0)
+	scrn->pixmapPrivate.ptr = ppix->devPrivate.ptr;
+#endif
+
+	/* nothing to flip, the crtcs keep scanning out their own bos */
+	for (i = 0; i < xf86_config->num_crtc; i++) {
+		xf86CrtcPtr crtc = xf86_config->crtc[i];
+		drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+
+		if (crtc->enabled && drmmode_crtc->use_scanout)
+			drmmode_crtc_scanout_update(crtc, NULL);
+	}
+
+	return TRUE;
+}
+
 static Bool
 drmmode_xf86crtc_resize (ScrnInfoPtr scrn, int width, int height)
 {
@@ -1146,102 +3863,656 @@ drmmode_xf86crtc_resize (ScrnInfoPtr scrn, int width, int height)
 	struct dumb_bo *old_front = NULL;
 	Bool	    ret;
 	ScreenPtr   screen = xf86ScrnToScreen(scrn);
-	uint32_t    old_fb_id;
+	uint32_t    old_fb_id, new_fb_id = 0;
 	int	    i, pitch, old_width, old_height, old_pitch;
+	int	    old_front_width, old_front_height;
+	int	    cap_width, cap_height;
 	int cpp = (scrn->bitsPerPixel + 7) / 8;
 	PixmapPtr ppix = screen->GetScreenPixmap(screen);
-	void *new_pixels;
+	void *new_pixels, *old_pixels;
+	void *new_shadow = NULL;
+	Bool reuse;
 
 	if (scrn->virtualX == width && scrn->virtualY == height)
 		return TRUE;
 
-	xf86DrvMsg(scrn->scrnIndex, X_INFO,
-		   "Allocate new frame buffer %dx%d stride\n",
-		   width, height);
+	if (drmmode->per_crtc_scanout)
+		return drmmode_resize_shadow(scrn, drmmode, width, height);
 
 	old_width = scrn->virtualX;
 	old_height = scrn->virtualY;
 	old_pitch = drmmode->front_bo->pitch;
 	old_fb_id = drmmode->fb_id;
 	old_front = drmmode->front_bo;
+	old_front_width = drmmode->front_width;
+	old_front_height = drmmode->front_height;
 
-	drmmode->front_bo = dumb_bo_create(drmmode->fd, width, height, scrn->bitsPerPixel);
-	if (!drmmode->front_bo)
-		goto fail;
+	/*
+	 * Keep the current buffer if the new size fits and we would not be
+	 * wasting most of it; the contents then stay where they are.
+	 */
+	reuse = width <= drmmode->front_width &&
+		height <= drmmode->front_height &&
+		4 * width * height >= drmmode->front_width * drmmode->front_height;
 
-	pitch = drmmode->front_bo->pitch;
+	if (!reuse) {
+		drmmode_front_capacity(drmmode, width, height,
+				       &cap_width, &cap_height);
 
-	scrn->virtualX = width;
-	scrn->virtualY = height;
-	scrn->displayWidth = pitch / cpp;
+		xf86DrvMsg(scrn->scrnIndex, X_INFO,
+			   "Allocate new frame buffer %dx%d (capacity %dx%d)\n",
+			   width, height, cap_width, cap_height);
+
+		drmmode->front_bo = dumb_bo_pool_get(&drmmode->bo_pool, cap_width,
+						   cap_height, scrn->bitsPerPixel);
+		if (!drmmode->front_bo)
+			goto fail;
+		drmmode->front_width = cap_width;
+		drmmode->front_height = cap_height;
+	}
+
+	pitch = drmmode->front_bo->pitch;
 
 	ret = drmModeAddFB(drmmode->fd, width, height, scrn->depth,
 			   scrn->bitsPerPixel, pitch,
 			   drmmode->front_bo->handle,
-			   &drmmode->fb_id);
+			   &new_fb_id);
 	if (ret)
 		goto fail;
-	
-	new_pixels  = drmmode_map_front_bo(drmmode);
+	drmmode->fb_id = new_fb_id;
+
+	new_pixels = drmmode_map_front_bo(drmmode);
 	if (!new_pixels)
 		goto fail;
 
+	if (drmmode->shadow_enable && !reuse) {
+		new_shadow = calloc(1, pitch * drmmode->front_height);
+		if (new_shadow == NULL)
+			goto fail;
+	}
+
+	/* carry over what is still visible, so nothing needs repainting */
+	if (!reuse) {
+		int copy_width = min(width, old_width);
+		int copy_height = min(height, old_height);
+
+		if (drmmode->shadow_enable) {
+			drmmode_copy_area(new_shadow, pitch,
+					  drmmode->shadow_fb, old_pitch,
+					  copy_width, copy_height, cpp);
+			/* avoid reading back from the old (uncached) front */
+			drmmode_copy_area(new_pixels, pitch, new_shadow, pitch,
+					  copy_width, copy_height, cpp);
+		} else {
+			old_pixels = old_front->ptr;
+			if (old_pixels)
+				drmmode_copy_area(new_pixels, pitch,
+						  old_pixels, old_pitch,
+						  copy_width, copy_height, cpp);
+		}
+	}
+
+	scrn->virtualX = width;
+	scrn->virtualY = height;
+	scrn->displayWidth = pitch / cpp;
+
 	if (!drmmode->shadow_enable)
 		screen->ModifyPixmapHeader(ppix, width, height, -1, -1,
 					   pitch, new_pixels);
 	else {
-		void *new_shadow;
-		uint32_t size = scrn->displayWidth * scrn->virtualY *
-			((scrn->bitsPerPixel + 7) >> 3);
-		new_shadow = calloc(1, size);
-		if (new_shadow == NULL)
-			goto fail;
-		free(drmmode->shadow_fb);
-		drmmode->shadow_fb = new_shadow;
+		if (new_shadow) {
+			free(drmmode->shadow_fb);
+			drmmode->shadow_fb = new_shadow;
+		}
 		screen->ModifyPixmapHeader(ppix, width, height, -1, -1,
 					   pitch, drmmode->shadow_fb);
 	}
 
-#if XORG_VERSION_CURRENT < XORG_VERSION_NUMERIC(1,9,99,1,0)
-	scrn->pixmapPrivate.ptr = ppix->devPrivate.ptr;
-#endif
+#if XORG_VERSION_CURRENT < XORG_VERSION_NUMERIC(1,9,99,1,0)
+	scrn->pixmapPrivate.ptr = ppix->devPrivate.ptr;
+#endif
+
+	/* switch every lit crtc over with a plane flip, modeset only if we must */
+	for (i = 0; i < xf86_config->num_crtc; i++) {
+		xf86CrtcPtr crtc = xf86_config->crtc[i];
+
+		if (!crtc->enabled)
+			continue;
+
+		if (drmmode_crtc_front_plane_ok(crtc, crtc->x, crtc->y,
+						width, height) &&
+		    drmmode_crtc_set_plane_fb(crtc, drmmode->fb_id,
+					      crtc->x, crtc->y))
+			continue;
+
+		drmmode_set_mode_major(crtc, &crtc->mode,
+				       crtc->rotation, crtc->x, crtc->y);
+	}
+
+	if (old_fb_id)
+		drmModeRmFB(drmmode->fd, old_fb_id);
+	if (!reuse)
+		dumb_bo_pool_put(&drmmode->bo_pool, old_front);
+
+	return TRUE;
+
+ fail:
+	free(new_shadow);
+	/* only ever the one we added: old_fb_id may still be on screen */
+	if (new_fb_id)
+		drmModeRmFB(drmmode->fd, new_fb_id);
+	if (drmmode->front_bo != old_front)
+		dumb_bo_pool_put(&drmmode->bo_pool, drmmode->front_bo);
+	drmmode->front_bo = old_front;
+	drmmode->front_width = old_front_width;
+	drmmode->front_height = old_front_height;
+	scrn->virtualX = old_width;
+	scrn->virtualY = old_height;
+	scrn->displayWidth = old_pitch / cpp;
+	drmmode->fb_id = old_fb_id;
+
+	return FALSE;
+}
+
+#ifdef MODESETTING_LEASE_SUPPORT
+/*
+ * RandR leases: the lessee gets a DRM fd of its own that owns the leased
+ * connectors, crtcs and their primary planes, and drives them directly
+ * with no X in the way.  Leased outputs read as disconnected meanwhile.
+ */
+
+/* is crtc lit for outputs outside the lease?  then it isn't free */
+static Bool
+drmmode_lease_crtc_busy(RRLeasePtr lease, xf86CrtcPtr crtc)
+{
+	xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(crtc->scrn);
+	int i, o;
+
+	if (!crtc->enabled)
+		return FALSE;
+
+	for (i = 0; i < xf86_config->num_output; i++) {
+		xf86OutputPtr output = xf86_config->output[i];
+
+		if (output->crtc != crtc)
+			continue;
+		for (o = 0; o < lease->numOutputs; o++)
+			if (lease->outputs[o]->devPrivate == output)
+				break;
+		if (o == lease->numOutputs)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+static void
+drmmode_lease_set_leased(RRLeasePtr lease, Bool leased)
+{
+	int c, o;
+
+	for (c = 0; c < lease->numCrtcs; c++) {
+		xf86CrtcPtr crtc = lease->crtcs[c]->devPrivate;
+		drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+
+		drmmode_crtc->leased = leased;
+	}
+	for (o = 0; o < lease->numOutputs; o++) {
+		xf86OutputPtr output = lease->outputs[o]->devPrivate;
+		drmmode_output_private_ptr drmmode_output = output->driver_private;
+
+		drmmode_output->leased = leased;
+		/* whatever was plugged in meanwhile, we didn't see it */
+		if (!leased)
+			drmmode_output->probe_pending = TRUE;
+	}
+}
+
+static int
+drmmode_create_lease(RRLeasePtr lease, int *fd)
+{
+	ScreenPtr screen = lease->screen;
+	ScrnInfoPtr scrn = xf86ScreenToScrn(screen);
+	modesettingPtr ms = modesettingPTR(scrn);
+	drmmode_ptr drmmode = &ms->drmmode;
+	drmmode_lease_private_ptr lease_private;
+	uint32_t *objects;
+	int nobjects = 0;
+	int lease_fd, c, o;
+
+	if (!lease->numCrtcs || !lease->numOutputs)
+		return BadValue;
+
+	for (c = 0; c < lease->numCrtcs; c++) {
+		xf86CrtcPtr crtc = lease->crtcs[c]->devPrivate;
+		drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+
+		if (drmmode_crtc->leased || drmmode_lease_crtc_busy(lease, crtc))
+			return BadAccess;
+	}
+	for (o = 0; o < lease->numOutputs; o++) {
+		xf86OutputPtr output = lease->outputs[o]->devPrivate;
+		drmmode_output_private_ptr drmmode_output = output->driver_private;
+
+		if (drmmode_output->leased || !drmmode_output->mode_output)
+			return BadAccess;
+	}
+
+	objects = calloc(2 * lease->numCrtcs + lease->numOutputs,
+			 sizeof(*objects));
+	lease_private = calloc(1, sizeof(*lease_private));
+	if (!objects || !lease_private) {
+		free(objects);
+		free(lease_private);
+		return BadAlloc;
+	}
+
+	for (c = 0; c < lease->numCrtcs; c++) {
+		xf86CrtcPtr crtc = lease->crtcs[c]->devPrivate;
+		drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+
+		objects[nobjects++] = drmmode_crtc->mode_crtc->crtc_id;
+		/* legacy SetCrtc by the lessee needs the primary plane too */
+		if (drmmode_crtc->plane_id)
+			objects[nobjects++] = drmmode_crtc->plane_id;
+	}
+	for (o = 0; o < lease->numOutputs; o++) {
+		xf86OutputPtr output = lease->outputs[o]->devPrivate;
+		drmmode_output_private_ptr drmmode_output = output->driver_private;
+
+		objects[nobjects++] = drmmode_output->mode_output->connector_id;
+	}
+
+	lease_fd = drmModeCreateLease(drmmode->fd, objects, nobjects, O_CLOEXEC,
+				      &lease_private->lessee_id);
+	free(objects);
+	if (lease_fd < 0) {
+		xf86DrvMsg(scrn->scrnIndex, X_WARNING,
+			   "Failed to create DRM lease: %s\n",
+			   strerror(-lease_fd));
+		free(lease_private);
+		return BadMatch;
+	}
+
+	/* let go of the crtcs: no more flips, scaling or VRR from us */
+	for (c = 0; c < lease->numCrtcs; c++) {
+		xf86CrtcPtr crtc = lease->crtcs[c]->devPrivate;
+		drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+
+		drmmode_crtc_set_vrr(crtc, FALSE);
+		drmmode_crtc_scanout_free(crtc);
+		drmmode_crtc->shown_fb_id = 0;
+	}
+
+	lease->devPrivate = lease_private;
+	drmmode_lease_set_leased(lease, TRUE);
+	xf86CrtcLeaseStarted(lease);
+
+	xf86DrvMsg(scrn->scrnIndex, X_INFO,
+		   "DRM lease %u: %d crtcs, %d outputs\n",
+		   lease_private->lessee_id, lease->numCrtcs,
+		   lease->numOutputs);
+
+	/* the leased outputs drop out of the desktop */
+	RRGetInfo(screen, TRUE);
+
+	*fd = lease_fd;
+	return Success;
+}
+
+/* give the lease's objects back to X; the server may free lease */
+static void
+drmmode_lease_finished(RRLeasePtr lease)
+{
+	free(lease->devPrivate);
+	lease->devPrivate = NULL;
+	drmmode_lease_set_leased(lease, FALSE);
+	xf86CrtcLeaseTerminated(lease);
+}
+
+static void
+drmmode_terminate_lease(RRLeasePtr lease)
+{
+	ScreenPtr screen = lease->screen;
+	modesettingPtr ms = modesettingPTR(xf86ScreenToScrn(screen));
+	drmmode_lease_private_ptr lease_private = lease->devPrivate;
+
+	/* already over, we get here again as the server tears it down */
+	if (!lease_private)
+		return;
+
+	/* fails if the lessee is gone already, which ends it just the same */
+	drmModeRevokeLease(ms->drmmode.fd, lease_private->lessee_id);
+	drmmode_lease_finished(lease);
+	RRGetInfo(screen, TRUE);
+}
+
+/* end the leases whose lessee went away, e.g. by closing its fd */
+void
+drmmode_validate_leases(ScrnInfoPtr scrn, drmmode_ptr drmmode)
+{
+	ScreenPtr screen = xf86ScrnToScreen(scrn);
+	rrScrPrivPtr scr_priv;
+	drmModeLesseeListPtr lessees;
+	RRLeasePtr lease, next;
+	uint32_t i;
+
+	if (!screen)
+		return;
+	scr_priv = rrGetScrPriv(screen);
+	if (!scr_priv || xorg_list_is_empty(&scr_priv->leases))
+		return;
+
+	lessees = drmModeListLessees(drmmode->fd);
+	if (!lessees)
+		return;
+
+	xorg_list_for_each_entry_safe(lease, next, &scr_priv->leases, list) {
+		drmmode_lease_private_ptr lease_private = lease->devPrivate;
+
+		if (!lease_private)
+			continue;
+		for (i = 0; i < lessees->count; i++)
+			if (lessees->lessees[i] == lease_private->lessee_id)
+				break;
+		if (i == lessees->count)
+			drmmode_lease_finished(lease);
+	}
+
+	drmFree(lessees);
+}
+#endif
+
+static const xf86CrtcConfigFuncsRec drmmode_xf86crtc_config_funcs = {
+	.resize = drmmode_xf86crtc_resize,
+#ifdef MODESETTING_LEASE_SUPPORT
+	.create_lease = drmmode_create_lease,
+	.terminate_lease = drmmode_terminate_lease,
+#endif
+};
+
+/* at most this many connectors are probed at once */
+#define DRMMODE_PROBE_THREADS 4
+/* how long a probe gets before the outputs it hasn't got to go on without */
+#define DRMMODE_PROBE_DEADLINE_MS 500
+
+/* what the kernel knows about a connector, without going to the hw */
+static drmModeConnectorPtr
+drmmode_connector_current(int fd, uint32_t connector_id)
+{
+#ifdef HAVE_DRMMODEGETCONNECTORCURRENT
+	return drmModeGetConnectorCurrent(fd, connector_id);
+#else
+	return drmModeGetConnector(fd, connector_id);
+#endif
+}
+
+/*
+ * The probe cache remembers, across server starts, what every connector
+ * looked like after the last full probe and what drmmode_get_default_bpp
+ * found.  It is keyed by the device and its kernel driver's version.
+ * When the state the kernel kept from its last probe still matches, the
+ * connectors are taken as they are and not probed again.
+ */
+#define DRMMODE_PROBE_CACHE_MAGIC "modesetting probe cache 1"
+
+static Bool
+drmmode_probe_cache_key(drmmode_ptr drmmode, char *key, int len)
+{
+	drmVersionPtr version;
+	char *busid;
+
+	busid = drmGetBusid(drmmode->fd);
+	version = drmGetVersion(drmmode->fd);
+	if (version)
+		snprintf(key, len, "key %s %s %d.%d.%d",
+			 busid && *busid ? busid : "-", version->name,
+			 version->version_major, version->version_minor,
+			 version->version_patchlevel);
+	drmFreeVersion(version);
+	drmFreeBusid(busid);
+	return version != NULL;
+}
+
+static uint64_t
+drmmode_connector_hash(int fd, drmModeConnectorPtr koutput,
+		       drmmode_connector_props_ptr conn_props)
+{
+	drmModePropertyBlobPtr edid = NULL;
+	uint64_t hash;
+	int i;
+
+	i = drmmode_connector_prop(fd, koutput, conn_props,
+				   DRMMODE_CONNECTOR_EDID);
+	if (i >= 0)
+		edid = drmModeGetPropertyBlob(fd, koutput->prop_values[i]);
+	hash = drmmode_probe_hash(koutput, edid);
+	drmModeFreePropertyBlob(edid);
+	return hash;
+}
+
+void
+drmmode_probe_cache_load(ScrnInfoPtr pScrn, drmmode_ptr drmmode)
+{
+	drmmode_probe_cache_ptr cache = &drmmode->probe_cache;
+	char line[256], key[256];
+	FILE *f;
+
+	if (!cache->path || !drmmode_probe_cache_key(drmmode, key, sizeof(key)))
+		return;
+
+	f = fopen(cache->path, "r");
+	if (!f)
+		return;
+
+	if (!fgets(line, sizeof(line), f) ||
+	    strcmp(line, DRMMODE_PROBE_CACHE_MAGIC "\n") ||
+	    !fgets(line, sizeof(line), f) ||
+	    strncmp(line, key, strlen(key)) || line[strlen(key)] != '\n')
+		goto out;
+
+	while (fgets(line, sizeof(line), f)) {
+		drmmode_probe_cache_entry_ptr entries;
+		unsigned int id;
+		int status;
+		unsigned long long hash;
+
+		if (sscanf(line, "bpp %d %d", &cache->depth, &cache->bpp) == 2)
+			continue;
+		if (sscanf(line, "connector %u %d %llx", &id, &status, &hash) != 3)
+			goto out;
+
+		entries = realloc(cache->connectors, (cache->num_connectors + 1) *
+				  sizeof(*entries));
+		if (!entries)
+			goto out;
+		cache->connectors = entries;
+		entries[cache->num_connectors].connector_id = id;
+		entries[cache->num_connectors].status = status;
+		entries[cache->num_connectors].hash = hash;
+		cache->num_connectors++;
+	}
+	cache->valid = cache->depth != 0;
+	if (cache->valid)
+		xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+			   "Using the probe cache in %s\n", cache->path);
+out:
+	fclose(f);
+	if (!cache->valid) {
+		free(cache->connectors);
+		cache->connectors = NULL;
+		cache->num_connectors = 0;
+	}
+}
+
+static void
+drmmode_probe_cache_save(ScrnInfoPtr pScrn, drmmode_ptr drmmode)
+{
+	xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(pScrn);
+	drmmode_probe_cache_ptr cache = &drmmode->probe_cache;
+	char key[256], *tmp;
+	FILE *f = NULL;
+	int i, fd;
+
+	/* nothing new to write down, or nothing trustworthy */
+	if (!cache->path || cache->hit || drmmode->probe_late ||
+	    !drmmode_probe_cache_key(drmmode, key, sizeof(key)))
+		return;
+
+	/*
+	 * A fresh file beside the cache, never one someone put there for
+	 * us to follow: we're root.
+	 */
+	if (Xasprintf(&tmp, "%s.XXXXXX", cache->path) < 0)
+		return;
+	fd = mkstemp(tmp);
+	if (fd >= 0) {
+		fchmod(fd, 0644);
+		f = fdopen(fd, "w");
+	}
+	if (!f) {
+		xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+			   "Couldn't write the probe cache %s: %s\n",
+			   cache->path, strerror(errno));
+		if (fd >= 0) {
+			close(fd);
+			unlink(tmp);
+		}
+		free(tmp);
+		return;
+	}
+
+	fprintf(f, DRMMODE_PROBE_CACHE_MAGIC "\n%s\n", key);
+	fprintf(f, "bpp %d %d\n", cache->depth, cache->bpp);
+	for (i = 0; i < xf86_config->num_output; i++) {
+		drmmode_output_private_ptr drmmode_output =
+			xf86_config->output[i]->driver_private;
+		drmModeConnectorPtr koutput = drmmode_output->mode_output;
+
+		if (!koutput)
+			continue;
+		fprintf(f, "connector %u %d %llx\n", koutput->connector_id,
+			koutput->connection,
+			(unsigned long long)
+			drmmode_connector_hash(drmmode->fd, koutput,
+					       &drmmode_output->conn_props));
+	}
+
+	/* swap it in whole, a half-written cache is no cache */
+	if (fclose(f) != 0 || rename(tmp, cache->path) != 0)
+		unlink(tmp);
+	free(tmp);
+}
+
+#ifdef HAVE_DRMMODEGETCONNECTORCURRENT
+/*
+ * The connectors as the kernel has them from its last probe, if they're
+ * all what the probe cache says they were.  NULL if anything differs.
+ */
+static drmModeConnectorPtr *
+drmmode_probe_cache_connectors(drmmode_ptr drmmode)
+{
+	drmmode_probe_cache_ptr cache = &drmmode->probe_cache;
+	drmModeResPtr mode_res = drmmode->mode_res;
+	drmModeConnectorPtr *koutputs;
+	int i, j, matched = 0;
 
-	for (i = 0; i < xf86_config->num_crtc; i++) {
-		xf86CrtcPtr crtc = xf86_config->crtc[i];
+	if (!cache->valid || !mode_res->count_connectors)
+		return NULL;
 
-		if (!crtc->enabled)
+	koutputs = calloc(mode_res->count_connectors, sizeof(*koutputs));
+	if (!koutputs)
+		return NULL;
+
+	for (i = 0; i < mode_res->count_connectors; i++) {
+		drmmode_connector_props_rec conn_props = { .valid = FALSE };
+		drmModeConnectorPtr koutput;
+
+		koutput = drmModeGetConnectorCurrent(drmmode->fd,
+						     mode_res->connectors[i]);
+		koutputs[i] = koutput;
+		if (!koutput)
+			goto miss;
+		if (koutput->connector_type == DRM_MODE_CONNECTOR_WRITEBACK)
 			continue;
 
-		drmmode_set_mode_major(crtc, &crtc->mode,
-				       crtc->rotation, crtc->x, crtc->y);
+		for (j = 0; j < cache->num_connectors; j++) {
+			if (cache->connectors[j].connector_id ==
+			    koutput->connector_id)
+				break;
+		}
+		if (j == cache->num_connectors ||
+		    cache->connectors[j].status != koutput->connection ||
+		    cache->connectors[j].hash !=
+		    drmmode_connector_hash(drmmode->fd, koutput, &conn_props))
+			goto miss;
+		matched++;
 	}
+	if (matched == cache->num_connectors)
+		return koutputs;
 
-	if (old_fb_id) {
-		drmModeRmFB(drmmode->fd, old_fb_id);
-		dumb_bo_destroy(drmmode->fd, old_front);
-	}
+miss:
+	for (i = 0; i < mode_res->count_connectors; i++)
+		drmModeFreeConnector(koutputs[i]);
+	free(koutputs);
+	return NULL;
+}
+#endif
 
-	return TRUE;
+/*
+ * Probe all connectors at once on the probe threads.  Connectors whose
+ * probe isn't done by the deadline start out with what the kernel knows
+ * and are probed again once the server is up.
+ */
+static void
+drmmode_outputs_init(ScrnInfoPtr pScrn, drmmode_ptr drmmode)
+{
+	drmModeResPtr mode_res = drmmode->mode_res;
+	struct ms_probe *probe;
+	int i;
 
- fail:
-	if (drmmode->front_bo)
-		dumb_bo_destroy(drmmode->fd, drmmode->front_bo);
-	drmmode->front_bo = old_front;
-	scrn->virtualX = old_width;
-	scrn->virtualY = old_height;
-	scrn->displayWidth = old_pitch / cpp;
-	drmmode->fb_id = old_fb_id;
+#ifdef HAVE_DRMMODEGETCONNECTORCURRENT
+	drmModeConnectorPtr *koutputs = drmmode_probe_cache_connectors(drmmode);
+
+	if (koutputs) {
+		xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+			   "Connectors unchanged since the probe cache was "
+			   "written, not probing them\n");
+		for (i = 0; i < mode_res->count_connectors; i++)
+			drmmode_output_init(pScrn, drmmode, koutputs[i], FALSE);
+		free(koutputs);
+		drmmode->probe_cache.hit = TRUE;
+		return;
+	}
+#endif
 
-	return FALSE;
-}
+	probe = ms_probe_start(drmmode->fd, mode_res->connectors,
+			       mode_res->count_connectors,
+			       DRMMODE_PROBE_THREADS);
+	if (probe && !ms_probe_wait(probe, DRMMODE_PROBE_DEADLINE_MS)) {
+		xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+			   "Connector probe still going after %d ms, "
+			   "finishing it later\n", DRMMODE_PROBE_DEADLINE_MS);
+		drmmode->probe_late = TRUE;
+	}
 
-static const xf86CrtcConfigFuncsRec drmmode_xf86crtc_config_funcs = {
-	drmmode_xf86crtc_resize
-};
+	for (i = 0; i < mode_res->count_connectors; i++) {
+		drmModeConnectorPtr koutput;
+
+		if (!probe)
+			koutput = drmModeGetConnector(drmmode->fd,
+						      mode_res->connectors[i]);
+		else if (!ms_probe_take(probe, i, &koutput))
+			koutput = drmmode_connector_current(drmmode->fd,
+							    mode_res->connectors[i]);
+		if (koutput)
+			drmmode_output_init(pScrn, drmmode, koutput, FALSE);
+	}
+	ms_probe_finish(probe);
+}
 
 Bool drmmode_pre_init(ScrnInfoPtr pScrn, drmmode_ptr drmmode, int cpp)
 {
-	int i, num_dvi = 0, num_hdmi = 0;
+	int i;
 	int ret;
 	uint64_t value = 0;
 
@@ -1256,17 +4527,39 @@ Bool drmmode_pre_init(ScrnInfoPtr pScrn, drmmode_ptr drmmode, int cpp)
 
 	drmmode->scrn = pScrn;
 	drmmode->cpp = cpp;
-	drmmode->mode_res = drmModeGetResources(drmmode->fd);
+#ifdef MODESETTING_PRESENT_SUPPORT
+	/* writeback connectors are only listed when asked for, with atomic */
+	if (drmmode->atomic_modeset) {
+		drmSetClientCap(drmmode->fd,
+				DRM_CLIENT_CAP_WRITEBACK_CONNECTORS, 1);
+		/* so a list fetched before doesn't have them */
+		drmModeFreeResources(drmmode->mode_res);
+		drmmode->mode_res = NULL;
+	}
+#endif
+	/* drmmode_get_default_bpp may have had to fetch them already */
+	if (!drmmode->mode_res)
+		drmmode->mode_res = drmModeGetResources(drmmode->fd);
 	if (!drmmode->mode_res)
 		return FALSE;
 
-	xf86CrtcSetSizeRange(pScrn, 320, 200, drmmode->mode_res->max_width, drmmode->mode_res->max_height);
+	/* atomic implies universal planes, and was negotiated in PreInit */
+	if (!drmmode->atomic_modeset)
+		drmmode->universal_planes =
+			drmSetClientCap(drmmode->fd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1) == 0;
+	else
+		drmmode->universal_planes = TRUE;
+
+	/* each crtc has its own scanout bo, so only the crtcs are limited */
+	if (drmmode->per_crtc_scanout)
+		xf86CrtcSetSizeRange(pScrn, 320, 200, MAXSHORT, MAXSHORT);
+	else
+		xf86CrtcSetSizeRange(pScrn, 320, 200, drmmode->mode_res->max_width, drmmode->mode_res->max_height);
 	for (i = 0; i < drmmode->mode_res->count_crtcs; i++)
 		if (!xf86IsEntityShared(pScrn->entityList[0]) || pScrn->confScreen->device->screen == i)
 			drmmode_crtc_init(pScrn, drmmode, i);
 
-	for (i = 0; i < drmmode->mode_res->count_connectors; i++)
-		drmmode_output_init(pScrn, drmmode, i, &num_dvi, &num_hdmi);
+	drmmode_outputs_init(pScrn, drmmode);
 
 	/* workout clones */
 	drmmode_clones_init(pScrn, drmmode);
@@ -1277,9 +4570,152 @@ Bool drmmode_pre_init(ScrnInfoPtr pScrn, drmmode_ptr drmmode, int cpp)
 
 	xf86InitialConfiguration(pScrn, TRUE);
 
+	drmmode_probe_cache_save(pScrn, drmmode);
+	free(drmmode->probe_cache.connectors);
+	drmmode->probe_cache.connectors = NULL;
+	drmmode->probe_cache.num_connectors = 0;
+
+	return TRUE;
+}
+
+/* move the scanout origin of an already lit crtc, no modeset needed */
+static Bool drmmode_crtc_pan_commit(xf86CrtcPtr crtc);
+
+/* the pan landed, or is due now; pans that came meanwhile go in as one */
+static void
+drmmode_crtc_pan_handler(uint64_t msc, uint64_t usec, void *data)
+{
+	xf86CrtcPtr crtc = data;
+	ScrnInfoPtr scrn = crtc->scrn;
+	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+	drmmode_ptr drmmode = drmmode_crtc->drmmode;
+
+	drmmode_crtc->pan_in_flight = FALSE;
+	/* a modeset since clears it, and it would have to be redone */
+	if (!drmmode_crtc->pan_pending || !crtc->enabled ||
+	    drmmode_crtc->use_scanout ||
+	    !drmmode_crtc_front_plane_ok(crtc, crtc->x, crtc->y,
+					 scrn->virtualX, scrn->virtualY))
+		return;
+
+	if (drmmode->atomic_modeset)
+		drmmode_crtc_pan_commit(crtc);
+	else
+		/* at the top of the frame, where SetPlane is least likely to tear */
+		drmmode_crtc_set_plane_fb(crtc, drmmode->fb_id,
+					  crtc->x, crtc->y);
+}
+
+static void
+drmmode_crtc_pan_abort(void *data)
+{
+	xf86CrtcPtr crtc = data;
+	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+
+	drmmode_crtc->pan_in_flight = FALSE;
+}
+
+/*
+ * Send the crtc's latest origin to its primary plane without waiting: a
+ * nonblocking atomic commit, or without atomic a SetPlane issued from
+ * the next vblank event.  Until that is done, further pans only update
+ * crtc->x, y and go in together afterwards.
+ */
+static Bool
+drmmode_crtc_pan_commit(xf86CrtcPtr crtc)
+{
+	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+	drmmode_ptr drmmode = drmmode_crtc->drmmode;
+	int w = crtc->mode.HDisplay;
+	int h = crtc->mode.VDisplay;
+	uint32_t seq;
+	int ret = -ENOMEM;
+
+	drmmode_crtc->pan_pending = TRUE;
+	if (drmmode_crtc->pan_in_flight)
+		return TRUE;
+
+	seq = ms_drm_queue_alloc(crtc, crtc, drmmode_crtc_pan_handler,
+				 drmmode_crtc_pan_abort);
+	if (seq && drmmode->atomic_modeset) {
+		drmModeAtomicReqPtr req = drmModeAtomicAlloc();
+
+		if (req) {
+			ret = drmmode_plane_add_props(req, drmmode_crtc,
+						      drmmode->fb_id, crtc->x,
+						      crtc->y, w, h, w, h);
+			if (ret == 0)
+				ret = drmModeAtomicCommit(drmmode->fd, req,
+							  DRM_MODE_ATOMIC_NONBLOCK |
+							  DRM_MODE_PAGE_FLIP_EVENT,
+							  (void *)(uintptr_t)seq);
+			drmModeAtomicFree(req);
+		}
+	} else if (seq) {
+		drmVBlank vbl;
+
+		vbl.request.type = DRM_VBLANK_RELATIVE | DRM_VBLANK_EVENT |
+			drmmode_crtc->vblank_pipe;
+		vbl.request.sequence = 1;
+		vbl.request.signal = seq;
+		ret = drmWaitVBlank(drmmode->fd, &vbl);
+	}
+
+	if (ret) {
+		/* most likely a flip in the way: just do it, and wait */
+		if (seq)
+			ms_drm_abort_seq(crtc->scrn, seq);
+		return drmmode_crtc_set_plane_fb(crtc, drmmode->fb_id,
+						 crtc->x, crtc->y);
+	}
+
+	drmmode_crtc->pan_in_flight = TRUE;
+	/* without atomic, the SetPlane is still to come */
+	if (!drmmode->atomic_modeset)
+		return TRUE;
+
+	drmmode_crtc->pan_pending = FALSE;
+	drmmode_crtc->shown_fb_id = drmmode->fb_id;
+	drmmode_crtc->shown_x = crtc->x;
+	drmmode_crtc->shown_y = crtc->y;
+	drmmode_crtc->shown_w = w;
+	drmmode_crtc->shown_h = h;
 	return TRUE;
 }
 
+static Bool
+drmmode_crtc_pan(xf86CrtcPtr crtc, int x, int y)
+{
+	ScrnInfoPtr pScrn = crtc->scrn;
+	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+	drmmode_ptr drmmode = drmmode_crtc->drmmode;
+
+	/* the plane's or the scaler's setup is redone by a modeset */
+	if (drmmode_crtc->plane_scaled || drmmode_crtc->scaler)
+		return FALSE;
+
+	/* the crtc's own scanout just needs refilling from the new origin */
+	if (drmmode_crtc->use_scanout) {
+		if (x < 0 || y < 0 ||
+		    x + crtc->mode.HDisplay > pScrn->virtualX ||
+		    y + crtc->mode.VDisplay > pScrn->virtualY)
+			return FALSE;
+		crtc->x = x;
+		crtc->y = y;
+		drmmode_crtc_scanout_update(crtc, NULL);
+		return TRUE;
+	}
+
+	if (!drmmode->fb_id ||
+	    !drmmode_crtc_front_plane_ok(crtc, x, y,
+					 pScrn->virtualX, pScrn->virtualY))
+		return FALSE;
+
+	crtc->x = x;
+	crtc->y = y;
+	return drmmode_crtc_pan_commit(crtc);
+}
+
 void drmmode_adjust_frame(ScrnInfoPtr pScrn, drmmode_ptr drmmode, int x, int y)
 {
 	xf86CrtcConfigPtr	config = XF86_CRTC_CONFIG_PTR(pScrn);
@@ -1287,6 +4723,8 @@ void drmmode_adjust_frame(ScrnInfoPtr pScrn, drmmode_ptr drmmode, int x, int y)
 	xf86CrtcPtr	crtc = output->crtc;
 
 	if (crtc && crtc->enabled) {
+		if (drmmode_crtc_pan(crtc, x, y))
+			return;
 		drmmode_set_mode_major(crtc, &crtc->mode, crtc->rotation,
 				       x, y);
 	}
@@ -1303,10 +4741,17 @@ Bool drmmode_set_desired_modes(ScrnInfoPtr pScrn, drmmode_ptr drmmode)
 		xf86OutputPtr	output = NULL;
 		int		o;
 
+		/* not ours to touch while leased */
+		if (drmmode_crtc->leased)
+			continue;
+
 		/* Skip disabled CRTCs */
 		if (!crtc->enabled) {
 			drmModeSetCrtc(drmmode->fd, drmmode_crtc->mode_crtc->crtc_id,
 				       0, 0, 0, NULL, 0, NULL);
+			drmmode_crtc->shown_fb_id = 0;
+			drmmode_crtc->tile_modeset = FALSE;
+			drmmode_crtc_scanout_free(crtc);
 			continue;
 		}
 
@@ -1343,6 +4788,7 @@ Bool drmmode_set_desired_modes(ScrnInfoPtr pScrn, drmmode_ptr drmmode)
 						 crtc->desiredX, crtc->desiredY))
 			return FALSE;
 	}
+	drmmode_flush_tile_modesets(drmmode);
 	return TRUE;
 }
 
@@ -1430,17 +4876,252 @@ Bool drmmode_setup_colormap(ScreenPtr pScreen, ScrnInfoPtr pScrn)
 }
 
 #ifdef HAVE_UDEV
+/*
+ * Catch up with connectors coming and going, as they do behind MST hubs
+ * and docks: outputs whose connector is gone are kept, disconnected, for
+ * it to come back to; new connectors get outputs.
+ */
+static void
+drmmode_update_connectors(ScrnInfoPtr scrn, drmmode_ptr drmmode)
+{
+	xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(scrn);
+	drmModeResPtr mode_res;
+	Bool changed = FALSE;
+	int i, j;
+
+	mode_res = drmModeGetResources(drmmode->fd);
+	if (!mode_res)
+		return;
+
+	for (i = 0; i < xf86_config->num_output; i++) {
+		xf86OutputPtr output = xf86_config->output[i];
+		drmmode_output_private_ptr drmmode_output = output->driver_private;
+
+		if (drmmode_output->output_id == -1)
+			continue;
+		for (j = 0; j < mode_res->count_connectors; j++)
+			if (mode_res->connectors[j] == drmmode_output->output_id)
+				break;
+		if (j < mode_res->count_connectors)
+			continue;
+
+		drmmode_output_drop_connector(drmmode_output);
+		drmmode_output->output_id = -1;
+		changed = TRUE;
+	}
+
+	/* new connectors are probed along with the ones hotplug events named */
+	for (i = 0; i < mode_res->count_connectors; i++) {
+		drmmode_output_private_ptr drmmode_output;
+		drmModeConnectorPtr koutput;
+
+		if (drmmode_find_output(scrn, mode_res->connectors[i]))
+			continue;
+
+		koutput = drmmode_connector_current(drmmode->fd,
+						    mode_res->connectors[i]);
+		if (!koutput ||
+		    !drmmode_output_init(scrn, drmmode, koutput, TRUE))
+			continue;
+
+		drmmode_output = drmmode_find_output(scrn,
+			mode_res->connectors[i])->driver_private;
+		drmmode_output->probe_pending = TRUE;
+		changed = TRUE;
+	}
+
+	drmModeFreeResources(drmmode->mode_res);
+	drmmode->mode_res = mode_res;
+
+	if (changed) {
+		drmmode_clones_init(scrn, drmmode);
+		RRSetChanged(xf86ScrnToScreen(scrn));
+		RRTellChanged(xf86ScrnToScreen(scrn));
+	}
+}
+
+/* how long a burst of hotplug events gets to settle before the reprobe */
+#define DRMMODE_HOTPLUG_DEBOUNCE_MS 100
+
+static void
+drmmode_hotplug_reprobe(ScrnInfoPtr scrn, drmmode_ptr drmmode)
+{
+	drmmode->hotplug_probe = TRUE;
+	RRGetInfo(xf86ScrnToScreen(scrn), TRUE);
+	drmmode->hotplug_probe = FALSE;
+}
+
+/*
+ * The probe threads are done, or out of time: hand what they found to
+ * the outputs and let RandR have a look.  Connectors still being probed
+ * keep what the kernel knows so far; should the probe change that, the
+ * kernel sends another hotplug event.
+ */
+static void
+drmmode_probe_done(ScrnInfoPtr scrn, drmmode_ptr drmmode)
+{
+	struct ms_probe *probe = drmmode->probe;
+	int i;
+
+	xf86RemoveGeneralHandler(drmmode->probe_handler);
+	drmmode->probe_handler = NULL;
+	TimerCancel(drmmode->probe_timer);
+	drmmode->probe = NULL;
+
+	for (i = 0; i < ms_probe_count(probe); i++) {
+		uint32_t connector_id = ms_probe_connector_id(probe, i);
+		xf86OutputPtr output = drmmode_find_output(scrn, connector_id);
+		drmmode_output_private_ptr drmmode_output;
+		drmModeConnectorPtr koutput;
+
+		if (!ms_probe_take(probe, i, &koutput))
+			koutput = drmmode_connector_current(drmmode->fd,
+							    connector_id);
+		if (!output || !koutput) {
+			drmModeFreeConnector(koutput);
+			continue;
+		}
+
+		drmmode_output = output->driver_private;
+		drmModeFreeConnector(drmmode_output->probed);
+		drmmode_output->probed = koutput;
+		drmmode_output->probe_pending = TRUE;
+	}
+	ms_probe_finish(probe);
+
+	drmmode_hotplug_reprobe(scrn, drmmode);
+}
+
+static void
+drmmode_probe_handler(int fd, void *closure)
+{
+	drmmode_ptr drmmode = closure;
+
+	drmmode_probe_done(drmmode->scrn, drmmode);
+}
+
+static CARD32
+drmmode_probe_deadline(OsTimerPtr timer, CARD32 now, void *arg)
+{
+	drmmode_ptr drmmode = arg;
+
+	xf86DrvMsg(drmmode->scrn->scrnIndex, X_INFO,
+		   "Connector probe still going after %d ms, going on without it\n",
+		   DRMMODE_PROBE_DEADLINE_MS);
+	drmmode_probe_done(drmmode->scrn, drmmode);
+	return 0;
+}
+
+/*
+ * Reprobe the connectors a burst of hotplug events named.  That's done on
+ * the probe threads, clients keep being served meanwhile.
+ */
+static CARD32
+drmmode_hotplug_timer(OsTimerPtr timer, CARD32 now, void *arg)
+{
+	drmmode_ptr drmmode = arg;
+	ScrnInfoPtr scrn = drmmode->scrn;
+	xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(scrn);
+	uint32_t *connector_ids;
+	int i, count = 0;
+
+	/* one probe at a time, this burst gets its turn after */
+	if (drmmode->probe)
+		return DRMMODE_HOTPLUG_DEBOUNCE_MS;
+
+	drmmode_update_connectors(scrn, drmmode);
+
+	if (drmmode->hotplug_all)
+		drmmode_force_probe(scrn);
+	drmmode->hotplug_all = FALSE;
+
+	connector_ids = calloc(xf86_config->num_output, sizeof(*connector_ids));
+	for (i = 0; connector_ids && i < xf86_config->num_output; i++) {
+		drmmode_output_private_ptr drmmode_output =
+			xf86_config->output[i]->driver_private;
+
+		if (drmmode_output->probe_pending &&
+		    drmmode_output->output_id != -1)
+			connector_ids[count++] = drmmode_output->output_id;
+	}
+	if (connector_ids)
+		drmmode->probe = ms_probe_start(drmmode->fd, connector_ids,
+						count, DRMMODE_PROBE_THREADS);
+	free(connector_ids);
+
+	/* no probe threads to be had, detect probes them right here */
+	if (!drmmode->probe) {
+		drmmode_hotplug_reprobe(scrn, drmmode);
+		return 0;
+	}
+
+	drmmode->probe_handler =
+		xf86AddGeneralHandler(ms_probe_fd(drmmode->probe),
+				      drmmode_probe_handler, drmmode);
+	drmmode->probe_timer = TimerSet(drmmode->probe_timer, 0,
+					DRMMODE_PROBE_DEADLINE_MS,
+					drmmode_probe_deadline, drmmode);
+	return 0;
+}
+
+/*
+ * Note which connector a hotplug event is for and (re)start the debounce
+ * timer: a dock coming up sends a burst of these, and one reprobe of the
+ * connectors they named does for all of them.
+ */
+static void
+drmmode_hotplug_event(ScrnInfoPtr scrn, drmmode_ptr drmmode,
+		      const char *connector)
+{
+	xf86OutputPtr output = NULL;
+
+	if (connector)
+		output = drmmode_find_output(scrn, strtoul(connector, NULL, 10));
+	if (output) {
+		drmmode_output_private_ptr drmmode_output = output->driver_private;
+
+		drmmode_output->probe_pending = TRUE;
+	} else
+		drmmode->hotplug_all = TRUE;
+
+	drmmode->hotplug_timer = TimerSet(drmmode->hotplug_timer, 0,
+					  DRMMODE_HOTPLUG_DEBOUNCE_MS,
+					  drmmode_hotplug_timer, drmmode);
+}
+
 static void
 drmmode_handle_uevents(int fd, void *closure)
 {
 	drmmode_ptr drmmode = closure;
 	ScrnInfoPtr scrn = drmmode->scrn;
 	struct udev_device *dev;
+	const char *value;
+
 	dev = udev_monitor_receive_device(drmmode->uevent_monitor);
 	if (!dev)
 		return;
 
-	RRGetInfo(xf86ScrnToScreen(scrn), TRUE);
+	/* every drm device's events come here, only ours are of interest */
+	if (drmmode->uevent_devnum &&
+	    udev_device_get_devnum(dev) != drmmode->uevent_devnum) {
+		udev_device_unref(dev);
+		return;
+	}
+
+#ifdef MODESETTING_LEASE_SUPPORT
+	/* a lessee closing its fd ends the lease, the kernel tells us here */
+	value = udev_device_get_property_value(dev, "LEASE");
+	if (value && !strcmp(value, "1")) {
+		drmmode_validate_leases(scrn, drmmode);
+		drmmode->hotplug_timer = TimerSet(drmmode->hotplug_timer, 0,
+						  DRMMODE_HOTPLUG_DEBOUNCE_MS,
+						  drmmode_hotplug_timer, drmmode);
+	}
+#endif
+	value = udev_device_get_property_value(dev, "HOTPLUG");
+	if (value && !strcmp(value, "1"))
+		drmmode_hotplug_event(scrn, drmmode,
+				      udev_device_get_property_value(dev, "CONNECTOR"));
 	udev_device_unref(dev);
 }
 #endif
@@ -1450,6 +5131,7 @@ void drmmode_uevent_init(ScrnInfoPtr scrn, drmmode_ptr drmmode)
 #ifdef HAVE_UDEV
 	struct udev *u;
 	struct udev_monitor *mon;
+	struct stat st;
 
 	u = udev_new();
 	if (!u)
@@ -1473,8 +5155,18 @@ void drmmode_uevent_init(ScrnInfoPtr scrn, drmmode_ptr drmmode)
 		xf86AddGeneralHandler(udev_monitor_get_fd(mon),
 				      drmmode_handle_uevents,
 				      drmmode);
+	if (fstat(drmmode->fd, &st) == 0)
+		drmmode->uevent_devnum = st.st_rdev;
 
 	drmmode->uevent_monitor = mon;
+
+	/* startup went on without some probe, finish it now that we're up */
+	if (drmmode->probe_late) {
+		drmmode->hotplug_all = TRUE;
+		drmmode->hotplug_timer = TimerSet(drmmode->hotplug_timer, 0,
+						  DRMMODE_HOTPLUG_DEBOUNCE_MS,
+						  drmmode_hotplug_timer, drmmode);
+	}
 #endif
 }
 
@@ -1488,6 +5180,15 @@ void drmmode_uevent_fini(ScrnInfoPtr scrn, drmmode_ptr drmmode)
 		udev_monitor_unref(drmmode->uevent_monitor);
 		udev_unref(u);
 	}
+	TimerFree(drmmode->hotplug_timer);
+	drmmode->hotplug_timer = NULL;
+	if (drmmode->probe) {
+		xf86RemoveGeneralHandler(drmmode->probe_handler);
+		ms_probe_finish(drmmode->probe);
+		drmmode->probe = NULL;
+	}
+	TimerFree(drmmode->probe_timer);
+	drmmode->probe_timer = NULL;
 #endif
 }
 
@@ -1505,10 +5206,17 @@ Bool drmmode_create_initial_bos(ScrnInfoPtr pScrn, drmmode_ptr drmmode)
 	width = pScrn->virtualX;
 	height = pScrn->virtualY;
 
-	drmmode->front_bo = dumb_bo_create(drmmode->fd, width, height, bpp);
-	if (!drmmode->front_bo)
-		return FALSE;
-	pScrn->displayWidth = drmmode->front_bo->pitch / cpp;
+	drmmode->front_width = width;
+	drmmode->front_height = height;
+	/* with per-crtc scanout the screen only lives in the shadow */
+	if (drmmode->per_crtc_scanout) {
+		pScrn->displayWidth = width;
+	} else {
+		drmmode->front_bo = dumb_bo_pool_get(&drmmode->bo_pool, width, height, bpp);
+		if (!drmmode->front_bo)
+			return FALSE;
+		pScrn->displayWidth = drmmode->front_bo->pitch / cpp;
+	}
 
 	width = ms->cursor_width;
 	height = ms->cursor_height;
@@ -1516,7 +5224,7 @@ Bool drmmode_create_initial_bos(ScrnInfoPtr pScrn, drmmode_ptr drmmode)
 	for (i = 0; i < xf86_config->num_crtc; i++) {
 		xf86CrtcPtr crtc = xf86_config->crtc[i];
 		drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
-		drmmode_crtc->cursor_bo = dumb_bo_create(drmmode->fd, width, height, bpp);
+		drmmode_crtc->cursor_bo = dumb_bo_pool_get(&drmmode->bo_pool, width, height, bpp);
 	}
 	return TRUE;
 }
@@ -1525,6 +5233,9 @@ void *drmmode_map_front_bo(drmmode_ptr drmmode)
 {
 	int ret;
 
+	if (!drmmode->front_bo)
+		return NULL;
+
 	if (drmmode->front_bo->ptr)
 		return drmmode->front_bo->ptr;
 
@@ -1576,63 +5287,184 @@ void drmmode_free_bos(ScrnInfoPtr pScrn, drmmode_ptr drmmode)
 		drmmode->fb_id = 0;
 	}
 
-	dumb_bo_destroy(drmmode->fd, drmmode->front_bo);
+	dumb_bo_pool_put(&drmmode->bo_pool, drmmode->front_bo);
 	drmmode->front_bo = NULL;
 
 	for (i = 0; i < xf86_config->num_crtc; i++) {
 		xf86CrtcPtr crtc = xf86_config->crtc[i];
 		drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
-		dumb_bo_destroy(drmmode->fd, drmmode_crtc->cursor_bo);
+		dumb_bo_pool_put(&drmmode->bo_pool, drmmode_crtc->cursor_bo);
+		drmmode_crtc->cursor_bo = NULL;
+		drmmode_crtc_scanout_free(crtc);
+	}
+	ms_scaler_pool_destroy(drmmode->scaler_pool);
+	drmmode->scaler_pool = NULL;
+
+	xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+		   "Dumb BO pool: %lu hits, %lu misses, %lu KiB idle\n",
+		   drmmode->bo_pool.hits, drmmode->bo_pool.misses,
+		   (unsigned long)(drmmode->bo_pool.idle_bytes >> 10));
+	dumb_bo_pool_trim(&drmmode->bo_pool, 0);
+}
+
+/*
+ * Whether an IN_FORMATS blob lists fourcc with the linear modifier, which
+ * is what dumb buffers are.  -1 if the blob can't be had.
+ */
+static int
+drmmode_in_formats_linear(int fd, uint64_t blob_id, uint32_t fourcc)
+{
+#ifdef FORMAT_BLOB_CURRENT
+	drmModePropertyBlobPtr blob;
+	struct drm_format_modifier_blob *fmt_blob;
+	struct drm_format_modifier *mods;
+	uint32_t *formats;
+	int i, j, ret = 0;
+
+	blob = drmModeGetPropertyBlob(fd, blob_id);
+	if (!blob)
+		return -1;
+
+	fmt_blob = blob->data;
+	formats = (uint32_t *)((char *)fmt_blob + fmt_blob->formats_offset);
+	mods = (struct drm_format_modifier *)
+		((char *)fmt_blob + fmt_blob->modifiers_offset);
+	for (i = 0; i < fmt_blob->count_modifiers && !ret; i++) {
+		if (mods[i].modifier != DRM_FORMAT_MOD_LINEAR)
+			continue;
+		for (j = 0; j < 64 && !ret; j++) {
+			ret = (mods[i].formats & (1ULL << j)) &&
+				mods[i].offset + j < fmt_blob->count_formats &&
+				formats[mods[i].offset + j] == fourcc;
+		}
+	}
+	drmModeFreePropertyBlob(blob);
+	return ret;
+#else
+	return -1;
+#endif
+}
+
+/*
+ * Whether every primary plane can scan out fourcc from a dumb buffer, by
+ * their IN_FORMATS or else their format lists.  -1 when the kernel
+ * doesn't tell us about primary planes.
+ */
+static int
+drmmode_primary_planes_support(drmmode_ptr drmmode, uint32_t fourcc)
+{
+	static const char * const names[] = { "type", "IN_FORMATS" };
+	drmModePlaneResPtr plane_res;
+	int i, j, primaries = 0, supported = 0;
+
+	if (drmSetClientCap(drmmode->fd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1))
+		return -1;
+	plane_res = drmModeGetPlaneResources(drmmode->fd);
+	if (!plane_res)
+		return -1;
+
+	for (i = 0; i < plane_res->count_planes; i++) {
+		uint32_t ids[MS_ARRAY_SIZE(names)];
+		uint64_t values[MS_ARRAY_SIZE(names)];
+		drmModePlanePtr plane;
+		int ok = -1;
+
+		if (!drmmode_prop_info_init(drmmode->fd, plane_res->planes[i],
+					    DRM_MODE_OBJECT_PLANE, names, ids,
+					    values, MS_ARRAY_SIZE(names)) ||
+		    !ids[0] || values[0] != DRM_PLANE_TYPE_PRIMARY)
+			continue;
+
+		if (ids[1])
+			ok = drmmode_in_formats_linear(drmmode->fd, values[1],
+						       fourcc);
+		if (ok < 0) {
+			plane = drmModeGetPlane(drmmode->fd,
+						plane_res->planes[i]);
+			if (!plane)
+				continue;
+			for (j = 0, ok = 0; j < plane->count_formats && !ok; j++)
+				ok = plane->formats[j] == fourcc;
+			drmModeFreePlane(plane);
+		}
+		primaries++;
+		supported += ok;
 	}
+	drmModeFreePlaneResources(plane_res);
+
+	if (!primaries)
+		return -1;
+	return supported == primaries;
 }
 
-/* ugly workaround to see if we can create 32bpp */
+/*
+ * Pick 24 or 32bpp for depth 24 by what the primary planes can show;
+ * kernels that don't list planes get the ugly workaround of seeing
+ * whether a 32bpp fb can be created.
+ */
 void drmmode_get_default_bpp(ScrnInfoPtr pScrn, drmmode_ptr drmmode, int *depth, int *bpp)
 {
 	drmModeResPtr mode_res;
 	uint64_t value;
 	struct dumb_bo *bo;
 	uint32_t fb_id;
+	int width, height;
+	int xrgb, rgb;
 	int ret;
 
+	if (drmmode->probe_cache.valid) {
+		*depth = drmmode->probe_cache.depth;
+		*bpp = drmmode->probe_cache.bpp;
+		return;
+	}
+
 	/* 16 is fine */
 	ret = drmGetCap(drmmode->fd, DRM_CAP_DUMB_PREFERRED_DEPTH, &value);
 	if (!ret && (value == 16 || value == 8)) {
 		*depth = value;
 		*bpp = value;
-		return;
+		goto record;
 	}
 
 	*depth = 24;
-	mode_res = drmModeGetResources(drmmode->fd);
+	*bpp = 24;
+	xrgb = drmmode_primary_planes_support(drmmode, DRM_FORMAT_XRGB8888);
+	if (xrgb == 1) {
+		*bpp = 32;
+		goto record;
+	}
+	rgb = drmmode_primary_planes_support(drmmode, DRM_FORMAT_RGB888);
+	/* the planes have spoken, even if it's to say neither will do */
+	if (xrgb >= 0 || rgb >= 0)
+		goto record;
+
+	/* PreInit's drmmode_pre_init picks these up rather than fetch them again */
+	if (!drmmode->mode_res)
+		drmmode->mode_res = drmModeGetResources(drmmode->fd);
+	mode_res = drmmode->mode_res;
 	if (!mode_res)
 		return;
 
-	if (mode_res->min_width == 0)
-		mode_res->min_width = 1;
-	if (mode_res->min_height == 0)
-		mode_res->min_height = 1;
+	width = max(mode_res->min_width, 1);
+	height = max(mode_res->min_height, 1);
 	/*create a bo */
-	bo = dumb_bo_create(drmmode->fd, mode_res->min_width, mode_res->min_height, 32);
-	if (!bo) {
-		*bpp = 24;
-		goto out;
-	}
+	bo = dumb_bo_pool_get(&drmmode->bo_pool, width, height, 32);
+	if (!bo)
+		goto record;
 
-	ret = drmModeAddFB(drmmode->fd, mode_res->min_width, mode_res->min_height,
+	ret = drmModeAddFB(drmmode->fd, width, height,
 			    24, 32, bo->pitch, bo->handle, &fb_id);
 
 	if (ret) {
-		*bpp = 24;
-		dumb_bo_destroy(drmmode->fd, bo);
-		goto out;
+		dumb_bo_pool_put(&drmmode->bo_pool, bo);
+		goto record;
 	}
 
 	drmModeRmFB(drmmode->fd, fb_id);
 	*bpp = 32;
 
-	dumb_bo_destroy(drmmode->fd, bo);
-out:	
-	drmModeFreeResources(mode_res);
-	return;
+	dumb_bo_pool_put(&drmmode->bo_pool, bo);
+record:
+	drmmode->probe_cache.depth = *depth;
+	drmmode->probe_cache.bpp = *bpp;
 }
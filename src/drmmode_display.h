@@ -28,6 +28,7 @@
 #define DRMMODE_DISPLAY_H
 
 #include "xf86drmMode.h"
+#include "dumb_bo.h"
 #ifdef HAVE_UDEV
 #include "libudev.h"
 #endif
@@ -37,18 +38,117 @@
 #define MODESETTING_OUTPUT_SLAVE_SUPPORT 1
 #endif
 
+/* RandR 1.6 leases hand outputs and crtcs to other DRM clients */
+#if XF86_CRTC_VERSION >= 8 && defined(HAVE_DRMMODECREATELEASE)
+#define MODESETTING_LEASE_SUPPORT 1
+#endif
+
+/* Present flips client pixmaps that live in dumb bos, tracked in msPixmapPriv */
+#if defined(HAVE_PRESENT_H) && defined(MODESETTING_OUTPUT_SLAVE_SUPPORT)
+#define MODESETTING_PRESENT_SUPPORT 1
+#endif
+
 #if XORG_VERSION_CURRENT >= XORG_VERSION_NUMERIC(1,14,99,2,0)
 #define DamageUnregister(d, dd) DamageUnregister(dd)
 #endif
 
-struct dumb_bo {
-    uint32_t handle;
-    uint32_t size;
-    void *ptr;
-    int map_count;
-    uint32_t pitch;
+typedef struct {
+    struct dumb_bo *bo;
+    uint32_t fb_id;
+    int width, height;
+} drmmode_scanout_rec, *drmmode_scanout_ptr;
+
+/* the most tiles of one monitor that modesets and flips are grouped for */
+#define DRMMODE_MAX_TILES 8
+
+/*
+ * A writeback connector, and the capture it does: each frame the crtc of
+ * output is written into pixmap's bo by the display engine.
+ */
+typedef struct {
+    uint32_t connector_id;
+    uint32_t possible_crtcs;
+    uint32_t crtc_prop_id;
+    uint32_t fb_prop_id;
+    uint32_t fence_prop_id;
+    xf86OutputPtr output;
+    PixmapPtr pixmap;
+    uint32_t fb_id;
+    /* the crtc the kernel has the connector on, 0 for none */
+    uint32_t bound_crtc_id;
+    /* signalled once the frame in flight has been written */
+    int32_t fence_fd;
+    void *fence_handler;
+} drmmode_writeback_rec, *drmmode_writeback_ptr;
+
+enum drmmode_plane_property {
+    DRMMODE_PLANE_TYPE = 0,
+    DRMMODE_PLANE_FB_ID,
+    DRMMODE_PLANE_CRTC_ID,
+    DRMMODE_PLANE_SRC_X,
+    DRMMODE_PLANE_SRC_Y,
+    DRMMODE_PLANE_SRC_W,
+    DRMMODE_PLANE_SRC_H,
+    DRMMODE_PLANE_CRTC_X,
+    DRMMODE_PLANE_CRTC_Y,
+    DRMMODE_PLANE_CRTC_W,
+    DRMMODE_PLANE_CRTC_H,
+    DRMMODE_PLANE_FB_DAMAGE_CLIPS,
+    DRMMODE_PLANE__COUNT
+};
+
+enum drmmode_connector_property {
+    DRMMODE_CONNECTOR_EDID = 0,
+    DRMMODE_CONNECTOR_DPMS,
+    DRMMODE_CONNECTOR_SCALING_MODE,
+    DRMMODE_CONNECTOR_TILE,
+    DRMMODE_CONNECTOR_PATH,
+    DRMMODE_CONNECTOR__COUNT
 };
 
+/*
+ * Ids of the connector properties we look at on every probe, and where
+ * they were in the connector's props array, so finding one is an index
+ * instead of a drmModeGetProperty() per property.
+ */
+typedef struct {
+    Bool valid;
+    uint32_t ids[DRMMODE_CONNECTOR__COUNT];
+    int index[DRMMODE_CONNECTOR__COUNT];
+} drmmode_connector_props_rec, *drmmode_connector_props_ptr;
+
+/* a bump allocator for mode lists that are thrown away all at once */
+struct drmmode_arena_chunk;
+typedef struct {
+    struct drmmode_arena_chunk *chunks;
+} drmmode_arena_rec, *drmmode_arena_ptr;
+
+/* what the GTF modes added for a panel fitter depend on */
+typedef struct {
+    int max_x, max_y;
+    float max_vrefresh;
+    int preferred_x, preferred_y;
+    float preferred_vrefresh;
+} drmmode_gtf_key_rec;
+
+/* a connector as the last full probe left it, see drmmode_probe_cache_load */
+typedef struct {
+    uint32_t connector_id;
+    int status;
+    uint64_t hash;
+} drmmode_probe_cache_entry_rec, *drmmode_probe_cache_entry_ptr;
+
+typedef struct {
+    const char *path;
+    /* the file was for this device and driver version */
+    Bool valid;
+    /* and the connectors still matched it, so there's nothing to write */
+    Bool hit;
+    int depth, bpp;
+    int num_connectors;
+    drmmode_probe_cache_entry_ptr connectors;
+} drmmode_probe_cache_rec, *drmmode_probe_cache_ptr;
+
 typedef struct {
     int fd;
     unsigned fb_id;
@@ -59,14 +159,60 @@ typedef struct {
 #ifdef HAVE_UDEV
     struct udev_monitor *uevent_monitor;
     InputHandlerProc uevent_handler;
+    /* our card's device number, uevents for other cards are ignored */
+    dev_t uevent_devnum;
+    /* a burst of hotplug events is reprobed once it has settled */
+    OsTimerPtr hotplug_timer;
+    /* some hotplug event didn't say which connector, reprobe them all */
+    Bool hotplug_all;
+    /* the hotplug reprobe running on probe threads, see probe.c */
+    struct ms_probe *probe;
+    void *probe_handler;
+    OsTimerPtr probe_timer;
 #endif
+    /* the probe under way is for hotplug events, see probe_pending */
+    Bool hotplug_probe;
+    /* startup went on without some connector's probe, redo it */
+    Bool probe_late;
+    drmmode_probe_cache_rec probe_cache;
     drmEventContext event_context;
+    struct dumb_bo_pool bo_pool;
     struct dumb_bo *front_bo;
+    int front_width, front_height; /* allocated size, may exceed virtual */
     Bool sw_cursor;
 
+    Bool universal_planes;
+    Bool atomic_modeset;
+
     Bool shadow_enable;
     void *shadow_fb;
 
+    /* every crtc scans out of its own bo, filled from the shadow */
+    Bool per_crtc_scanout;
+    Bool dirty_fb_unsupported;
+    /* two scanout bos per crtc, updates are page flipped in */
+    Bool tearfree;
+    /* Present may flip fullscreen client pixmaps onto the crtcs */
+    Bool pageflip;
+    Bool async_flip_cap;
+    /* flip without waiting for vblank: lower latency, may tear */
+    Bool async_flip;
+    /* adaptive sync for flipping clients that set _VARIABLE_REFRESH */
+    Bool vrr_support;
+    /* threads for scaling transforms the planes can't do, 0 leaves them to the server */
+    int scaler_threads;
+    struct ms_scaler_pool *scaler_pool;
+    /* some tile's modeset waits for drmmode_flush_tile_modesets */
+    Bool tile_modeset_pending;
+    /* some output property waits for drmmode_flush_output_props */
+    Bool prop_change_pending;
+#ifdef MODESETTING_PRESENT_SUPPORT
+    /* writeback connectors, offered for capture via WRITEBACK_PIXMAP */
+    drmmode_writeback_ptr writebacks;
+    int num_writebacks;
+    Atom writeback_atom;
+#endif
+
 #ifdef HAVE_SCREEN_SPECIFIC_PRIVATE_KEYS
     DevPrivateKeyRec pixmapPrivateKeyRec;
 #endif
@@ -76,8 +222,44 @@ typedef struct {
     drmmode_ptr drmmode;
     drmModeCrtcPtr mode_crtc;
     int hw_id;
+    uint32_t vblank_pipe;
+    uint32_t plane_id;
+    uint32_t plane_props[DRMMODE_PLANE__COUNT];
     struct dumb_bo *cursor_bo;
     unsigned rotate_fb_id;
+    drmmode_scanout_rec scanout[2];
+    unsigned scanout_id; /* the one on screen, or about to be */
+    Bool use_scanout;
+    RegionRec scanout_damage; /* not yet in the back scanout */
+    RegionRec scanout_last_damage; /* went into the front one last frame */
+    Bool flip_pending;
+    Bool async_flip_refused;
+    uint32_t vrr_prop_id;
+    Bool vrr_enabled;
+    /* what the crtc was last pointed at, and which part of it */
+    uint32_t shown_fb_id;
+    int shown_x, shown_y, shown_w, shown_h;
+    /* a pan is on its way to the plane, another waits for it to land */
+    Bool pan_in_flight;
+    Bool pan_pending;
+    /* the primary plane scales shown_w x shown_h to the mode */
+    Bool plane_scaled;
+    /* or the driver scales the shadow into the scanout bos itself */
+    struct ms_scaler *scaler;
+    uint32_t msc_prev;
+    uint64_t msc_high;
+    /* leased out, some other DRM client drives it */
+    Bool leased;
+    /* a tile whose modeset is held back to go in with its peers' */
+    Bool tile_modeset;
+    drmModeModeInfo tile_kmode;
+    /* until it goes in: the scanouts still on screen, and RandR's old state */
+    drmmode_scanout_rec tile_old_scanout[2];
+    DisplayModeRec tile_saved_mode;
+    int tile_saved_x, tile_saved_y;
+    Rotation tile_saved_rotation;
+    /* the crtc whose flip event also completes this tile's flip */
+    xf86CrtcPtr tile_flip_leader;
     uint16_t lut_r[256], lut_g[256], lut_b[256];
     DamagePtr slave_damage;
 } drmmode_crtc_private_rec, *drmmode_crtc_private_ptr;
@@ -87,26 +269,59 @@ typedef struct {
     uint64_t value;
     int num_atoms; /* if range prop, num_atoms == 1; if enum prop, num_atoms == num_enums + 1 */
     Atom *atoms;
+    /* set by a client, waiting for drmmode_flush_output_props */
+    Bool pending;
+    uint64_t pending_value;
 } drmmode_prop_rec, *drmmode_prop_ptr;
 
 
 typedef struct {
     drmmode_ptr drmmode;
+    /* -1 once the connector is gone, e.g. its MST hub was unplugged */
     int output_id;
     drmModeConnectorPtr mode_output;
     drmModeEncoderPtr *mode_encoders;
+    int num_encoders;
     drmModePropertyBlobPtr edid_blob;
+    drmmode_connector_props_rec conn_props;
+    /* what get_modes made of the monitor the last time, see probe_hash */
+    Bool probe_cached;
+    uint64_t probe_hash;
+    DisplayModePtr probe_modes;
+    drmmode_arena_rec mode_arena;
+    /* the GTF modes for a panel fitter, and the limits they were made for */
+    Bool gtf_cached;
+    drmmode_gtf_key_rec gtf_key;
+    DisplayModePtr gtf_modes;
+    drmmode_arena_rec gtf_arena;
     int dpms_enum_id;
     int num_props;
     drmmode_prop_ptr props;
+    /* props by atom: open addressing, index + 1, 0 is empty */
+    int *prop_hash;
+    unsigned int prop_hash_mask;
     int enc_mask;
     int enc_clone_mask;
+    drmModePropertyBlobPtr tile_blob;
+    Bool leased;
+    /* a hotplug event named this connector, the next reprobe is for it */
+    Bool probe_pending;
+    /* and this is what the probe threads found, for detect to pick up */
+    drmModeConnectorPtr probed;
 } drmmode_output_private_rec, *drmmode_output_private_ptr;
 
+#ifdef MODESETTING_LEASE_SUPPORT
+typedef struct {
+    uint32_t lessee_id;
+} drmmode_lease_private_rec, *drmmode_lease_private_ptr;
+#endif
+
 #ifdef MODESETTING_OUTPUT_SLAVE_SUPPORT
 typedef struct _msPixmapPriv {
     uint32_t fb_id;
     struct dumb_bo *backing_bo; /* if this pixmap is backed by a dumb bo */
+    Bool own_bo; /* backing_bo came from msCreatePixmap, fb_id too */
+    Bool flip_vrr; /* the window it was last checked for wants VRR */
 } msPixmapPrivRec, *msPixmapPrivPtr;
 
 
@@ -122,10 +337,32 @@ Bool drmmode_SetSlaveBO(PixmapPtr ppix,
 #endif
 
 extern Bool drmmode_pre_init(ScrnInfoPtr pScrn, drmmode_ptr drmmode, int cpp);
+void drmmode_probe_cache_load(ScrnInfoPtr pScrn, drmmode_ptr drmmode);
 void drmmode_adjust_frame(ScrnInfoPtr pScrn, drmmode_ptr drmmode, int x, int y);
+void drmmode_crtc_set_vrr(xf86CrtcPtr crtc, Bool enabled);
+int drmmode_crtc_page_flip(xf86CrtcPtr crtc, uint32_t fb_id, Bool async,
+			   uint32_t seq, RegionPtr damage);
+int drmmode_crtc_tile_peers(xf86CrtcPtr crtc, xf86CrtcPtr *peers);
+int drmmode_crtcs_page_flip(xf86CrtcPtr *crtcs, int n, uint32_t fb_id,
+			    Bool async, uint32_t seq);
+void drmmode_flush_tile_modesets(drmmode_ptr drmmode);
+void drmmode_flush_output_props(drmmode_ptr drmmode);
+void drmmode_force_probe(ScrnInfoPtr scrn);
+#ifdef MODESETTING_PRESENT_SUPPORT
+void drmmode_writeback_frame(drmmode_ptr drmmode);
+void drmmode_writeback_fini(drmmode_ptr drmmode);
+Bool drmmode_writeback_size_ok(drmmode_ptr drmmode, int width, int height);
+#endif
+Bool drmmode_damage_fb(drmmode_ptr drmmode, uint32_t fb_id, RegionPtr region,
+		       int dx, int dy);
+void drmmode_update_scanouts(ScrnInfoPtr scrn, drmmode_ptr drmmode, RegionPtr damage);
 extern Bool drmmode_set_desired_modes(ScrnInfoPtr pScrn, drmmode_ptr drmmode);
 extern Bool drmmode_setup_colormap(ScreenPtr pScreen, ScrnInfoPtr pScrn);
 
+#ifdef MODESETTING_LEASE_SUPPORT
+void drmmode_validate_leases(ScrnInfoPtr scrn, drmmode_ptr drmmode);
+#endif
+
 extern void drmmode_uevent_init(ScrnInfoPtr scrn, drmmode_ptr drmmode);
 extern void drmmode_uevent_fini(ScrnInfoPtr scrn, drmmode_ptr drmmode);
 
@@ -143,6 +380,32 @@ void drmmode_get_default_bpp(ScrnInfoPtr pScrn, drmmode_ptr drmmmode, int *depth
 #define DRM_CAP_DUMB_PREFER_SHADOW 4
 #endif
 
+#ifndef DRM_CAP_ASYNC_PAGE_FLIP
+#define DRM_CAP_ASYNC_PAGE_FLIP 0x7
+#endif
+#ifndef DRM_MODE_PAGE_FLIP_ASYNC
+#define DRM_MODE_PAGE_FLIP_ASYNC 0x02
+#endif
+
+#ifndef DRM_CLIENT_CAP_UNIVERSAL_PLANES
+#define DRM_CLIENT_CAP_UNIVERSAL_PLANES 2
+#endif
+#ifndef DRM_CLIENT_CAP_ATOMIC
+#define DRM_CLIENT_CAP_ATOMIC 3
+#endif
+#ifndef DRM_CLIENT_CAP_WRITEBACK_CONNECTORS
+#define DRM_CLIENT_CAP_WRITEBACK_CONNECTORS 5
+#endif
+#ifndef DRM_MODE_CONNECTOR_WRITEBACK
+#define DRM_MODE_CONNECTOR_WRITEBACK 18
+#endif
+#ifndef DRM_MODE_PROP_ATOMIC
+#define DRM_MODE_PROP_ATOMIC 0x80000000
+#endif
+#ifndef DRM_PLANE_TYPE_PRIMARY
+#define DRM_PLANE_TYPE_PRIMARY 1
+#endif
+
 #define MS_ARRAY_SIZE(x) (sizeof(x)/sizeof(x[0]))
 
 
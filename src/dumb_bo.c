@@ -0,0 +1,238 @@
+/*
+ * Copyright © 2007 Red Hat, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * Authors:
+ *    Dave Airlie <airlied@redhat.com>
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <xf86drm.h>
+
+#include "dumb_bo.h"
+
+/* four classes per power of two, so a class spans less than 25% */
+static int dumb_bo_size_class(uint32_t size)
+{
+	int msb = 0;
+
+	if (size < 8)
+		return size;
+
+	while (size >> (msb + 1))
+		msb++;
+
+	return msb * 4 + ((size >> (msb - 2)) & 3);
+}
+
+struct dumb_bo *dumb_bo_create(int fd,
+			  const unsigned width, const unsigned height,
+			  const unsigned bpp)
+{
+	struct drm_mode_create_dumb arg;
+	struct dumb_bo *bo;
+	int ret;
+
+	bo = calloc(1, sizeof(*bo));
+	if (!bo)
+		return NULL;
+
+	memset(&arg, 0, sizeof(arg));
+	arg.width = width;
+	arg.height = height;
+	arg.bpp = bpp;
+	
+	ret = drmIoctl(fd, DRM_IOCTL_MODE_CREATE_DUMB, &arg);
+	if (ret)
+		goto err_free;
+
+	bo->handle = arg.handle;
+	bo->size = arg.size;
+	bo->pitch = arg.pitch;
+	bo->width = width;
+	bo->height = height;
+	bo->bpp = bpp;
+	bo->size_class = dumb_bo_size_class(bo->size);
+
+	return bo;
+ err_free:
+	free(bo);
+	return NULL;
+}
+
+int dumb_bo_map(int fd, struct dumb_bo *bo)
+{
+	struct drm_mode_map_dumb arg;
+	int ret, flags = MAP_SHARED;
+	void *map;
+
+	if (bo->ptr) {
+		bo->map_count++;
+		return 0;
+	}
+
+	memset(&arg, 0, sizeof(arg));
+	arg.handle = bo->handle;
+
+	ret = drmIoctl(fd, DRM_IOCTL_MODE_MAP_DUMB, &arg);
+	if (ret)
+		return ret;
+
+#ifdef MAP_POPULATE
+	/* take the page faults now rather than on the first frame */
+	if (bo->prefault)
+		flags |= MAP_POPULATE;
+#endif
+
+	map = mmap(0, bo->size, PROT_READ | PROT_WRITE, flags,
+		   fd, arg.offset);
+	if (map == MAP_FAILED)
+		return -errno;
+
+	bo->ptr = map;
+	return 0;
+}
+
+int dumb_bo_destroy(int fd, struct dumb_bo *bo)
+{
+	struct drm_mode_destroy_dumb arg;
+	int ret;
+	
+	if (bo->ptr) {
+		munmap(bo->ptr, bo->size);
+		bo->ptr = NULL;
+	}
+
+	memset(&arg, 0, sizeof(arg));
+	arg.handle = bo->handle;
+	ret = drmIoctl(fd, DRM_IOCTL_MODE_DESTROY_DUMB, &arg);
+	if (ret)
+		return -errno;
+
+	free(bo);
+	return 0;
+}
+
+#ifdef HAVE_DRMPRIMEFDTOHANDLE
+struct dumb_bo *dumb_get_bo_from_handle(int fd, int handle, int pitch, int size)
+{
+  	struct dumb_bo *bo;
+	int ret;
+
+	bo = calloc(1, sizeof(*bo));
+	if (!bo)
+		return NULL;
+
+	ret = drmPrimeFDToHandle(fd, handle, &bo->handle);
+	if (ret) {
+		free(bo);
+		return NULL;
+	}
+	bo->pitch = pitch;
+	bo->size = size;
+	return bo;
+}
+#endif
+
+void dumb_bo_pool_init(struct dumb_bo_pool *pool, int fd)
+{
+	memset(pool, 0, sizeof(*pool));
+	pool->fd = fd;
+	pool->max_idle_bytes = DUMB_BO_POOL_DEFAULT_SIZE;
+}
+
+/*
+ * Same width and bpp means the kernel would hand out the same pitch, so
+ * an idle bo of that width and at least the height in the same size class
+ * can stand in for a new one.
+ */
+struct dumb_bo *dumb_bo_pool_get(struct dumb_bo_pool *pool,
+				 const unsigned width, const unsigned height,
+				 const unsigned bpp)
+{
+	struct dumb_bo **link, *bo;
+
+	for (link = &pool->idle; (bo = *link); link = &bo->next) {
+		if (bo->width != width || bo->bpp != bpp ||
+		    bo->height < height ||
+		    bo->size_class != dumb_bo_size_class(bo->pitch * height))
+			continue;
+
+		*link = bo->next;
+		bo->next = NULL;
+		pool->idle_bytes -= bo->size;
+		pool->hits++;
+		return bo;
+	}
+
+	pool->misses++;
+	bo = dumb_bo_create(pool->fd, width, height, bpp);
+	if (bo)
+		bo->prefault = pool->prefault;
+	return bo;
+}
+
+void dumb_bo_pool_put(struct dumb_bo_pool *pool, struct dumb_bo *bo)
+{
+	if (!bo)
+		return;
+
+	if (bo->size > pool->max_idle_bytes) {
+		dumb_bo_destroy(pool->fd, bo);
+		return;
+	}
+
+	bo->next = pool->idle;
+	pool->idle = bo;
+	pool->idle_bytes += bo->size;
+
+	if (pool->idle_bytes > pool->max_idle_bytes)
+		dumb_bo_pool_trim(pool, pool->max_idle_bytes);
+}
+
+/* release idle bos until at most max_idle_bytes remain, newest are kept */
+void dumb_bo_pool_trim(struct dumb_bo_pool *pool, size_t max_idle_bytes)
+{
+	struct dumb_bo **link = &pool->idle;
+	size_t kept = 0;
+
+	while (*link) {
+		struct dumb_bo *bo = *link;
+
+		if (kept + bo->size <= max_idle_bytes) {
+			kept += bo->size;
+			link = &bo->next;
+			continue;
+		}
+
+		*link = bo->next;
+		pool->idle_bytes -= bo->size;
+		dumb_bo_destroy(pool->fd, bo);
+	}
+}
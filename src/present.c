@@ -0,0 +1,621 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Present backend: vblank timing from drmWaitVBlank, and page flips of
+ * fullscreen pixmaps that live in dumb bos.  Everything else is left to
+ * the copy path in the Present core.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "xf86.h"
+#include "xf86Crtc.h"
+#include "X11/Xatom.h"
+#include "driver.h"
+
+#ifdef MODESETTING_PRESENT_SUPPORT
+
+#include <present.h>
+#include "propertyst.h"
+
+static Atom ms_vrr_atom;
+
+struct ms_present_flip;
+
+/* a Present vblank wait, or one crtc's share of a flip */
+struct ms_present_vblank_event {
+    uint64_t event_id;
+    struct ms_present_flip *flip;
+    xf86CrtcPtr crtc;
+};
+
+/* a flip across all lit crtcs, done when the last one completes */
+struct ms_present_flip {
+    uint64_t event_id;
+    xf86CrtcPtr event_crtc; /* report its msc, or the first one's if NULL */
+    uint64_t ust, msc;
+    Bool have_msc;
+    int pending;
+    Bool failed;
+};
+
+static RRCrtcPtr
+ms_present_get_crtc(WindowPtr window)
+{
+    ScrnInfoPtr scrn = xf86ScreenToScrn(window->drawable.pScreen);
+    xf86CrtcPtr crtc;
+    BoxRec box;
+
+    box.x1 = window->drawable.x;
+    box.y1 = window->drawable.y;
+    box.x2 = box.x1 + window->drawable.width;
+    box.y2 = box.y1 + window->drawable.height;
+
+    crtc = ms_covering_crtc(scrn, &box);
+    if (!crtc)
+        return NULL;
+    return crtc->randr_crtc;
+}
+
+static int
+ms_present_get_ust_msc(RRCrtcPtr crtc, CARD64 *ust, CARD64 *msc)
+{
+    xf86CrtcPtr xf86_crtc = crtc->devPrivate;
+
+    return ms_get_crtc_ust_msc(xf86_crtc, ust, msc);
+}
+
+static void
+ms_present_vblank_handler(uint64_t msc, uint64_t usec, void *data)
+{
+    struct ms_present_vblank_event *event = data;
+
+    present_event_notify(event->event_id, usec, msc);
+    free(event);
+}
+
+static void
+ms_present_vblank_abort(void *data)
+{
+    free(data);
+}
+
+static int
+ms_present_queue_vblank(RRCrtcPtr crtc, uint64_t event_id, uint64_t msc)
+{
+    xf86CrtcPtr xf86_crtc = crtc->devPrivate;
+    ScreenPtr screen = crtc->pScreen;
+    ScrnInfoPtr scrn = xf86ScreenToScrn(screen);
+    modesettingPtr ms = modesettingPTR(scrn);
+    drmmode_crtc_private_ptr drmmode_crtc = xf86_crtc->driver_private;
+    struct ms_present_vblank_event *event;
+    drmVBlank vbl;
+    uint32_t seq;
+
+    event = calloc(1, sizeof(*event));
+    if (!event)
+        return BadAlloc;
+    event->event_id = event_id;
+    event->crtc = xf86_crtc;
+
+    seq = ms_drm_queue_alloc(xf86_crtc, event, ms_present_vblank_handler,
+                             ms_present_vblank_abort);
+    if (!seq) {
+        free(event);
+        return BadAlloc;
+    }
+
+    vbl.request.type = DRM_VBLANK_ABSOLUTE | DRM_VBLANK_EVENT |
+        drmmode_crtc->vblank_pipe;
+    vbl.request.sequence = ms_crtc_msc_to_kernel_msc(xf86_crtc, msc);
+    vbl.request.signal = seq;
+    while (drmWaitVBlank(ms->fd, &vbl)) {
+        /* the kernel's event queue is full, drain it and retry */
+        if (errno != EBUSY || ms_flush_drm_events(screen) <= 0) {
+            ms_drm_abort_seq(scrn, seq);
+            return BadAlloc;
+        }
+    }
+
+    return Success;
+}
+
+static Bool
+ms_present_event_match(void *data, void *match_data)
+{
+    struct ms_present_vblank_event *event = data;
+    uint64_t *event_id = match_data;
+
+    return event->event_id == *event_id;
+}
+
+static void
+ms_present_abort_vblank(RRCrtcPtr crtc, uint64_t event_id, uint64_t msc)
+{
+    ScrnInfoPtr scrn = xf86ScreenToScrn(crtc->pScreen);
+
+    ms_drm_abort(scrn, ms_present_vblank_handler, ms_present_event_match,
+                 &event_id);
+}
+
+static void
+ms_present_flush(WindowPtr window)
+{
+    /* no acceleration, nothing is queued up */
+}
+
+/* can this crtc be flipped between the front and a screen-sized pixmap? */
+static Bool
+ms_present_crtc_flippable(xf86CrtcPtr crtc)
+{
+    drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+
+    if (drmmode_crtc->rotate_fb_id || drmmode_crtc->use_scanout)
+        return FALSE;
+    if (crtc->randr_crtc && crtc->randr_crtc->scanout_pixmap)
+        return FALSE;
+    return TRUE;
+}
+
+static uint32_t
+ms_present_pixmap_fb(ScrnInfoPtr scrn, PixmapPtr pixmap)
+{
+    modesettingPtr ms = modesettingPTR(scrn);
+    msPixmapPrivPtr ppriv = msGetPixmapPriv(&ms->drmmode, pixmap);
+
+    if (!ppriv->fb_id &&
+        drmModeAddFB(ms->fd, pixmap->drawable.width,
+                     pixmap->drawable.height, pixmap->drawable.depth,
+                     pixmap->drawable.bitsPerPixel, ppriv->backing_bo->pitch,
+                     ppriv->backing_bo->handle, &ppriv->fb_id))
+        ppriv->fb_id = 0;
+
+    return ppriv->fb_id;
+}
+
+/* has the client set _VARIABLE_REFRESH on window to ask for VRR? */
+static Bool
+ms_window_wants_vrr(WindowPtr window)
+{
+    PropertyPtr prop;
+
+    if (!ms_vrr_atom ||
+        dixLookupProperty(&prop, window, ms_vrr_atom, serverClient,
+                          DixReadAccess) != Success)
+        return FALSE;
+
+    return prop->type == XA_CARDINAL && prop->format == 32 &&
+        prop->size == 1 && *(uint32_t *) prop->data != 0;
+}
+
+static void
+ms_present_set_screen_vrr(ScrnInfoPtr scrn, Bool enabled)
+{
+    xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(scrn);
+    int i;
+
+    for (i = 0; i < config->num_crtc; i++) {
+        xf86CrtcPtr crtc = config->crtc[i];
+
+        if (crtc->enabled || !enabled)
+            drmmode_crtc_set_vrr(crtc, enabled);
+    }
+}
+
+/* could the whole screen be flipped to pixmap right now? */
+static Bool
+ms_present_flippable(ScrnInfoPtr scrn, PixmapPtr pixmap)
+{
+    modesettingPtr ms = modesettingPTR(scrn);
+    xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(scrn);
+    msPixmapPrivPtr ppriv = msGetPixmapPriv(&ms->drmmode, pixmap);
+    int num_crtcs_on = 0;
+    int i;
+
+    /* the crtcs must be scanning out of the front, not a shadow copy */
+    if (!ms->drmmode.pageflip || ms->drmmode.shadow_enable ||
+        !ms->drmmode.front_bo || !ms->drmmode.fb_id)
+        return FALSE;
+
+    if (!ppriv->own_bo ||
+        pixmap->drawable.width != scrn->virtualX ||
+        pixmap->drawable.height != scrn->virtualY ||
+        pixmap->drawable.bitsPerPixel != scrn->bitsPerPixel ||
+        ppriv->backing_bo->pitch != ms->drmmode.front_bo->pitch)
+        return FALSE;
+
+    for (i = 0; i < config->num_crtc; i++) {
+        xf86CrtcPtr xf86_crtc = config->crtc[i];
+
+        if (!xf86_crtc->enabled)
+            continue;
+        if (!ms_present_crtc_flippable(xf86_crtc))
+            return FALSE;
+        num_crtcs_on++;
+    }
+
+    return num_crtcs_on > 0;
+}
+
+static Bool
+ms_present_check_flip(RRCrtcPtr crtc, WindowPtr window, PixmapPtr pixmap,
+                      Bool sync_flip)
+{
+    ScrnInfoPtr scrn = xf86ScreenToScrn(window->drawable.pScreen);
+    modesettingPtr ms = modesettingPTR(scrn);
+
+    if (!ms_present_flippable(scrn, pixmap))
+        return FALSE;
+
+    /*
+     * flip only gets the pixmap, and maybe much later, so note on it
+     * whether the window it is presented to wants VRR.
+     */
+    msGetPixmapPriv(&ms->drmmode, pixmap)->flip_vrr =
+        ms->drmmode.vrr_support && ms_window_wants_vrr(window);
+
+    return TRUE;
+}
+
+static void
+ms_present_flip_done(struct ms_present_flip *flip)
+{
+    if (--flip->pending)
+        return;
+
+    if (!flip->failed)
+        present_event_notify(flip->event_id, flip->ust, flip->msc);
+    free(flip);
+}
+
+static void
+ms_present_flip_handler(uint64_t msc, uint64_t usec, void *data)
+{
+    struct ms_present_vblank_event *event = data;
+    struct ms_present_flip *flip = event->flip;
+
+    if (event->crtc == flip->event_crtc ||
+        (!flip->event_crtc && !flip->have_msc)) {
+        flip->ust = usec;
+        flip->msc = msc;
+        flip->have_msc = TRUE;
+    }
+
+    free(event);
+    ms_present_flip_done(flip);
+}
+
+static void
+ms_present_flip_abort(void *data)
+{
+    struct ms_present_vblank_event *event = data;
+    struct ms_present_flip *flip = event->flip;
+
+    flip->failed = TRUE;
+    free(event);
+    ms_present_flip_done(flip);
+}
+
+/* put the front back on every lit crtc the hard way */
+static void
+ms_present_restore_front(ScrnInfoPtr scrn)
+{
+    xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(scrn);
+    int i;
+
+    for (i = 0; i < config->num_crtc; i++) {
+        xf86CrtcPtr crtc = config->crtc[i];
+
+        if (crtc->enabled)
+            crtc->funcs->set_mode_major(crtc, &crtc->mode, crtc->rotation,
+                                        crtc->x, crtc->y);
+    }
+}
+
+/*
+ * Flip every lit crtc to fb_id.  Present hears about event_id once the
+ * last of them has completed.  The tiles of one monitor flip together,
+ * in one commit reporting back through a single event.
+ */
+static Bool
+ms_present_do_flip(ScrnInfoPtr scrn, xf86CrtcPtr event_crtc,
+                   uint64_t event_id, uint32_t fb_id, Bool async)
+{
+    modesettingPtr ms = modesettingPTR(scrn);
+    xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(scrn);
+    struct ms_present_flip *flip;
+    uint32_t done = 0;
+    int flipped = 0;
+    int i, j;
+
+    flip = calloc(1, sizeof(*flip));
+    if (!flip)
+        return FALSE;
+    flip->event_id = event_id;
+    flip->event_crtc = event_crtc;
+    flip->pending = 1; /* ours, dropped below */
+
+    for (i = 0; i < config->num_crtc; i++) {
+        xf86CrtcPtr crtc = config->crtc[i];
+        xf86CrtcPtr peers[DRMMODE_MAX_TILES];
+        struct ms_present_vblank_event *event;
+        uint32_t seq;
+        int npeers;
+
+        if (!crtc->enabled || !ms_present_crtc_flippable(crtc) ||
+            (done & (1U << i)))
+            continue;
+
+        npeers = drmmode_crtc_tile_peers(crtc, peers);
+
+        event = calloc(1, sizeof(*event));
+        if (!event)
+            goto fail;
+        event->event_id = event_id;
+        event->flip = flip;
+        /* the group's event comes from the crtc Present asked about */
+        event->crtc = crtc;
+        for (j = 0; j < npeers; j++)
+            if (peers[j] == event_crtc)
+                event->crtc = event_crtc;
+
+        seq = ms_drm_queue_alloc(event->crtc, event, ms_present_flip_handler,
+                                 ms_present_flip_abort);
+        if (!seq) {
+            free(event);
+            goto fail;
+        }
+        flip->pending++;
+
+        if (drmmode_crtcs_page_flip(peers, npeers, fb_id, async, seq)) {
+            ms_drm_abort_seq(scrn, seq);
+            goto fail;
+        }
+        flipped++;
+
+        for (j = 0; j < npeers; j++) {
+            drmmode_crtc_private_ptr drmmode_crtc = peers[j]->driver_private;
+
+            done |= 1U << drmmode_crtc->hw_id;
+        }
+    }
+
+    if (!flipped)
+        goto fail;
+
+    ms_present_flip_done(flip);
+    return TRUE;
+
+fail:
+    flip->failed = TRUE;
+    if (flipped) {
+        /* some crtcs went ahead, let them land and then undo them */
+        while (flip->pending > 1 &&
+               drmHandleEvent(ms->fd, &ms->drmmode.event_context) >= 0)
+            ;
+        ms_present_restore_front(scrn);
+    }
+    ms_present_flip_done(flip);
+    return FALSE;
+}
+
+static Bool
+ms_present_flip(RRCrtcPtr crtc, uint64_t event_id, uint64_t target_msc,
+                PixmapPtr pixmap, Bool sync_flip)
+{
+    ScreenPtr screen = crtc->pScreen;
+    ScrnInfoPtr scrn = xf86ScreenToScrn(screen);
+    modesettingPtr ms = modesettingPTR(scrn);
+    Bool vrr = msGetPixmapPriv(&ms->drmmode, pixmap)->flip_vrr;
+    uint32_t fb_id;
+
+    if (!ms_present_flippable(scrn, pixmap))
+        return FALSE;
+
+    fb_id = ms_present_pixmap_fb(scrn, pixmap);
+    if (!fb_id)
+        return FALSE;
+
+    /* with VRR the refresh follows the client's flips */
+    ms_present_set_screen_vrr(scrn, vrr);
+
+    /* the client asked for it, or the operator wants it for everyone */
+    if (ms_present_do_flip(scrn, crtc->devPrivate, event_id, fb_id,
+                           !sync_flip || ms->drmmode.async_flip))
+        return TRUE;
+
+    /* present falls back to copying, at the desktop's fixed rate */
+    if (vrr)
+        ms_present_set_screen_vrr(scrn, FALSE);
+    return FALSE;
+}
+
+static void
+ms_present_unflip(ScreenPtr screen, uint64_t event_id)
+{
+    ScrnInfoPtr scrn = xf86ScreenToScrn(screen);
+    modesettingPtr ms = modesettingPTR(scrn);
+
+    /* back to the desktop, which should not flicker at random rates */
+    ms_present_set_screen_vrr(scrn, FALSE);
+
+    if (ms->drmmode.fb_id &&
+        ms_present_do_flip(scrn, NULL, event_id, ms->drmmode.fb_id,
+                           ms->drmmode.async_flip))
+        return;
+
+    ms_present_restore_front(scrn);
+    present_event_notify(event_id, 0, 0);
+}
+
+/*
+ * Screen-sized pixmaps are what fullscreen windows get flipped with, so
+ * put those in dumb bos that can become framebuffers, if anything could
+ * be flipped at all.  So are pixmaps the size of a lit crtc when there
+ * are writeback connectors to capture into them.  Rendering into bos is
+ * slower, so no others.
+ */
+static PixmapPtr
+ms_present_create_pixmap(ScreenPtr screen, int width, int height, int depth,
+                         unsigned usage)
+{
+    ScrnInfoPtr scrn = xf86ScreenToScrn(screen);
+    modesettingPtr ms = modesettingPTR(scrn);
+    Bool flips = ms->drmmode.pageflip && !ms->drmmode.shadow_enable;
+    struct dumb_bo *bo;
+    PixmapPtr pixmap;
+
+    if (depth != scrn->depth || usage == CREATE_PIXMAP_USAGE_GLYPH_PICTURE)
+        goto fallback;
+    if (!(flips && width == scrn->virtualX && height == scrn->virtualY) &&
+        !drmmode_writeback_size_ok(&ms->drmmode, width, height))
+        goto fallback;
+
+    bo = dumb_bo_pool_get(&ms->drmmode.bo_pool, width, height,
+                          scrn->bitsPerPixel);
+    if (!bo)
+        goto fallback;
+    if (dumb_bo_map(ms->fd, bo)) {
+        dumb_bo_pool_put(&ms->drmmode.bo_pool, bo);
+        goto fallback;
+    }
+
+    screen->CreatePixmap = ms->CreatePixmap;
+    pixmap = screen->CreatePixmap(screen, 0, 0, depth, usage);
+    screen->CreatePixmap = ms_present_create_pixmap;
+    if (!pixmap) {
+        dumb_bo_pool_put(&ms->drmmode.bo_pool, bo);
+        return NULL;
+    }
+
+    if (!screen->ModifyPixmapHeader(pixmap, width, height, depth,
+                                    scrn->bitsPerPixel, bo->pitch, bo->ptr)) {
+        screen->DestroyPixmap(pixmap);
+        dumb_bo_pool_put(&ms->drmmode.bo_pool, bo);
+        goto fallback;
+    }
+
+    msGetPixmapPriv(&ms->drmmode, pixmap)->backing_bo = bo;
+    msGetPixmapPriv(&ms->drmmode, pixmap)->own_bo = TRUE;
+    return pixmap;
+
+fallback:
+    screen->CreatePixmap = ms->CreatePixmap;
+    pixmap = screen->CreatePixmap(screen, width, height, depth, usage);
+    screen->CreatePixmap = ms_present_create_pixmap;
+    return pixmap;
+}
+
+static Bool
+ms_present_destroy_pixmap(PixmapPtr pixmap)
+{
+    ScreenPtr screen = pixmap->drawable.pScreen;
+    modesettingPtr ms = modesettingPTR(xf86ScreenToScrn(screen));
+    Bool ret;
+
+    if (pixmap->refcnt == 1) {
+        msPixmapPrivPtr ppriv = msGetPixmapPriv(&ms->drmmode, pixmap);
+
+        if (ppriv->own_bo) {
+            if (ppriv->fb_id)
+                drmModeRmFB(ms->fd, ppriv->fb_id);
+            dumb_bo_pool_put(&ms->drmmode.bo_pool, ppriv->backing_bo);
+            ppriv->fb_id = 0;
+            ppriv->backing_bo = NULL;
+            ppriv->own_bo = FALSE;
+        }
+    }
+
+    screen->DestroyPixmap = ms->DestroyPixmap;
+    ret = screen->DestroyPixmap(pixmap);
+    screen->DestroyPixmap = ms_present_destroy_pixmap;
+    return ret;
+}
+
+static const present_screen_info_rec ms_present_screen_info = {
+    .version = PRESENT_SCREEN_INFO_VERSION,
+
+    .get_crtc = ms_present_get_crtc,
+    .get_ust_msc = ms_present_get_ust_msc,
+    .queue_vblank = ms_present_queue_vblank,
+    .abort_vblank = ms_present_abort_vblank,
+    .flush = ms_present_flush,
+
+    .capabilities = PresentCapabilityNone,
+    .check_flip = ms_present_check_flip,
+    .flip = ms_present_flip,
+    .unflip = ms_present_unflip,
+};
+
+Bool
+ms_present_screen_init(ScreenPtr screen)
+{
+    ScrnInfoPtr scrn = xf86ScreenToScrn(screen);
+    modesettingPtr ms = modesettingPTR(scrn);
+
+    /* with a shadow in front nothing could ever be flipped */
+    if ((ms->drmmode.pageflip && !ms->drmmode.shadow_enable) ||
+        ms->drmmode.num_writebacks) {
+        ms->CreatePixmap = screen->CreatePixmap;
+        screen->CreatePixmap = ms_present_create_pixmap;
+        ms->DestroyPixmap = screen->DestroyPixmap;
+        screen->DestroyPixmap = ms_present_destroy_pixmap;
+    }
+
+    if (ms->drmmode.vrr_support)
+        ms_vrr_atom = MakeAtom("_VARIABLE_REFRESH",
+                               strlen("_VARIABLE_REFRESH"), TRUE);
+
+    ms->present_info = malloc(sizeof(ms_present_screen_info));
+    if (!ms->present_info)
+        return FALSE;
+    *ms->present_info = ms_present_screen_info;
+    if (ms->drmmode.async_flip_cap)
+        ms->present_info->capabilities |= PresentCapabilityAsync;
+
+    return present_screen_init(screen, ms->present_info);
+}
+
+void
+ms_present_close_screen(ScreenPtr screen)
+{
+    modesettingPtr ms = modesettingPTR(xf86ScreenToScrn(screen));
+
+    if (ms->CreatePixmap) {
+        screen->CreatePixmap = ms->CreatePixmap;
+        screen->DestroyPixmap = ms->DestroyPixmap;
+        ms->CreatePixmap = NULL;
+        ms->DestroyPixmap = NULL;
+    }
+
+    /* present's CloseScreen, wrapped after ours, is done with it by now */
+    free(ms->present_info);
+    ms->present_info = NULL;
+}
+
+#endif
@@ -0,0 +1,249 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Connector probing off the main thread.  A forced probe has the kernel
+ * read EDID over DDC, and a port with nothing on it can take a DDC
+ * timeout to say so; done one after another from the server's main loop
+ * that stalls startup and, on hotplug, client dispatch.
+ *
+ * A probe hands its connectors out to a few threads and signals a pipe
+ * once they are all done, so the main loop can poll for it or wait with
+ * a deadline.  A thread stuck in the kernel can't be called back: the
+ * caller just stops waiting, and whoever lets go of the probe last, the
+ * caller or a worker, frees it.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "probe.h"
+
+struct ms_probe {
+    pthread_mutex_t lock;
+    int refcnt;                 /* the caller and each worker still going */
+    int fd;                     /* our own dup, the caller may close theirs */
+    int pipe[2];                /* readable once every connector is done */
+    int count, next, left;
+    uint32_t *ids;
+    drmModeConnectorPtr *connectors;
+    uint8_t *done;
+    int abandoned;
+};
+
+/* drop a reference, called under lock, which it releases */
+static void
+ms_probe_unref(struct ms_probe *probe)
+{
+    int i;
+
+    if (--probe->refcnt) {
+        pthread_mutex_unlock(&probe->lock);
+        return;
+    }
+    pthread_mutex_unlock(&probe->lock);
+
+    for (i = 0; i < probe->count; i++)
+        drmModeFreeConnector(probe->connectors[i]);
+    close(probe->pipe[0]);
+    close(probe->pipe[1]);
+    close(probe->fd);
+    pthread_mutex_destroy(&probe->lock);
+    free(probe->connectors);
+    free(probe->done);
+    free(probe->ids);
+    free(probe);
+}
+
+/* probe whatever connectors are left, called under lock */
+static void
+ms_probe_work(struct ms_probe *probe)
+{
+    while (probe->next < probe->count && !probe->abandoned) {
+        int i = probe->next++;
+        drmModeConnectorPtr koutput;
+
+        pthread_mutex_unlock(&probe->lock);
+        koutput = drmModeGetConnector(probe->fd, probe->ids[i]);
+        pthread_mutex_lock(&probe->lock);
+
+        probe->connectors[i] = koutput;
+        probe->done[i] = 1;
+        if (--probe->left == 0) {
+            char c = 0;
+
+            if (write(probe->pipe[1], &c, 1) != 1)
+                probe->abandoned = 1;
+        }
+    }
+}
+
+static void *
+ms_probe_worker(void *data)
+{
+    struct ms_probe *probe = data;
+
+    pthread_mutex_lock(&probe->lock);
+    ms_probe_work(probe);
+    ms_probe_unref(probe);
+
+    return NULL;
+}
+
+/*
+ * Start probing count connectors on up to nthreads threads.  If no thread
+ * can be had the probe is done right here, so the result is the same,
+ * just not sooner.
+ */
+struct ms_probe *
+ms_probe_start(int fd, const uint32_t *connector_ids, int count, int nthreads)
+{
+    struct ms_probe *probe;
+    sigset_t set, old;
+    pthread_t thread;
+    int i, started = 0;
+
+    probe = calloc(1, sizeof(*probe));
+    if (!probe)
+        return NULL;
+
+    probe->ids = malloc(count * sizeof(*probe->ids));
+    probe->connectors = calloc(count, sizeof(*probe->connectors));
+    probe->done = calloc(count, sizeof(*probe->done));
+    probe->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if ((count && (!probe->ids || !probe->connectors || !probe->done)) ||
+        probe->fd < 0 || pipe(probe->pipe) < 0) {
+        if (probe->fd >= 0)
+            close(probe->fd);
+        free(probe->connectors);
+        free(probe->done);
+        free(probe->ids);
+        free(probe);
+        return NULL;
+    }
+    fcntl(probe->pipe[0], F_SETFD, FD_CLOEXEC);
+    fcntl(probe->pipe[1], F_SETFD, FD_CLOEXEC);
+
+    for (i = 0; i < count; i++)
+        probe->ids[i] = connector_ids[i];
+    probe->count = probe->left = count;
+    probe->refcnt = 1;
+    pthread_mutex_init(&probe->lock, NULL);
+
+    if (nthreads > count)
+        nthreads = count;
+
+    /* signals are for the server's main thread, not the workers */
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, &old);
+    pthread_mutex_lock(&probe->lock);
+    for (i = 0; i < nthreads; i++) {
+        if (pthread_create(&thread, NULL, ms_probe_worker, probe))
+            break;
+        pthread_detach(thread);
+        probe->refcnt++;
+        started++;
+    }
+    if (!started)
+        ms_probe_work(probe);
+    pthread_mutex_unlock(&probe->lock);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (!count) {
+        char c = 0;
+
+        if (write(probe->pipe[1], &c, 1) != 1)
+            probe->abandoned = 1;
+    }
+
+    return probe;
+}
+
+/* readable once every connector of the probe is done */
+int
+ms_probe_fd(const struct ms_probe *probe)
+{
+    return probe->pipe[0];
+}
+
+/* wait up to timeout_ms for the probe to finish, 1 if it did */
+int
+ms_probe_wait(struct ms_probe *probe, int timeout_ms)
+{
+    struct pollfd pfd = { .fd = probe->pipe[0], .events = POLLIN };
+    int ret;
+
+    do {
+        ret = poll(&pfd, 1, timeout_ms);
+    } while (ret < 0 && errno == EINTR);
+
+    return ret > 0;
+}
+
+int
+ms_probe_count(const struct ms_probe *probe)
+{
+    return probe->count;
+}
+
+uint32_t
+ms_probe_connector_id(const struct ms_probe *probe, int i)
+{
+    return probe->ids[i];
+}
+
+/*
+ * Hand over connector i if its probe is done, 1 if it was: *koutput is
+ * the caller's then, NULL if the connector couldn't be had.
+ */
+int
+ms_probe_take(struct ms_probe *probe, int i, drmModeConnectorPtr *koutput)
+{
+    int done;
+
+    pthread_mutex_lock(&probe->lock);
+    done = probe->done[i];
+    *koutput = probe->connectors[i];
+    probe->connectors[i] = NULL;
+    pthread_mutex_unlock(&probe->lock);
+
+    return done;
+}
+
+/* done with the probe; workers still in the kernel finish on their own */
+void
+ms_probe_finish(struct ms_probe *probe)
+{
+    if (!probe)
+        return;
+
+    pthread_mutex_lock(&probe->lock);
+    probe->abandoned = 1;
+    ms_probe_unref(probe);
+}
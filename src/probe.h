@@ -0,0 +1,39 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef MS_PROBE_H
+#define MS_PROBE_H
+
+#include <stdint.h>
+#include <xf86drmMode.h>
+
+/* drmModeGetConnector() of a batch of connectors, on a few threads */
+struct ms_probe;
+
+struct ms_probe *ms_probe_start(int fd, const uint32_t *connector_ids,
+                                int count, int nthreads);
+int ms_probe_fd(const struct ms_probe *probe);
+int ms_probe_wait(struct ms_probe *probe, int timeout_ms);
+int ms_probe_count(const struct ms_probe *probe);
+uint32_t ms_probe_connector_id(const struct ms_probe *probe, int i);
+int ms_probe_take(struct ms_probe *probe, int i, drmModeConnectorPtr *koutput);
+void ms_probe_finish(struct ms_probe *probe);
+
+#endif
@@ -0,0 +1,662 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Separable software scaler for 32bpp images, used to stretch the shadow
+ * into a crtc's scanout bo when the display engine can't do a RandR
+ * scale itself.  Upscaling is bilinear, downscaling a box filter.
+ *
+ * Each axis has its weights precomputed for MS_SCALER_PHASES sub-pixel
+ * phases, so the inner loops are nothing but fixed point multiply-adds:
+ * a horizontal pass filters source rows into 16-bit intermediates and a
+ * vertical pass combines those into output pixels.  Large updates are
+ * cut into horizontal bands that the pool's threads scale in parallel.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "scaler.h"
+
+#define MS_SCALER_PHASE_BITS 6
+#define MS_SCALER_PHASES (1 << MS_SCALER_PHASE_BITS)
+
+/* weights are 2.14 fixed point, each set adds up to exactly one */
+#define MS_SCALER_WEIGHT_BITS 14
+#define MS_SCALER_ONE (1 << MS_SCALER_WEIGHT_BITS)
+
+/* intermediates keep 7 fraction bits, so 255 still fits an int16 */
+#define MS_SCALER_HSHIFT (MS_SCALER_WEIGHT_BITS - 7)
+#define MS_SCALER_VSHIFT (MS_SCALER_WEIGHT_BITS + 7)
+
+/* below this many output pixels a band isn't worth waking a thread for */
+#define MS_SCALER_BAND_PIXELS 16384
+
+struct ms_scaler_axis {
+    int src_size, dst_size;
+    int ntaps;                  /* even, padded with zero weights */
+    int *first;                 /* first source pixel of each output pixel */
+    uint8_t *phase;             /* and which weight set it uses */
+    int16_t *weights;           /* MS_SCALER_PHASES sets of ntaps */
+    /* output pixels in [safe_start, safe_end) need no edge clamping */
+    int safe_start, safe_end;
+};
+
+struct ms_scaler {
+    struct ms_scaler_axis x, y;
+};
+
+struct ms_scaler_job {
+    const struct ms_scaler *scaler;
+    const uint8_t *src;
+    int src_pitch;
+    uint8_t *dst;
+    int dst_pitch;
+    int x1, y1, x2, y2;
+    int band_height;
+    int16_t *rows;              /* row cache, row_size per band */
+    size_t row_size;
+};
+
+struct ms_scaler_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t done;
+    pthread_t *threads;
+    int nthreads;
+    int quit;
+    /* the job being worked on, under lock */
+    const struct ms_scaler_job *job;
+    int next_band, nbands, bands_left;
+};
+
+static inline int
+ms_scaler_clamp(int v, int lo, int hi)
+{
+    return v < lo ? lo : v > hi ? hi : v;
+}
+
+static inline int
+ms_scaler_floor(double v)
+{
+    int i = (int) v;
+
+    return i > v ? i - 1 : i;
+}
+
+/* round a set of weights to fixed point without changing their sum */
+static void
+ms_scaler_quantize(int16_t *out, const double *w, int ntaps)
+{
+    int t, sum = 0, big = 0;
+
+    for (t = 0; t < ntaps; t++) {
+        out[t] = (int16_t) (w[t] * MS_SCALER_ONE + 0.5);
+        sum += out[t];
+        if (w[t] > w[big])
+            big = t;
+    }
+    out[big] += MS_SCALER_ONE - sum;
+}
+
+static void
+ms_scaler_axis_fini(struct ms_scaler_axis *ax)
+{
+    free(ax->first);
+    free(ax->phase);
+    free(ax->weights);
+}
+
+static int
+ms_scaler_axis_init(struct ms_scaler_axis *ax, int src_size, int dst_size)
+{
+    double ratio = (double) src_size / dst_size;
+    int box = ratio > 1.0;
+    double w[MS_SCALER_MAX_TAPS];
+    int i, p, t;
+
+    ax->src_size = src_size;
+    ax->dst_size = dst_size;
+    /* a box ratio wide can straddle one more source pixel than it covers */
+    ax->ntaps = box ? (int) ratio + (ratio > (int) ratio) + 1 : 2;
+    ax->ntaps = (ax->ntaps + 1) & ~1;
+    if (ax->ntaps > MS_SCALER_MAX_TAPS)
+        return 0;
+
+    ax->first = malloc(dst_size * sizeof(*ax->first));
+    ax->phase = malloc(dst_size * sizeof(*ax->phase));
+    ax->weights = malloc(MS_SCALER_PHASES * ax->ntaps *
+                         sizeof(*ax->weights));
+    if (!ax->first || !ax->phase || !ax->weights) {
+        ms_scaler_axis_fini(ax);
+        return 0;
+    }
+
+    for (p = 0; p < MS_SCALER_PHASES; p++) {
+        double frac = (double) p / MS_SCALER_PHASES;
+
+        for (t = 0; t < ax->ntaps; t++) {
+            if (box) {
+                /* how much of [frac, frac + ratio) source pixel t covers */
+                double lo = t > frac ? t : frac;
+                double hi = t + 1 < frac + ratio ? t + 1 : frac + ratio;
+
+                w[t] = hi > lo ? (hi - lo) / ratio : 0;
+            } else
+                w[t] = t == 0 ? 1 - frac : t == 1 ? frac : 0;
+        }
+        ms_scaler_quantize(ax->weights + p * ax->ntaps, w, ax->ntaps);
+    }
+
+    /*
+     * Box output pixel i averages source [i * ratio, (i + 1) * ratio);
+     * bilinear samples between the two source centres around its own.
+     */
+    for (i = 0; i < dst_size; i++) {
+        double pos = box ? i * ratio : (i + 0.5) * ratio - 0.5;
+        int first = ms_scaler_floor(pos);
+        int phase = (int) ((pos - first) * MS_SCALER_PHASES + 0.5);
+
+        if (phase == MS_SCALER_PHASES) {
+            first++;
+            phase = 0;
+        }
+        ax->first[i] = first;
+        ax->phase[i] = phase;
+    }
+
+    ax->safe_start = 0;
+    while (ax->safe_start < dst_size && ax->first[ax->safe_start] < 0)
+        ax->safe_start++;
+    ax->safe_end = dst_size;
+    while (ax->safe_end > ax->safe_start &&
+           ax->first[ax->safe_end - 1] + ax->ntaps > src_size)
+        ax->safe_end--;
+
+    return 1;
+}
+
+/* the first output pixel whose first tap is at or past source pixel pos */
+static int
+ms_scaler_axis_lower_bound(const struct ms_scaler_axis *ax, int pos)
+{
+    int lo = 0, hi = ax->dst_size;
+
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+
+        if (ax->first[mid] < pos)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/* turn source span [*p1, *p2) into the output span whose taps touch it */
+static void
+ms_scaler_axis_span(const struct ms_scaler_axis *ax, int *p1, int *p2)
+{
+    int s1 = *p1, s2 = *p2;
+
+    if (s2 <= s1) {
+        *p1 = *p2 = 0;
+        return;
+    }
+    /* edge pixels are clamped, so the border reaches beyond its taps */
+    *p1 = s1 <= 0 ? 0 : ms_scaler_axis_lower_bound(ax, s1 - ax->ntaps + 1);
+    *p2 = s2 >= ax->src_size ? ax->dst_size :
+        ms_scaler_axis_lower_bound(ax, s2);
+}
+
+/* horizontal filter for one output pixel near the edge, taps clamped */
+static void
+ms_scaler_hpixel_clamped(const struct ms_scaler_axis *ax,
+                         const uint32_t *src, int16_t *out, int x)
+{
+    const int16_t *w = ax->weights + ax->phase[x] * ax->ntaps;
+    int32_t acc[4] = { 0, 0, 0, 0 };
+    int t, c;
+
+    for (t = 0; t < ax->ntaps; t++) {
+        uint32_t p = src[ms_scaler_clamp(ax->first[x] + t, 0,
+                                         ax->src_size - 1)];
+
+        for (c = 0; c < 4; c++)
+            acc[c] += w[t] * (int32_t) ((p >> (8 * c)) & 0xff);
+    }
+    for (c = 0; c < 4; c++)
+        out[c] = (acc[c] + (1 << (MS_SCALER_HSHIFT - 1))) >>
+            MS_SCALER_HSHIFT;
+}
+
+#ifdef __SSE2__
+
+/* two taps' weights, paired up for pmaddwd */
+static inline __m128i
+ms_scaler_weight_pair(const int16_t *w)
+{
+    return _mm_set1_epi32((uint16_t) w[0] | (uint32_t) (uint16_t) w[1] << 16);
+}
+
+static void
+ms_scaler_hspan(const struct ms_scaler_axis *ax, const uint32_t *src,
+                int16_t *out, int x1, int x2)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i round = _mm_set1_epi32(1 << (MS_SCALER_HSHIFT - 1));
+    int x, t;
+
+    for (x = x1; x < x2; x++, out += 4) {
+        const uint32_t *p = src + ax->first[x];
+        const int16_t *w = ax->weights + ax->phase[x] * ax->ntaps;
+        __m128i acc = round;
+
+        for (t = 0; t < ax->ntaps; t += 2) {
+            /* b0 b1 g0 g1 r0 r1 x0 x1, widened to 16 bits */
+            __m128i px = _mm_unpacklo_epi8(_mm_cvtsi32_si128(p[t]),
+                                           _mm_cvtsi32_si128(p[t + 1]));
+
+            px = _mm_unpacklo_epi8(px, zero);
+            acc = _mm_add_epi32(acc, _mm_madd_epi16(px,
+                                                    ms_scaler_weight_pair(w + t)));
+        }
+        acc = _mm_srai_epi32(acc, MS_SCALER_HSHIFT);
+        _mm_storel_epi64((__m128i *) out, _mm_packs_epi32(acc, acc));
+    }
+}
+
+static void
+ms_scaler_vspan(const int16_t *const *rows, const int16_t *w, int ntaps,
+                uint32_t *dst, int width)
+{
+    const __m128i round = _mm_set1_epi32(1 << (MS_SCALER_VSHIFT - 1));
+    __m128i wv[MS_SCALER_MAX_TAPS / 2];
+    int x, t;
+
+    for (t = 0; t < ntaps; t += 2)
+        wv[t / 2] = ms_scaler_weight_pair(w + t);
+
+    /* two pixels at a time, each pmaddwd folds two rows together */
+    for (x = 0; x + 2 <= width; x += 2) {
+        __m128i acc0 = round, acc1 = round;
+
+        for (t = 0; t < ntaps; t += 2) {
+            __m128i a = _mm_loadu_si128((const __m128i *) (rows[t] + 4 * x));
+            __m128i b = _mm_loadu_si128((const __m128i *) (rows[t + 1] +
+                                                           4 * x));
+
+            acc0 = _mm_add_epi32(acc0, _mm_madd_epi16(_mm_unpacklo_epi16(a, b),
+                                                      wv[t / 2]));
+            acc1 = _mm_add_epi32(acc1, _mm_madd_epi16(_mm_unpackhi_epi16(a, b),
+                                                      wv[t / 2]));
+        }
+        acc0 = _mm_packs_epi32(_mm_srai_epi32(acc0, MS_SCALER_VSHIFT),
+                               _mm_srai_epi32(acc1, MS_SCALER_VSHIFT));
+        _mm_storel_epi64((__m128i *) (dst + x),
+                         _mm_packus_epi16(acc0, acc0));
+    }
+
+    if (x < width) {
+        __m128i acc = round;
+
+        for (t = 0; t < ntaps; t += 2) {
+            __m128i a = _mm_loadl_epi64((const __m128i *) (rows[t] + 4 * x));
+            __m128i b = _mm_loadl_epi64((const __m128i *) (rows[t + 1] +
+                                                           4 * x));
+
+            acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_unpacklo_epi16(a, b),
+                                                    wv[t / 2]));
+        }
+        acc = _mm_srai_epi32(acc, MS_SCALER_VSHIFT);
+        acc = _mm_packs_epi32(acc, acc);
+        dst[x] = _mm_cvtsi128_si32(_mm_packus_epi16(acc, acc));
+    }
+}
+
+#else
+
+static void
+ms_scaler_hspan(const struct ms_scaler_axis *ax, const uint32_t *src,
+                int16_t *out, int x1, int x2)
+{
+    int x, t, c;
+
+    for (x = x1; x < x2; x++, out += 4) {
+        const uint32_t *p = src + ax->first[x];
+        const int16_t *w = ax->weights + ax->phase[x] * ax->ntaps;
+        int32_t acc[4] = { 0, 0, 0, 0 };
+
+        for (t = 0; t < ax->ntaps; t++)
+            for (c = 0; c < 4; c++)
+                acc[c] += w[t] * (int32_t) ((p[t] >> (8 * c)) & 0xff);
+        for (c = 0; c < 4; c++)
+            out[c] = (acc[c] + (1 << (MS_SCALER_HSHIFT - 1))) >>
+                MS_SCALER_HSHIFT;
+    }
+}
+
+static void
+ms_scaler_vspan(const int16_t *const *rows, const int16_t *w, int ntaps,
+                uint32_t *dst, int width)
+{
+    int x, t, c;
+
+    for (x = 0; x < width; x++) {
+        uint32_t p = 0;
+
+        for (c = 0; c < 4; c++) {
+            int32_t acc = 1 << (MS_SCALER_VSHIFT - 1);
+
+            for (t = 0; t < ntaps; t++)
+                acc += w[t] * rows[t][4 * x + c];
+            p |= (uint32_t) ms_scaler_clamp(acc >> MS_SCALER_VSHIFT,
+                                            0, 255) << (8 * c);
+        }
+        dst[x] = p;
+    }
+}
+
+#endif
+
+/* filter source row src horizontally into out, for outputs [x1, x2) */
+static void
+ms_scaler_hrow(const struct ms_scaler_axis *ax, const uint32_t *src,
+               int16_t *out, int x1, int x2)
+{
+    int lo = ms_scaler_clamp(ax->safe_start, x1, x2);
+    int hi = ms_scaler_clamp(ax->safe_end, lo, x2);
+    int x;
+
+    for (x = x1; x < lo; x++)
+        ms_scaler_hpixel_clamped(ax, src, out + 4 * (x - x1), x);
+    ms_scaler_hspan(ax, src, out + 4 * (lo - x1), lo, hi);
+    for (x = hi; x < x2; x++)
+        ms_scaler_hpixel_clamped(ax, src, out + 4 * (x - x1), x);
+}
+
+/*
+ * Scale output rows [y1, y2).  Filtered source rows are cached in rows,
+ * one slot per tap: consecutive output rows mostly share their taps.
+ */
+static void
+ms_scaler_band(const struct ms_scaler_job *job, int16_t *rows, int y1, int y2)
+{
+    const struct ms_scaler *s = job->scaler;
+    const struct ms_scaler_axis *ay = &s->y;
+    int width = job->x2 - job->x1;
+    const int16_t *taps[MS_SCALER_MAX_TAPS];
+    int cached[MS_SCALER_MAX_TAPS];
+    int y, t;
+
+    for (t = 0; t < ay->ntaps; t++)
+        cached[t] = -1;
+
+    for (y = y1; y < y2; y++) {
+        for (t = 0; t < ay->ntaps; t++) {
+            int sy = ms_scaler_clamp(ay->first[y] + t, 0, ay->src_size - 1);
+            int slot = sy % ay->ntaps;
+            int16_t *row = rows + (size_t) slot * width * 4;
+
+            if (cached[slot] != sy) {
+                ms_scaler_hrow(&s->x, (const uint32_t *)
+                               (job->src + (size_t) sy * job->src_pitch),
+                               row, job->x1, job->x2);
+                cached[slot] = sy;
+            }
+            taps[t] = row;
+        }
+        ms_scaler_vspan(taps, ay->weights + ay->phase[y] * ay->ntaps,
+                        ay->ntaps, (uint32_t *)
+                        (job->dst + (size_t) y * job->dst_pitch) + job->x1,
+                        width);
+    }
+}
+
+/* scale whatever bands of the current job are left, called under lock */
+static void
+ms_scaler_pool_work(struct ms_scaler_pool *pool)
+{
+    while (pool->job && pool->next_band < pool->nbands) {
+        const struct ms_scaler_job *job = pool->job;
+        int band = pool->next_band++;
+        int y1 = job->y1 + band * job->band_height;
+        int y2 = y1 + job->band_height;
+
+        if (y2 > job->y2)
+            y2 = job->y2;
+
+        pthread_mutex_unlock(&pool->lock);
+        ms_scaler_band(job, job->rows + band * job->row_size, y1, y2);
+        pthread_mutex_lock(&pool->lock);
+
+        if (--pool->bands_left == 0)
+            pthread_cond_signal(&pool->done);
+    }
+}
+
+static void *
+ms_scaler_worker(void *data)
+{
+    struct ms_scaler_pool *pool = data;
+
+    pthread_mutex_lock(&pool->lock);
+    while (!pool->quit) {
+        ms_scaler_pool_work(pool);
+        if (!pool->quit)
+            pthread_cond_wait(&pool->work, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+/*
+ * A pool of nthreads workers; the calling thread always scales bands as
+ * well, so 0 is a valid pool that just doesn't run anything in parallel.
+ */
+struct ms_scaler_pool *
+ms_scaler_pool_create(int nthreads)
+{
+    struct ms_scaler_pool *pool;
+    sigset_t set, old;
+    int i;
+
+    pool = calloc(1, sizeof(*pool));
+    if (!pool)
+        return NULL;
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->done, NULL);
+
+    if (nthreads > 0)
+        pool->threads = calloc(nthreads, sizeof(*pool->threads));
+    if (!pool->threads)
+        return pool;
+
+    /* signals are for the server's main thread, not the workers */
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, &old);
+    for (i = 0; i < nthreads; i++) {
+        if (pthread_create(&pool->threads[i], NULL, ms_scaler_worker, pool))
+            break;
+    }
+    pool->nthreads = i;
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    return pool;
+}
+
+void
+ms_scaler_pool_destroy(struct ms_scaler_pool *pool)
+{
+    int i;
+
+    if (!pool)
+        return;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = 1;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (i = 0; i < pool->nthreads; i++)
+        pthread_join(pool->threads[i], NULL);
+
+    pthread_cond_destroy(&pool->done);
+    pthread_cond_destroy(&pool->work);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->threads);
+    free(pool);
+}
+
+struct ms_scaler *
+ms_scaler_create(int src_w, int src_h, int dst_w, int dst_h)
+{
+    struct ms_scaler *scaler;
+
+    if (src_w <= 0 || src_h <= 0 || dst_w <= 0 || dst_h <= 0)
+        return NULL;
+
+    scaler = calloc(1, sizeof(*scaler));
+    if (!scaler)
+        return NULL;
+
+    if (!ms_scaler_axis_init(&scaler->x, src_w, dst_w)) {
+        free(scaler);
+        return NULL;
+    }
+    if (!ms_scaler_axis_init(&scaler->y, src_h, dst_h)) {
+        ms_scaler_axis_fini(&scaler->x);
+        free(scaler);
+        return NULL;
+    }
+
+    return scaler;
+}
+
+void
+ms_scaler_destroy(struct ms_scaler *scaler)
+{
+    if (!scaler)
+        return;
+
+    ms_scaler_axis_fini(&scaler->x);
+    ms_scaler_axis_fini(&scaler->y);
+    free(scaler);
+}
+
+void
+ms_scaler_src_size(const struct ms_scaler *scaler, int *w, int *h)
+{
+    *w = scaler->x.src_size;
+    *h = scaler->y.src_size;
+}
+
+/*
+ * Map a damaged source box onto the output box that has to be redone:
+ * every output pixel whose filter footprint reaches into it.
+ */
+void
+ms_scaler_dst_box(const struct ms_scaler *scaler,
+                  int *x1, int *y1, int *x2, int *y2)
+{
+    ms_scaler_axis_span(&scaler->x, x1, x2);
+    ms_scaler_axis_span(&scaler->y, y1, y2);
+}
+
+/*
+ * Scale the output box [x1, x2) x [y1, y2) from src into dst, both
+ * 32bpp; src is the top left of the source rectangle.  Returns 0 if
+ * there was no memory for the row cache.
+ */
+int
+ms_scaler_run(struct ms_scaler_pool *pool, const struct ms_scaler *scaler,
+              const void *src, int src_pitch, void *dst, int dst_pitch,
+              int x1, int y1, int x2, int y2)
+{
+    struct ms_scaler_job job;
+    int width, height, nbands = 1;
+
+    x1 = ms_scaler_clamp(x1, 0, scaler->x.dst_size);
+    x2 = ms_scaler_clamp(x2, x1, scaler->x.dst_size);
+    y1 = ms_scaler_clamp(y1, 0, scaler->y.dst_size);
+    y2 = ms_scaler_clamp(y2, y1, scaler->y.dst_size);
+    width = x2 - x1;
+    height = y2 - y1;
+    if (!width || !height)
+        return 1;
+
+    if (pool && pool->nthreads) {
+        nbands = width * height / MS_SCALER_BAND_PIXELS;
+        if (nbands > pool->nthreads + 1)
+            nbands = pool->nthreads + 1;
+        if (nbands > height)
+            nbands = height;
+        if (nbands < 1)
+            nbands = 1;
+    }
+
+    job.scaler = scaler;
+    job.src = src;
+    job.src_pitch = src_pitch;
+    job.dst = dst;
+    job.dst_pitch = dst_pitch;
+    job.x1 = x1;
+    job.y1 = y1;
+    job.x2 = x2;
+    job.y2 = y2;
+    job.band_height = (height + nbands - 1) / nbands;
+    nbands = (height + job.band_height - 1) / job.band_height;
+    job.row_size = (size_t) scaler->y.ntaps * width * 4;
+    job.rows = malloc(nbands * job.row_size * sizeof(*job.rows));
+    if (!job.rows)
+        return 0;
+
+    if (nbands == 1) {
+        ms_scaler_band(&job, job.rows, y1, y2);
+    } else {
+        pthread_mutex_lock(&pool->lock);
+        pool->job = &job;
+        pool->next_band = 0;
+        pool->nbands = nbands;
+        pool->bands_left = nbands;
+        pthread_cond_broadcast(&pool->work);
+
+        ms_scaler_pool_work(pool);
+        while (pool->bands_left)
+            pthread_cond_wait(&pool->done, &pool->lock);
+        pool->job = NULL;
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    free(job.rows);
+    return 1;
+}
@@ -0,0 +1,47 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef MS_SCALER_H
+#define MS_SCALER_H
+
+#include <stdint.h>
+
+/* the most source pixels one output pixel is filtered from, per axis */
+#define MS_SCALER_MAX_TAPS 16
+
+/* filter tables for scaling one src_w x src_h 32bpp image to dst_w x dst_h */
+struct ms_scaler;
+/* worker threads that scale horizontal bands of the output in parallel */
+struct ms_scaler_pool;
+
+struct ms_scaler_pool *ms_scaler_pool_create(int nthreads);
+void ms_scaler_pool_destroy(struct ms_scaler_pool *pool);
+
+struct ms_scaler *ms_scaler_create(int src_w, int src_h, int dst_w, int dst_h);
+void ms_scaler_destroy(struct ms_scaler *scaler);
+void ms_scaler_src_size(const struct ms_scaler *scaler, int *w, int *h);
+
+void ms_scaler_dst_box(const struct ms_scaler *scaler,
+                       int *x1, int *y1, int *x2, int *y2);
+int ms_scaler_run(struct ms_scaler_pool *pool, const struct ms_scaler *scaler,
+                  const void *src, int src_pitch, void *dst, int dst_pitch,
+                  int x1, int y1, int x2, int y2);
+
+#endif
@@ -0,0 +1,368 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * DRM event plumbing: vblank and page flip events are tagged with a
+ * sequence number from a small queue, which maps them back to the crtc
+ * and the callback that asked for them.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "xf86.h"
+#include "xf86Crtc.h"
+#include "driver.h"
+
+struct ms_drm_queue {
+    struct ms_drm_queue *next;
+    uint32_t seq;
+    void *data;
+    ScrnInfoPtr scrn;
+    xf86CrtcPtr crtc;
+    ms_drm_handler_proc handler;
+    ms_drm_abort_proc abort;
+};
+
+static struct ms_drm_queue *ms_drm_queue;
+static uint32_t ms_drm_seq;
+
+/*
+ * Convert a 32-bit kernel vblank sequence into the 64-bit msc the crtc
+ * has been counting, carrying the wrap over into the high half.
+ */
+uint64_t
+ms_kernel_msc_to_crtc_msc(xf86CrtcPtr crtc, uint32_t sequence)
+{
+    drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+
+    if (sequence < drmmode_crtc->msc_prev &&
+        drmmode_crtc->msc_prev - sequence > 0x40000000)
+        drmmode_crtc->msc_high += 0x100000000ULL;
+    drmmode_crtc->msc_prev = sequence;
+    return drmmode_crtc->msc_high + sequence;
+}
+
+/* the DRM_VBLANK_* crtc selection bits for drmWaitVBlank */
+uint32_t
+ms_crtc_vblank_pipe(int crtc_index)
+{
+    if (crtc_index > 1)
+        return (crtc_index << DRM_VBLANK_HIGH_CRTC_SHIFT) &
+            DRM_VBLANK_HIGH_CRTC_MASK;
+    else if (crtc_index > 0)
+        return DRM_VBLANK_SECONDARY;
+    else
+        return 0;
+}
+
+uint32_t
+ms_crtc_msc_to_kernel_msc(xf86CrtcPtr crtc, uint64_t expect)
+{
+    drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+
+    return (uint32_t) (expect - drmmode_crtc->msc_high);
+}
+
+int
+ms_get_crtc_ust_msc(xf86CrtcPtr crtc, CARD64 *ust, CARD64 *msc)
+{
+    drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+    drmmode_ptr drmmode = drmmode_crtc->drmmode;
+    drmVBlank vbl;
+
+    vbl.request.type = DRM_VBLANK_RELATIVE | drmmode_crtc->vblank_pipe;
+    vbl.request.sequence = 0;
+    vbl.request.signal = 0;
+    if (drmWaitVBlank(drmmode->fd, &vbl))
+        return BadMatch;
+
+    *ust = (CARD64) vbl.reply.tval_sec * 1000000 + vbl.reply.tval_usec;
+    *msc = ms_kernel_msc_to_crtc_msc(crtc, vbl.reply.sequence);
+    return Success;
+}
+
+static void
+ms_crtc_box(xf86CrtcPtr crtc, BoxPtr box)
+{
+    if (crtc->enabled) {
+        box->x1 = crtc->x;
+        box->y1 = crtc->y;
+        box->x2 = crtc->x + xf86ModeWidth(&crtc->mode, crtc->rotation);
+        box->y2 = crtc->y + xf86ModeHeight(&crtc->mode, crtc->rotation);
+    } else
+        box->x1 = box->x2 = box->y1 = box->y2 = 0;
+}
+
+static int
+ms_box_intersect_area(BoxPtr a, BoxPtr b)
+{
+    int w = min(a->x2, b->x2) - max(a->x1, b->x1);
+    int h = min(a->y2, b->y2) - max(a->y1, b->y1);
+
+    if (w <= 0 || h <= 0)
+        return 0;
+    return w * h;
+}
+
+/* the enabled crtc showing most of box, or NULL if none shows any of it */
+xf86CrtcPtr
+ms_covering_crtc(ScrnInfoPtr scrn, BoxPtr box)
+{
+    xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(scrn);
+    xf86CrtcPtr best_crtc = NULL;
+    int best_coverage = 0;
+    int c;
+
+    for (c = 0; c < xf86_config->num_crtc; c++) {
+        xf86CrtcPtr crtc = xf86_config->crtc[c];
+        BoxRec crtc_box;
+        int coverage;
+
+        ms_crtc_box(crtc, &crtc_box);
+        coverage = ms_box_intersect_area(&crtc_box, box);
+        if (coverage > best_coverage) {
+            best_crtc = crtc;
+            best_coverage = coverage;
+        }
+    }
+
+    return best_crtc;
+}
+
+/*
+ * Enqueue a callback for a vblank or flip event on crtc.  The returned
+ * sequence goes to the kernel as the event's user data; 0 means failure.
+ */
+uint32_t
+ms_drm_queue_alloc(xf86CrtcPtr crtc, void *data,
+                   ms_drm_handler_proc handler, ms_drm_abort_proc abort)
+{
+    struct ms_drm_queue *q;
+
+    q = calloc(1, sizeof(*q));
+    if (!q)
+        return 0;
+
+    if (!ms_drm_seq)
+        ++ms_drm_seq;
+    q->seq = ms_drm_seq++;
+    q->scrn = crtc->scrn;
+    q->crtc = crtc;
+    q->data = data;
+    q->handler = handler;
+    q->abort = abort;
+
+    q->next = ms_drm_queue;
+    ms_drm_queue = q;
+
+    return q->seq;
+}
+
+static struct ms_drm_queue *
+ms_drm_queue_unlink(struct ms_drm_queue **link)
+{
+    struct ms_drm_queue *q = *link;
+
+    *link = q->next;
+    return q;
+}
+
+/* drop all outstanding events for scrn, e.g. when the screen goes away */
+static void
+ms_drm_abort_scrn(ScrnInfoPtr scrn)
+{
+    struct ms_drm_queue **link = &ms_drm_queue;
+
+    while (*link) {
+        if ((*link)->scrn == scrn) {
+            struct ms_drm_queue *q = ms_drm_queue_unlink(link);
+
+            q->abort(q->data);
+            free(q);
+        } else
+            link = &(*link)->next;
+    }
+}
+
+/*
+ * Abort the first outstanding event on scrn that was queued with handler
+ * and whose data matches; the handler tells apart whose data it is.
+ */
+void
+ms_drm_abort(ScrnInfoPtr scrn, ms_drm_handler_proc handler,
+             Bool (*match)(void *data, void *match_data), void *match_data)
+{
+    struct ms_drm_queue **link;
+
+    for (link = &ms_drm_queue; *link; link = &(*link)->next) {
+        if ((*link)->scrn == scrn && (*link)->handler == handler &&
+            match((*link)->data, match_data)) {
+            struct ms_drm_queue *q = ms_drm_queue_unlink(link);
+
+            q->abort(q->data);
+            free(q);
+            return;
+        }
+    }
+}
+
+/* abort an event that never made it to the kernel */
+void
+ms_drm_abort_seq(ScrnInfoPtr scrn, uint32_t seq)
+{
+    struct ms_drm_queue **link;
+
+    for (link = &ms_drm_queue; *link; link = &(*link)->next) {
+        if ((*link)->scrn == scrn && (*link)->seq == seq) {
+            struct ms_drm_queue *q = ms_drm_queue_unlink(link);
+
+            q->abort(q->data);
+            free(q);
+            return;
+        }
+    }
+}
+
+/*
+ * Run the callback queued under seq.  A non-zero crtc_id only accepts the
+ * event from that crtc: an atomic commit flipping several crtcs at once
+ * sends one event per crtc under the same seq, and msc has to come from
+ * the one the callback was queued on.
+ */
+static void
+ms_drm_dispatch(uint32_t seq, uint32_t crtc_id, uint32_t frame,
+                uint32_t sec, uint32_t usec)
+{
+    struct ms_drm_queue **link;
+
+    for (link = &ms_drm_queue; *link; link = &(*link)->next) {
+        if ((*link)->seq == seq) {
+            drmmode_crtc_private_ptr drmmode_crtc =
+                (*link)->crtc->driver_private;
+            struct ms_drm_queue *q;
+
+            if (crtc_id && drmmode_crtc->mode_crtc->crtc_id != crtc_id)
+                return;
+
+            q = ms_drm_queue_unlink(link);
+            q->handler(ms_kernel_msc_to_crtc_msc(q->crtc, frame),
+                       (uint64_t) sec * 1000000 + usec, q->data);
+            free(q);
+            return;
+        }
+    }
+}
+
+/* common handler for vblank and page flip events */
+static void
+ms_drm_handler(int fd, uint32_t frame, uint32_t sec, uint32_t usec,
+               void *user_ptr)
+{
+    ms_drm_dispatch((uint32_t) (uintptr_t) user_ptr, 0, frame, sec, usec);
+}
+
+#if DRM_EVENT_CONTEXT_VERSION >= 3
+static void
+ms_drm_flip_handler(int fd, uint32_t frame, uint32_t sec, uint32_t usec,
+                    uint32_t crtc_id, void *user_ptr)
+{
+    ms_drm_dispatch((uint32_t) (uintptr_t) user_ptr, crtc_id,
+                    frame, sec, usec);
+}
+#endif
+
+/*
+ * Handle DRM events that have already arrived, without blocking.
+ * Returns 1 if some were handled, 0 if there were none, -1 on error.
+ */
+int
+ms_flush_drm_events(ScreenPtr screen)
+{
+    modesettingPtr ms = modesettingPTR(xf86ScreenToScrn(screen));
+    struct pollfd p = { .fd = ms->fd, .events = POLLIN };
+    int r;
+
+    do {
+        r = poll(&p, 1, 0);
+    } while (r == -1 && (errno == EINTR || errno == EAGAIN));
+
+    if (r <= 0)
+        return r;
+
+    return drmHandleEvent(ms->fd, &ms->drmmode.event_context) >= 0 ? 1 : -1;
+}
+
+static void
+ms_drm_socket_handler(int fd, void *data)
+{
+    ScreenPtr screen = data;
+    modesettingPtr ms = modesettingPTR(xf86ScreenToScrn(screen));
+
+    drmHandleEvent(fd, &ms->drmmode.event_context);
+}
+
+Bool
+ms_vblank_screen_init(ScreenPtr screen)
+{
+    ScrnInfoPtr scrn = xf86ScreenToScrn(screen);
+    modesettingPtr ms = modesettingPTR(scrn);
+    drmmode_ptr drmmode = &ms->drmmode;
+
+    drmmode->event_context.version = 2;
+    drmmode->event_context.vblank_handler = ms_drm_handler;
+    drmmode->event_context.page_flip_handler = ms_drm_handler;
+#if DRM_EVENT_CONTEXT_VERSION >= 3
+    /* version 3 flip events say which crtc they are for */
+    drmmode->event_context.version = 3;
+    drmmode->event_context.page_flip_handler2 = ms_drm_flip_handler;
+#endif
+
+    ms->drm_event_handler = xf86AddGeneralHandler(ms->fd,
+                                                  ms_drm_socket_handler,
+                                                  screen);
+    if (!ms->drm_event_handler) {
+        xf86DrvMsg(scrn->scrnIndex, X_ERROR,
+                   "Failed to register DRM event handler\n");
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+void
+ms_vblank_close_screen(ScreenPtr screen)
+{
+    ScrnInfoPtr scrn = xf86ScreenToScrn(screen);
+    modesettingPtr ms = modesettingPTR(scrn);
+
+    ms_drm_abort_scrn(scrn);
+
+    if (ms->drm_event_handler) {
+        xf86RemoveGeneralHandler(ms->drm_event_handler);
+        ms->drm_event_handler = NULL;
+    }
+}